@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2006, Russell Bryant <russell@russellbryant.net> 
+ *
+ * This file is part of LibIAX2xx.
+ *
+ * LibIAX2xx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * LibIAX2xx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LibIAX2xx; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*!
+ * \file
+ * \author Russell Bryant <russell@russellbryant.net>
+ *
+ * \brief IAX2 alert descriptor definitions
+ */
+
+#ifndef IAX2_ALERT_H
+#define IAX2_ALERT_H
+
+/*!
+ * \brief A file descriptor that one thread makes readable to wake up another
+ *
+ * This is an eventfd where it is available, and a non-blocking pipe
+ * everywhere else.  The callers are expected to keep track of whether it has
+ * already been signalled, so that it is written to at most once per wakeup.
+ */
+class iax2_alert {
+public:
+	iax2_alert(void);
+	~iax2_alert(void);
+
+	/*!
+	 * \brief Create the file descriptor
+	 *
+	 * \retval 0 success
+	 * \retval -1 failure
+	 */
+	int open(void);
+
+	/*!
+	 * \brief Get the descriptor to wait on
+	 */
+	inline int get_fd(void) const
+		{ return fds[0]; }
+
+	/*!
+	 * \brief Make the descriptor readable
+	 */
+	void signal(void);
+
+	/*!
+	 * \brief Make the descriptor no longer readable
+	 */
+	void clear(void);
+
+private:
+	/*! The read and write ends, which are the same for an eventfd */
+	int fds[2];
+};
+
+#endif /* IAX2_ALERT_H */
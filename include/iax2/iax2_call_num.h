@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2006, Russell Bryant <russell@russellbryant.net> 
+ *
+ * This file is part of LibIAX2xx.
+ *
+ * LibIAX2xx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * LibIAX2xx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LibIAX2xx; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*!
+ * \file
+ * \author Russell Bryant <russell@russellbryant.net>
+ *
+ * \brief IAX2 call number allocation definitions
+ */
+
+#ifndef IAX2_CALL_NUM_H
+#define IAX2_CALL_NUM_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+/*! The number of distinct IAX2 call numbers (they are 15 bits) */
+#define IAX2_MAX_CALL_NUMS 32768
+
+/*!
+ * \brief How long a released call number is kept out of use, in milliseconds
+ *
+ * Frames for the old call can still arrive for a while after it ends, such
+ * as retransmissions from the other side.  They must not be taken for frames
+ * of a new call that happens to get the same number.
+ */
+#define IAX2_CALL_NUM_QUARANTINE 10000
+
+/*!
+ * \brief A released call number waiting to be used again
+ */
+struct iax2_quarantined_call_num {
+	unsigned short num;
+	/*! When it can be used again, in milliseconds since the allocator was made */
+	unsigned int expires;
+};
+
+/*!
+ * \brief Hands out call numbers that are not in use
+ *
+ * There is one bit per call number, set while the number is in use or in
+ * quarantine.  alloc() claims a clear bit with a compare-and-swap, so it can
+ * be called from any thread without a lock.  A released number is only
+ * cleared after IAX2_CALL_NUM_QUARANTINE.
+ *
+ * release() and expire() must only be called from the thread running the
+ * peer.
+ */
+class iax2_call_num_allocator {
+public:
+	iax2_call_num_allocator(void);
+	~iax2_call_num_allocator(void);
+
+	/*!
+	 * \brief Set the range of call numbers to hand out
+	 *
+	 * The default is every call number but 0.  This MUST be called before
+	 * any number is handed out.
+	 */
+	void set_range(unsigned short first, unsigned short last);
+
+	/*!
+	 * \brief Claim a free call number
+	 *
+	 * \return the call number, or 0 if every number in the range is in use
+	 */
+	unsigned short alloc(void);
+
+	/*!
+	 * \brief Give back a call number once its dialog is gone
+	 *
+	 * It is put in quarantine, and can be handed out again after
+	 * IAX2_CALL_NUM_QUARANTINE.
+	 */
+	void release(unsigned short num);
+
+	/*!
+	 * \brief Make the call numbers whose quarantine is over free again
+	 */
+	void expire(void);
+
+private:
+	unsigned int now(void) const;
+
+	/*! One bit per call number, set if it is taken */
+	volatile unsigned long bits[IAX2_MAX_CALL_NUMS / (8 * sizeof(unsigned long))];
+	/*! The words of bits that cover the range */
+	unsigned int first_word;
+	unsigned int num_words;
+	/*! The word alloc() starts looking in */
+	volatile unsigned int next_word;
+
+	/*! Released call numbers in the order they were released */
+	iax2_quarantined_call_num *quarantine;
+	unsigned int quarantine_head;
+	unsigned int quarantine_count;
+	struct timeval start;
+};
+
+#endif /* IAX2_CALL_NUM_H */
@@ -30,6 +30,8 @@
 #ifndef IAX2_COMMAND_H
 #define IAX2_COMMAND_H
 
+#include "iax2/iax2_mpsc_queue.h"
+
 /*!
  * \brief Commands that can be passed to an iax2_command_handler
  */
@@ -58,6 +60,15 @@ enum iax2_command_type {
 	 * milliseconds.
 	 */
 	IAX2_COMMAND_TYPE_LAGRQ,
+	/*!
+	 * \brief Turn the jitter buffer of a call on or off
+	 *
+	 * The payload is a uint, the number of milliseconds of audio in each
+	 * frame, or 0 to turn the jitter buffer off.  While it is on, received
+	 * audio is held in the jitter buffer instead of being passed up as
+	 * events, and the application takes it with iax2_peer::get_audio().
+	 */
+	IAX2_COMMAND_TYPE_JITTERBUFFER,
 	/*! Shutdown the peer, causing the run() funciton to return. */
 	IAX2_COMMAND_TYPE_SHUTDOWN,
 };
@@ -78,8 +89,11 @@ enum iax2_command_payload_type {
 
 /*!
  * \brief IAX2 command
+ *
+ * Commands are passed to the thread running the peer through a lock-free
+ * queue, which links them together through the iax2_mpsc_node base.
  */
-class iax2_command {
+class iax2_command : public iax2_mpsc_node {
 public:
 	iax2_command(enum iax2_command_type type, unsigned short call_num);
 
@@ -39,6 +39,27 @@ using namespace std;
 
 class iax2_peer;
 class iax2_server;
+class iax2_jitterbuffer;
+
+/*! The number of possible sequence numbers */
+#define IAX2_SEQ_SPACE 256
+
+/*!
+ * \brief How far ahead of the next expected full frame one may be and still
+ *        be held until the frames before it arrive
+ *
+ * Sequence numbers wrap, so a frame that is further ahead than half of the
+ * sequence space is taken to be an old one that was sent again.
+ */
+#define IAX2_DIALOG_REORDER_WINDOW (IAX2_SEQ_SPACE / 2)
+
+/*!
+ * \brief A full frame that arrived ahead of its turn
+ */
+struct iax2_held_frame {
+	iax2_frame *frame;
+	struct sockaddr_in sin;
+};
 
 /*!
  * \brief Return values for process_frame()
@@ -77,12 +98,29 @@ public:
 	inline unsigned short get_call_num(void) const
 		{ return call_num; }
 
+	/*!
+	 * \brief Let go of the call number without giving it back to the peer
+	 *
+	 * This is for a dialog that turns out to share its call number with
+	 * another dialog, which still needs it.
+	 */
+	inline void disown_call_num(void)
+		{ call_num = 0; }
+
 	inline const struct sockaddr_in *get_remote_addr(void) const
 		{ return &remote_addr; }
 
 	inline unsigned short get_remote_call_num(void) const
 		{ return dest_call_num; }
 
+	/*!
+	 * \brief Retrieve the key this dialog is filed under in the media index
+	 *
+	 * \return the media index key, or 0 if the dialog is not indexed
+	 */
+	inline u_int64_t get_media_key(void) const
+		{ return media_key; }
+
 	enum iax2_dialog_result process_incoming_frame(iax2_frame &frame,
 		const struct sockaddr_in *rcv_addr);
 
@@ -90,6 +128,35 @@ public:
 
 	virtual enum iax2_dialog_result timer_callback(void) = 0;
 
+	/*!
+	 * \brief Send again the frames the other side has not received
+	 *
+	 * \param seq the first sequence number that is missing on the other side
+	 *
+	 * This is called when a VNAK arrives.  Dialogs that do not keep sent
+	 * frames around rely on their retransmission timer instead.
+	 */
+	virtual void retransmit_from(unsigned char) { }
+
+	/*!
+	 * \brief A full frame that was already processed has arrived again
+	 *
+	 * This means the other side did not get the ACK for it.
+	 */
+	virtual void process_duplicate(const iax2_frame &) { }
+
+	/*!
+	 * \brief Process the media for this dialog from a meta trunk frame
+	 *
+	 * \param trunk the trunk frame
+	 * \param call the part of the trunk frame for this dialog
+	 *
+	 * This is called by the peer for each call in a trunk frame, so that
+	 * no frame has to be built for each one.
+	 */
+	virtual void process_trunk_call(const iax2_frame &, 
+		const iax2_trunk_call &) { }
+
 protected:
 	/*!
 	 * \brief process an incoming frame for this call number
@@ -100,6 +167,55 @@ protected:
 	virtual enum iax2_dialog_result process_frame(iax2_frame &frame, 
 		const struct sockaddr_in *rcv_addr) = 0;
 
+	/*!
+	 * \brief Set the call number used for this dialog on the remote side
+	 *
+	 * \param num the remote call number
+	 *
+	 * Media frames are matched to a dialog by the remote call number, IP
+	 * address, and port, so this also files the dialog in the parent peer's
+	 * media index.  remote_addr must already be set when this is called.
+	 */
+	void set_remote_call_num(unsigned short num);
+
+	/*!
+	 * \brief Keep a copy of a full frame until the frames before it arrive
+	 */
+	void hold_frame(const iax2_frame &frame, const struct sockaddr_in *rcv_addr);
+
+	/*!
+	 * \brief Ask the other side to resend everything from in_seq_num onward
+	 *
+	 * \param frame_in the frame that revealed the gap
+	 *
+	 * Only one VNAK is sent for each gap.
+	 */
+	void send_vnak(const iax2_frame &frame_in);
+
+	/*!
+	 * \brief Start the timer to retransmit a frame that was just sent
+	 *
+	 * The timeout is the retransmission timeout for remote_addr, see
+	 * iax2_rtt_table.
+	 */
+	void start_retransmit_timer(void);
+
+	/*!
+	 * \brief Start the timer again after retransmitting
+	 *
+	 * This is called from timer_callback().  The timeout doubles each time,
+	 * up to IAX2_RTO_MAX.
+	 */
+	void restart_retransmit_timer(void);
+
+	/*!
+	 * \brief Stop the retransmission timer, because the reply has arrived
+	 *
+	 * The time since start_retransmit_timer() is used as a round trip time
+	 * measurement, unless the frame has been retransmitted.
+	 */
+	void stop_retransmit_timer(void);
+
 	struct sockaddr_in remote_addr;
 	/*! This number uniquely identifies the session locally */
 	unsigned short call_num;
@@ -113,6 +229,21 @@ protected:
 	iax2_peer *parent_peer;
 	/*! ID of registered timer */
 	unsigned int timer_id;
+	/*! Key in the parent peer's media index, 0 if not indexed */
+	u_int64_t media_key;
+	/*! When the frame being timed by the retransmission timer was sent */
+	struct timeval rtx_sent;
+	/*! The number of times it has been retransmitted */
+	unsigned int rtx_count;
+	/*!
+	 * \brief Full frames that arrived early, indexed by sequence number
+	 *
+	 * This is not allocated until a frame arrives out of order.
+	 */
+	iax2_held_frame *held_frames;
+	unsigned int num_held_frames;
+	/*! A VNAK has been sent for the gap at in_seq_num */
+	bool vnak_sent;
 };
 
 /*!
@@ -210,6 +341,22 @@ enum iax2_call_state {
 	IAX2_CALL_STATE_HANGUP_SENT,
 };
 
+/*!
+ * \brief A full frame that has been sent and not acknowledged yet
+ */
+struct iax2_unacked_frame {
+	/*! The frame as it goes out on the wire, marked as a retransmission */
+	unsigned char *buf;
+	size_t len;
+	unsigned char out_seq_num;
+	/*! When the frame was first sent */
+	struct timeval sent;
+	/*! When the frame is to be sent again */
+	struct timeval deadline;
+	/*! The number of times it has been sent again */
+	unsigned int retries;
+};
+
 class iax2_call_dialog : public iax2_dialog {
 public:
 	iax2_call_dialog(iax2_peer *peer, unsigned short call_num, int sockfd,
@@ -223,19 +370,125 @@ public:
 	
 	virtual enum iax2_dialog_result timer_callback(void);
 
+	virtual void retransmit_from(unsigned char seq);
+
+	virtual void process_duplicate(const iax2_frame &frame);
+
+	virtual void process_trunk_call(const iax2_frame &trunk, 
+		const iax2_trunk_call &call);
+
 	int start(void);
 
-	void retransmit_frame_queue(void);
+	/*!
+	 * \brief Rebuild the full timestamp of a mini frame
+	 *
+	 * \param last the latest full timestamp of the audio received so far
+	 * \param ts16 the low 16 bits of the timestamp from the mini frame
+	 *
+	 * \return the full timestamp that is closest to last.  That is in the
+	 *         next 16 bit period if the mini frame is from after a wrap
+	 *         that last does not know about yet, or in the previous one if
+	 *         it is from before a wrap and arrived late.
+	 */
+	static u_int32_t unwrap_mini_ts(u_int32_t last, unsigned short ts16);
 
 private:
+	/*! \brief The audio format to send, picked from actual_formats */
+	u_int32_t audio_format(void) const;
+
+	/*!
+	 * \brief Pass received audio to the jitter buffer, or up as an event
+	 */
+	void deliver_audio(const void *data, size_t len, u_int32_t ts, u_int32_t format);
+
+	/*!
+	 * \brief Replace the jitter buffer
+	 * \param interval the milliseconds of audio per frame, or 0 for none
+	 */
+	void set_jitterbuffer(unsigned int interval);
+
+	/*!
+	 * \brief Deliver audio that came with only the low 16 bits of its timestamp
+	 */
+	void process_mini_audio(const void *data, size_t len, unsigned short ts);
+
+	/*!
+	 * \brief Send a full frame, and keep it until it is acknowledged
+	 * \retval 0 success
+	 * \retval -1 failure
+	 */
+	int send_reliable(const iax2_frame &frame);
+
+	/*!
+	 * \brief Forget the frames that the other side has received
+	 * \param seq the next sequence number the other side expects
+	 */
+	void ack_frames(unsigned char seq);
+
+	/*!
+	 * \brief Send again the frames whose deadlines have passed
+	 */
+	void retransmit_frames(void);
+
+	/*!
+	 * \brief Send a frame from frame_queue again and push back its deadline
+	 */
+	void resend_frame(iax2_unacked_frame &unacked, unsigned int rto, 
+		const struct timeval &now);
+
+	/*!
+	 * \brief Acknowledge the full frames received, now or after the ACK delay
+	 * \param ts the timestamp of the newest frame received
+	 */
+	void ack_received(u_int32_t ts);
+
+	/*!
+	 * \brief Send one ACK for every full frame received so far
+	 */
+	void send_ack(u_int32_t ts);
+
+	/*!
+	 * \brief Set the timer for the earliest retransmission or ACK deadline
+	 */
+	void schedule_timer(void);
+
 	enum iax2_call_state state;
 	unsigned int retransmissions;
 	struct timeval start_time;
 	u_int32_t peer_capabilities;
 	u_int32_t actual_formats;
-
-	list<iax2_frame *> frame_queue;
-	typedef list<iax2_frame *>::const_iterator frame_queue_iterator;
+	/*! The format of the last full voice frame sent, 0 before the first one */
+	u_int32_t tx_audio_format;
+	/*! The timestamp of the last audio frame sent */
+	u_int32_t tx_audio_ts;
+	/*! The format of the last full voice frame received */
+	u_int32_t rx_audio_format;
+	/*! The newest full timestamp of the audio received */
+	u_int32_t rx_audio_ts;
+	/*!
+	 * \brief Added to the timestamp of a trunk frame to get a call timestamp
+	 *
+	 * This is for trunk frames that do not carry a timestamp for each call.
+	 * It is worked out again after each full voice frame.
+	 */
+	u_int32_t rx_trunk_offset;
+	bool rx_trunk_synced;
+	/*! When the last full voice frame was received */
+	struct timeval rx_voice_time;
+	/*! Holds the received audio for the application, if turned on */
+	iax2_jitterbuffer *jb;
+
+	/*! Sent frames waiting to be acknowledged, oldest first */
+	list<iax2_unacked_frame> frame_queue;
+	typedef list<iax2_unacked_frame>::iterator frame_queue_iterator;
+	/*! When the timer is set to go off, if it is set */
+	struct timeval timer_time;
+	/*! Frames have been received that have not been acknowledged yet */
+	bool ack_pending;
+	/*! The timestamp for the pending ACK */
+	u_int32_t ack_ts;
+	/*! When the pending ACK has to be sent */
+	struct timeval ack_deadline;
 };
 
 #endif /* IAX2_DIALOG_H */
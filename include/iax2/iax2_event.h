@@ -33,6 +33,8 @@
 #ifndef IAX2_EVENT_H
 #define IAX2_EVENT_H
 
+#include <sys/types.h>
+
 enum iax2_event_type {
 	/*! \brief Undefined event type */
 	IAX2_EVENT_TYPE_UNDEFINED,
@@ -67,7 +69,7 @@ enum iax2_event_type {
 	/*!
 	 * \brief An audio frame has been received
 	 *
-	 * Payload type: raw, the audio frame data
+	 * Payload type: iax2_audio_event_payload, the audio frame data
 	 */
 	IAX2_EVENT_TYPE_AUDIO,
 	/*!
@@ -103,15 +105,44 @@ enum iax2_event_payload_type {
 	/*! The payload is of type, unsigned int, and is avaialable at payload.uint */
 	IAX2_EVENT_PAYLOAD_TYPE_UINT,
 	IAX2_EVENT_PAYLOAD_TYPE_VIDEO,
+	IAX2_EVENT_PAYLOAD_TYPE_AUDIO,
 };
 
+/*! The bit for an event type in an event type mask */
+#define IAX2_EVENT_MASK(type) (1U << (type))
+
 struct iax2_video_event_payload {
-	iax2_video_event_payload(const void *frame, size_t frame_len, unsigned short timestamp);
+	/*!
+	 * \param borrow point at frame instead of copying it.  frame must then
+	 *        outlive the payload.
+	 */
+	iax2_video_event_payload(const void *frame, size_t frame_len, unsigned short timestamp,
+		bool borrow = false);
 	~iax2_video_event_payload();
 
 	unsigned short m_timestamp;
 	size_t m_frame_len;
 	const void *m_frame;
+	bool m_borrowed;
+};
+
+struct iax2_audio_event_payload {
+	/*!
+	 * \param timestamp the full 32-bit timestamp, which is rebuilt from the
+	 *        last full voice frame when the audio came in a mini frame
+	 * \param format the IAX2_FORMAT_* bit the audio is encoded in
+	 * \param borrow point at frame instead of copying it.  frame must then
+	 *        outlive the payload.
+	 */
+	iax2_audio_event_payload(const void *frame, size_t frame_len, u_int32_t timestamp,
+		u_int32_t format, bool borrow = false);
+	~iax2_audio_event_payload();
+
+	u_int32_t m_timestamp;
+	u_int32_t m_format;
+	size_t m_frame_len;
+	const void *m_frame;
+	bool m_borrowed;
 };
 
 /*!
@@ -128,9 +159,10 @@ public:
 	 * \param call_num the call number for this event
 	 * \param data the raw data for the payload
 	 * \param data_len the raw data length
+	 * \param borrow point at the data instead of copying it, see dup()
 	 */
 	iax2_event(enum iax2_event_type t, unsigned short call_num, 
-		const void *data, unsigned int data_len);
+		const void *data, unsigned int data_len, bool borrow = false);
 
 	/*!
 	 * \brief iax2_event constructor for string type payload
@@ -138,9 +170,10 @@ public:
 	 * \param t the event type
 	 * \param call_num the call number for this event
 	 * \param s the string for the payload
+	 * \param borrow point at the string instead of copying it, see dup()
 	 */
 	iax2_event(enum iax2_event_type t, unsigned short call_num,
-		const char *s);
+		const char *s, bool borrow = false);
 
 	/*!
 	 * \brief iax2_event constructor for unsigned int type payload
@@ -152,14 +185,37 @@ public:
 	iax2_event(enum iax2_event_type t, unsigned short call_num,
 		unsigned int u);
 	
+	/*!
+	 * \brief iax2_event constructor for a video payload
+	 *
+	 * \param borrow do not delete vid along with the event, see dup()
+	 */
+	iax2_event(enum iax2_event_type t, unsigned short call_num,
+		struct iax2_video_event_payload *vid, bool borrow = false);
+
+	/*!
+	 * \brief iax2_event constructor for an audio payload
+	 *
+	 * \param borrow do not delete aud along with the event, see dup()
+	 */
 	iax2_event(enum iax2_event_type t, unsigned short call_num,
-		struct iax2_video_event_payload *vid);
+		struct iax2_audio_event_payload *aud, bool borrow = false);
 
 	/*!
 	 * \brief iax2_event destructor
 	 */
 	~iax2_event(void);
 
+	/*!
+	 * \brief Make a copy of the event that owns its payload
+	 *
+	 * An event with a borrowed payload can be built on the stack without
+	 * allocating anything, as long as it is only used while the data it
+	 * points to is still around.  This makes the copy that is needed to keep
+	 * it any longer than that, such as to queue it.
+	 */
+	iax2_event *dup(void) const;
+
 	/*!
 	 * \brief retrieve the event type
 	 */
@@ -209,6 +265,9 @@ public:
 	inline const iax2_video_event_payload *get_payload_video(void) const
 		{ return payload.video_frame; }
 
+	inline const iax2_audio_event_payload *get_payload_audio(void) const
+		{ return payload.audio_frame; }
+
 	/*!
 	 * \brief get the call number for the event
 	 */
@@ -234,12 +293,15 @@ private:
 	enum iax2_event_payload_type payload_type;
 	/*! The call number for this event */
 	unsigned short call_num;
+	/*! The payload belongs to someone else, so it is not freed */
+	bool borrowed;
 	/*! The associated data payload for the event */
 	union {
 		void *raw;
 		const char *str;
 		unsigned int uint;
 		struct iax2_video_event_payload *video_frame;
+		struct iax2_audio_event_payload *audio_frame;
 	} payload;
 
 	/*!
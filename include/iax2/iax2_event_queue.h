@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2006, Russell Bryant <russell@russellbryant.net> 
+ *
+ * This file is part of LibIAX2xx.
+ *
+ * LibIAX2xx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * LibIAX2xx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LibIAX2xx; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*!
+ * \file
+ * \author Russell Bryant <russell@russellbryant.net>
+ *
+ * \brief IAX2 event queue definitions
+ */
+
+#ifndef IAX2_EVENT_QUEUE_H
+#define IAX2_EVENT_QUEUE_H
+
+#include <pthread.h>
+
+#include <queue>
+
+#include "iax2/iax2_alert.h"
+
+class iax2_event;
+
+/*! The number of events the ring of an event queue holds, a power of 2 */
+#define IAX2_EVENT_RING_SIZE 1024
+
+/*! The size of a cache line, used to keep the two ends of the ring apart */
+#define IAX2_CACHE_LINE_LEN 64
+
+/*!
+ * \brief A queue of events from the thread running a peer to a consumer
+ *
+ * Events are passed through a lock-free ring with a single producer, the
+ * thread running the peer, and a single consumer, usually an event dispatcher
+ * thread.  If the ring is full, events spill over into a list that is
+ * protected by a lock, so that the producer never has to wait.  Events come
+ * out in the order that they went in either way.
+ *
+ * The producer only takes the lock to wake up the consumer if the consumer
+ * has said that it is going to sleep, so there are no system calls while the
+ * consumer is keeping up.
+ */
+class iax2_event_queue {
+public:
+	iax2_event_queue(void);
+	~iax2_event_queue(void);
+
+	/*!
+	 * \brief Add an event to the queue
+	 *
+	 * This must only be called from the producer thread.
+	 */
+	void push(iax2_event *event);
+
+	/*!
+	 * \brief Remove events from the queue, without waiting
+	 *
+	 * \param events where to store the events
+	 * \param max the most events to remove
+	 *
+	 * \return the number of events removed
+	 *
+	 * This must only be called from the consumer thread.
+	 */
+	unsigned int pop(iax2_event **events, unsigned int max);
+
+	/*!
+	 * \brief Sleep until there are events in the queue
+	 *
+	 * \param timeout the most milliseconds to wait, or -1 to wait forever
+	 *
+	 * This can return early, such as after interrupt() has been called, so the
+	 * caller has to check for events again.  This must only be called from
+	 * the consumer thread.
+	 */
+	void wait(int timeout = -1);
+
+	/*!
+	 * \brief Wake up the consumer through a file descriptor
+	 *
+	 * \retval 0 success
+	 * \retval -1 failure
+	 *
+	 * After this, the consumer is woken up by making the descriptor from
+	 * get_fd() readable, instead of with a condition variable, so that it can
+	 * wait for events along with other descriptors.  The descriptor is reset
+	 * when pop() finds the queue empty, and becomes readable again once there
+	 * are events.
+	 */
+	int open_fd(void);
+
+	/*!
+	 * \brief Get the descriptor that is readable when there are events
+	 *
+	 * \return the descriptor, or -1 if open_fd() has not been called
+	 */
+	inline int get_fd(void) const
+		{ return use_alert ? alert.get_fd() : -1; }
+
+	/*!
+	 * \brief Make the consumer return from wait(), now and from now on
+	 */
+	void interrupt(void);
+
+	inline bool is_interrupted(void) const
+		{ return interrupted; }
+
+private:
+	iax2_event *ring[IAX2_EVENT_RING_SIZE];
+
+	/*! The next slot the producer writes to.  Only the producer changes it. */
+	volatile unsigned int tail;
+	char tail_pad[IAX2_CACHE_LINE_LEN - sizeof(unsigned int)];
+
+	/*! The next slot the consumer reads from.  Only the consumer changes it. */
+	volatile unsigned int head;
+	/*! Set while the consumer is about to sleep, or is sleeping.  With a
+	 *  descriptor, it stays set until the producer signals it. */
+	volatile int sleeping;
+	char head_pad[IAX2_CACHE_LINE_LEN - sizeof(unsigned int) - sizeof(int)];
+
+	/*! Protects overflow, and is used with cond for sleeping */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/*! Events that did not fit in the ring */
+	std::queue<iax2_event *> overflow;
+	/*! The number of events in overflow, so that it can be checked without the lock */
+	volatile unsigned int overflow_count;
+	volatile bool interrupted;
+
+	/*! Used instead of cond once open_fd() has been called */
+	iax2_alert alert;
+	bool use_alert;
+};
+
+#endif /* IAX2_EVENT_QUEUE_H */
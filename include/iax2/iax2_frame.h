@@ -31,7 +31,7 @@
 #include <stdlib.h>
 #include <sys/types.h>
 
-#include <list>
+class iax2_tx_queue;
 
 /*! The ways of sending an IAX2 frame */
 enum iax2_frame_shell {
@@ -51,6 +51,22 @@ enum iax2_meta_type {
 	IAX2_META_UNDEFINED,
 	/*! Video */
 	IAX2_META_VIDEO,
+	/*! Trunk, the media of many calls */
+	IAX2_META_TRUNK,
+};
+
+/*!
+ * \brief The media of one call in a meta trunk frame
+ *
+ * This points into the payload of the trunk frame.
+ */
+struct iax2_trunk_call {
+	/*! Source call number */
+	unsigned short call_num;
+	/*! The 16-bit timestamp of the call, if the trunk frame has them */
+	unsigned short timestamp;
+	const unsigned char *data;
+	size_t len;
 };
 
 /*!
@@ -392,6 +408,18 @@ struct iax2_ie {
 /*! The maximum data length for IAX2 IEs */
 #define IAX2_IE_MAX_DATALEN 255
 
+/*! The size of the IE index in an iax2_frame, one more than the highest IE type */
+#define IAX2_IE_INDEX_LEN (IAX2_IE_OSPTOKEN + 1)
+
+/*! The number of bytes of IEs an iax2_frame can hold without allocating memory */
+#define IAX2_FRAME_IE_INLINE_LEN 128
+
+/*! The maximum total length of the IEs in an iax2_frame */
+#define IAX2_FRAME_IE_MAX_LEN 65535
+
+/*! A buffer size for iax2_frame::format() that fits the text for most frames */
+#define IAX2_FRAME_FORMAT_LEN 2048
+
 /*!
  * \brief An IAX2 frame
  *
@@ -401,13 +429,53 @@ struct iax2_ie {
  * that can be passed a buffer of a raw IAX2 frame that came from the network,
  * and the frame will be parsed and the fields of this data structure will be
  * filled to represent the frame that was received.
+ *
+ * A received frame can either copy its payload, or refer directly to the
+ * buffer it was parsed from.  In both cases, the information elements of a
+ * received frame are read in place from the payload.
  */
 class iax2_frame {
 public:
 	iax2_frame(void);
-	iax2_frame(const unsigned char *buf, size_t buflen);
+	/*!
+	 * \brief Parse a frame received from the network
+	 *
+	 * \param buf the raw frame
+	 * \param buflen the length of the raw frame
+	 * \param borrow if true, the payload is not copied and the frame refers
+	 *        to buf directly.  buf must not be changed or freed while the frame
+	 *        is in use, unless own() is called first.
+	 */
+	iax2_frame(const unsigned char *buf, size_t buflen, bool borrow = false);
+	/*!
+	 * \brief Copy a frame
+	 *
+	 * The copy owns its IEs and payload, even if the original frame borrows
+	 * its payload.  If memory runs out, the copy is left without them.
+	 */
+	iax2_frame(const iax2_frame &frame);
 	~iax2_frame(void);
 
+	/*!
+	 * \brief Take a private copy of a borrowed payload
+	 *
+	 * A frame parsed with borrow set only refers to the buffer it was received
+	 * in, which gets reused as soon as the frame has been dispatched.  Anything
+	 * that needs to keep the frame longer than that must call this first.  It
+	 * does nothing if the frame already owns its payload.
+	 */
+	iax2_frame &own(void);
+
+	/*!
+	 * \brief Make a copy of the frame that owns all of its data
+	 *
+	 * \return the copy, or NULL on failure.  It must be deleted.
+	 */
+	iax2_frame *dup(void) const;
+
+	inline bool is_borrowed(void) const
+		{ return raw_data_borrowed; }
+
 	/*!
 	 * \brief Prepare and deliver this frame
 	 *
@@ -424,13 +492,43 @@ public:
 	 */
 	int send(const struct sockaddr_in *sin, const int sockfd);
 
+	/*!
+	 * \brief Prepare this frame and queue it for delivery
+	 *
+	 * \param sin The address and port to send the frame to
+	 * \param tx_queue The queue to put the encoded frame in
+	 *
+	 * \retval 0 success
+	 * \retval non-zero failure
+	 *
+	 * This is like send(), except that the encoded frame is put in a transmit
+	 * queue, and it does not go out on the network until the queue is
+	 * flushed.  A frame that is too large for the queue is sent right away.
+	 */
+	int queue(const struct sockaddr_in *sin, iax2_tx_queue &tx_queue);
+
 	/*!
 	 * \brief Print contents of the frame
 	 *
 	 * This function will print the contents and direction of this frame.  It
-	 * is mostly for debugging purposes.
+	 * is mostly for debugging purposes.  Frames are not printed as they are
+	 * sent and received.  Use an iax2_tracer for that.
 	 */
-	void print(const struct sockaddr_in *);
+	void print(const struct sockaddr_in *) const;
+
+	/*!
+	 * \brief Describe the contents of the frame
+	 *
+	 * \param buf the buffer to write the text to
+	 * \param len the size of buf.  IAX2_FRAME_FORMAT_LEN is enough for all
+	 *        but the largest frames, which are cut off.
+	 * \param sin the address the frame was sent to or received from
+	 *
+	 * \return the length of the NULL terminated text written to buf
+	 *
+	 * This writes the same text as print(), but to a buffer.
+	 */
+	size_t format(char *buf, size_t len, const struct sockaddr_in *sin) const;
 
 	/*!
 	 * \brief Add an information element to the frame
@@ -504,12 +602,25 @@ public:
 	iax2_frame &add_ie_empty(enum iax2_ie_type type);
 	int add_ie_empty(const char *type);
 
+	/*!
+	 * \brief Get the data of an information element of the given type
+	 *
+	 * \param type the information element type to retrieve from this frame
+	 * \param datalen if not NULL, this is set to the length of the data
+	 *
+	 * \return the information element data, or NULL if it is not present.
+	 *         For a received frame, this points into the frame payload.
+	 */
+	const void *get_ie(enum iax2_ie_type type, unsigned int *datalen) const;
+
 	/*!
 	 * \brief Get an information element of the given type with a string
 	 *
 	 * \param type the information element type to retrieve from this frame
 	 *
 	 * \return the information element data as a string
+	 *
+	 * \note The string is NOT NULL terminated.  Use get_ie() to get its length.
 	 */
 	const char *get_ie_string(enum iax2_ie_type type) const;
 
@@ -565,6 +676,26 @@ public:
 	 */
 	int set_meta_type(const char *val);
 
+	/*!
+	 * \brief Find out whether each call in this trunk frame has a timestamp
+	 *
+	 * If not, the timestamp of the trunk frame applies to every call in it.
+	 */
+	inline bool has_trunk_timestamps(void) const
+		{ return trunk_timestamps; }
+
+	/*!
+	 * \brief Get the next call in a received meta trunk frame
+	 *
+	 * \param offset where to start in the payload, 0 for the first call.  It
+	 *        is moved past the call that is returned.
+	 * \param call the call, which points into this frame's payload
+	 *
+	 * \retval 0 success
+	 * \retval -1 there are no more calls, or the rest is malformed
+	 */
+	int get_trunk_call(size_t *offset, iax2_trunk_call *call) const;
+
 	// XXX These functions need to be updated to handle a coded subclass	
 	inline unsigned int get_subclass(void) const
 		{ return subclass; }
@@ -577,6 +708,20 @@ public:
 	 */
 	int set_subclass(const char *);
 
+	/*!
+	 * \brief Get the format of a voice or video frame
+	 *
+	 * The subclass of a media frame is a format bit, which is sent as the
+	 * bit number with the coded flag set when it does not fit in 7 bits.
+	 */
+	inline u_int32_t get_format(void) const
+		{ return subclass_coded ? (1U << subclass) : subclass; }
+	/*!
+	 * \brief Set the subclass of a voice or video frame to a format
+	 * \param format a single IAX2_FORMAT_* bit
+	 */
+	iax2_frame &set_format(u_int32_t format);
+
 	inline unsigned short get_source_call_num(void) const
 		{ return source_call_num; }
 	inline iax2_frame &set_source_call_num(unsigned short num)
@@ -613,20 +758,34 @@ public:
 		{ return raw_data_len; }
 
 	iax2_frame &set_raw_data(const void *data, unsigned int data_len);
+
+	/*! Get the number of bytes this frame takes on the wire, 0 if unknown */
+	size_t get_wire_len(void) const;
+	/*!
+	 * \brief Encode the frame into buf, which must hold get_wire_len() bytes
+	 * \retval 0 success
+	 * \retval -1 the frame can not be sent
+	 */
+	int encode(unsigned char *buf) const;
 	
 private:
-	void print_ies(void) const;
-	void print_full_frame(const struct sockaddr_in *) const;
-	void print_mini_frame(const struct sockaddr_in *) const;
-	void print_meta_frame(const struct sockaddr_in *) const;
-	void parse_full_frame(const unsigned char *buf, size_t buflen);
-	void parse_mini_frame(const unsigned char *buf, size_t buflen);
-	void parse_meta_frame(const unsigned char *buf, size_t buflen);
-	void parse_meta_video_frame(const unsigned char *buf, size_t buflen);
-	int send_full_frame(const struct sockaddr_in *sin, const int sockfd);
-	int send_meta_frame(const struct sockaddr_in *sin, const int sockfd);
-	int send_meta_video_frame(const struct sockaddr_in *sin, const int sockfd);
-	int send_mini_frame(const struct sockaddr_in *sin, const int sockfd);
+	/*! Not implemented, since a frame owns its buffers */
+	iax2_frame &operator=(const iax2_frame &);
+
+	size_t format_ies(char *buf, size_t len, size_t offset) const;
+	size_t format_full_frame(char *buf, size_t len, const char *ip, const struct sockaddr_in *) const;
+	size_t format_mini_frame(char *buf, size_t len, const char *ip, const struct sockaddr_in *) const;
+	size_t format_meta_frame(char *buf, size_t len, const char *ip, const struct sockaddr_in *) const;
+	void parse_full_frame(const unsigned char *buf, size_t buflen, bool borrow);
+	void parse_mini_frame(const unsigned char *buf, size_t buflen, bool borrow);
+	void parse_meta_frame(const unsigned char *buf, size_t buflen, bool borrow);
+	void parse_meta_video_frame(const unsigned char *buf, size_t buflen, bool borrow);
+	void parse_meta_trunk_frame(const unsigned char *buf, size_t buflen, bool borrow);
+	/*! Set the payload of a received frame, either as a copy or a view */
+	void set_payload(const unsigned char *data, size_t data_len, bool borrow);
+	void encode_full_frame(unsigned char *buf) const;
+	void encode_meta_video_frame(unsigned char *buf) const;
+	void encode_mini_frame(unsigned char *buf) const;
 	size_t total_ie_len(void) const;
 	const char *type2str(void) const;
 	const char *iax2subclass2str(void) const;
@@ -656,14 +815,44 @@ private:
 	/*! Frame type subclass */
 	unsigned int subclass:7;
 
-	/*! Information Elements */
-	list<iax2_ie *> ies;
-	typedef list<iax2_ie *>::const_iterator iax2_ie_iterator;
+	/*!
+	 * \brief Information Elements added to an outbound frame
+	 *
+	 * The IEs are stored back to back in wire format, so they can be copied
+	 * into an outgoing packet as they are.  This points to ie_inline until
+	 * the IEs outgrow it.
+	 */
+	unsigned char *ie_buf;
+	/*! The size of ie_buf */
+	unsigned int ie_buf_size;
+	/*! The length of the IEs in ie_buf, or at the start of raw_data */
+	unsigned int ie_data_len;
+	/*! The IEs of this received frame are at the start of raw_data */
+	bool ies_in_payload;
+	/*!
+	 * \brief The offset plus one of the first IE of each type
+	 *
+	 * An entry of zero means that this frame does not have that IE.
+	 */
+	unsigned short ie_index[IAX2_IE_INDEX_LEN];
+	/*! Storage for the IEs of most frames */
+	unsigned char ie_inline[IAX2_FRAME_IE_INLINE_LEN];
+
+	inline const unsigned char *get_ie_data(void) const
+		{ return ies_in_payload ? (const unsigned char *) raw_data : ie_buf; }
+	void index_ie(const iax2_ie *ie, unsigned int offset);
+	void clear_ies(void);
+	int grow_ie_buf(size_t len);
+	const iax2_ie *find_ie(enum iax2_ie_type type) const;
 
 	enum iax2_meta_type meta_type;
+	/*! Each call in this trunk frame has a timestamp */
+	bool trunk_timestamps;
 
 	void *raw_data;
 	unsigned int raw_data_len;
+	/*! raw_data points into a buffer that this frame does not own */
+	bool raw_data_borrowed;
 };
 
 /*!
@@ -725,6 +914,58 @@ struct iax2_meta_video_header {
     uint8_t data[0];
 } __attribute__ ((__packed__));
 
+/*! The meta command for a trunk frame */
+#define IAX2_META_CMD_TRUNK 0x01
+/*! Trunk frame command data flag: each entry has its own timestamp */
+#define IAX2_META_TRUNK_TIMESTAMPS 0x01
+
+/*!
+ * \brief A literal IAX2 meta trunk frame
+ *
+ * This struct is used for preparing or parsing a frame to or from the
+ * network that carries the media of many calls.  The data is a series of
+ * iax2_meta_trunk_entry, or of iax2_meta_trunk_mini if the
+ * IAX2_META_TRUNK_TIMESTAMPS flag is set in cmddata.
+ */
+struct iax2_meta_trunk_header {
+	/*! Zeros field -- must be zero */
+	uint16_t zeros;
+	/*! Meta command -- IAX2_META_CMD_TRUNK */
+	uint8_t metacmd;
+	/*! Command Data -- trunk flags */
+	uint8_t cmddata;
+	/*! 32-bit timestamp of when the trunk frame was sent */
+	uint32_t ts;
+	/*! Trunk entries */
+	uint8_t data[0];
+} __attribute__ ((__packed__));
+
+/*!
+ * \brief A call in a meta trunk frame without timestamps
+ */
+struct iax2_meta_trunk_entry {
+	/*! Source call number */
+	uint16_t callno;
+	/*! Length of the media data */
+	uint16_t len;
+	/*! Media data */
+	uint8_t data[0];
+} __attribute__ ((__packed__));
+
+/*!
+ * \brief A call in a meta trunk frame with timestamps
+ */
+struct iax2_meta_trunk_mini {
+	/*! Length of the media data */
+	uint16_t len;
+	/*! Source call number */
+	uint16_t callno;
+	/*! 16-bit timestamp, like in a mini frame */
+	uint16_t ts;
+	/*! Media data */
+	uint8_t data[0];
+} __attribute__ ((__packed__));
+
 /*!
  * \brief A literal IAX2 mini frame
  *
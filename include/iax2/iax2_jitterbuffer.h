@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2006, Russell Bryant <russell@russellbryant.net> 
+ *
+ * This file is part of LibIAX2xx.
+ *
+ * LibIAX2xx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * LibIAX2xx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LibIAX2xx; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*!
+ * \file
+ * \author Russell Bryant <russell@russellbryant.net>
+ *
+ * \brief IAX2 jitter buffer definitions
+ */
+
+#ifndef IAX2_JITTERBUFFER_H
+#define IAX2_JITTERBUFFER_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+/*! The number of frames the jitter buffer holds.  This must be a power of 2. */
+#define IAX2_JB_SLOTS 64
+#define IAX2_JB_SLOTS_MASK (IAX2_JB_SLOTS - 1)
+
+/*! The largest frame that fits in a slot, 40 ms of signed linear audio */
+#define IAX2_JB_MAX_FRAME_LEN 640
+
+/*! The playout delay never goes above this many milliseconds */
+#define IAX2_JB_MAX_DELAY 500
+
+/*! The playout delay is this many times the measured jitter, plus one frame */
+#define IAX2_JB_JITTER_FACTOR 4
+
+/*!
+ * \brief The result of taking a frame from a jitter buffer
+ */
+enum iax2_jb_result {
+	/*! A frame was taken */
+	IAX2_JB_OK,
+	/*! 
+	 * \brief A frame is due, but there is not one to play
+	 *
+	 * Either it was lost, or the delay is being raised.  The application
+	 * should play one frame of concealment or silence.
+	 */
+	IAX2_JB_INTERP,
+	/*! Nothing is due yet, so nothing should be played */
+	IAX2_JB_NOFRAME,
+	/*! The buffer is empty, and playout will restart with the next frame */
+	IAX2_JB_EMPTY,
+};
+
+/*!
+ * \brief A frame taken from a jitter buffer
+ */
+struct iax2_jb_frame {
+	/*! The timestamp of the frame, or of the missing frame for IAX2_JB_INTERP */
+	u_int32_t ts;
+	/*! The IAX2_FORMAT_* of the frame */
+	u_int32_t format;
+	/*! The number of bytes copied out */
+	size_t len;
+};
+
+/*!
+ * \brief A slot in the ring of a jitter buffer
+ *
+ * This is used internally to a jitter buffer.
+ */
+struct iax2_jb_slot {
+	/*! The number of the frame in this slot, its timestamp over the interval */
+	u_int32_t num;
+	u_int32_t ts;
+	u_int32_t format;
+	/*! The length of the frame, or 0 if the slot is empty */
+	unsigned int len;
+	unsigned char data[IAX2_JB_MAX_FRAME_LEN];
+};
+
+/*!
+ * \brief An adaptive jitter buffer for the audio of a call
+ *
+ * Frames are stored in a ring that is allocated along with the buffer.  The
+ * slot for a frame comes from its timestamp divided by the frame interval, so
+ * frames that arrive out of order fall into place, and nothing is allocated
+ * per frame.
+ *
+ * The jitter is measured as in RFC 3550, from the difference between the
+ * transit times of each pair of frames.  The playout delay aims for
+ * IAX2_JB_JITTER_FACTOR times the jitter, plus one frame.  It goes up as soon
+ * as the jitter does, and comes down slowly.  The delay is raised by asking
+ * the application to play a concealment frame without moving the playout
+ * point, and it is lowered by dropping a frame.
+ *
+ * Frames are put into the buffer by the thread running the peer, and taken
+ * out by the application, on its own clock, from any thread.
+ */
+class iax2_jitterbuffer {
+public:
+	/*!
+	 * \param interval the number of milliseconds of audio in each frame
+	 */
+	iax2_jitterbuffer(unsigned int interval);
+	~iax2_jitterbuffer(void);
+
+	/*!
+	 * \brief Add a frame that has arrived
+	 *
+	 * \param data the frame
+	 * \param len the length of the frame
+	 * \param ts the full timestamp of the frame
+	 * \param format the IAX2_FORMAT_* of the frame
+	 * \param now the time that the frame arrived
+	 *
+	 * \retval 0 success
+	 * \retval -1 the frame was dropped, because it is too big, a duplicate,
+	 *         or too late to be played
+	 */
+	int put(const void *data, size_t len, u_int32_t ts, u_int32_t format,
+		struct timeval now);
+
+	/*!
+	 * \brief Take the frame that is due to be played
+	 *
+	 * \param frame where to store the details of the frame
+	 * \param buf where to copy the frame
+	 * \param buflen the size of buf
+	 * \param now the time on the clock of the application
+	 *
+	 * \return the result, see iax2_jb_result.  The frame is only copied out
+	 *         for IAX2_JB_OK.
+	 *
+	 * This should be called once per interval.  A frame that does not fit in
+	 * buf is dropped, and IAX2_JB_INTERP is returned for it.
+	 */
+	enum iax2_jb_result get(iax2_jb_frame *frame, void *buf, size_t buflen,
+		struct timeval now);
+
+	/*! \brief Get the measured jitter, in milliseconds */
+	unsigned int get_jitter(void);
+
+	/*! \brief Get the playout delay, in milliseconds */
+	unsigned int get_delay(void);
+
+	inline unsigned int get_interval(void) const
+		{ return interval; }
+
+private:
+	int get_ms(struct timeval tv) const;
+	unsigned int target_delay(void) const;
+	void clear(iax2_jb_slot *slot);
+	void discard_before(u_int32_t num);
+
+	pthread_mutex_t lock;
+
+	/*! The time that the millisecond clock of the buffer counts from */
+	struct timeval base;
+	unsigned int interval;
+	/*! The number of frames in the ring */
+	unsigned int count;
+
+	/*! The number of the next frame to play, once playout has started */
+	u_int32_t next_num;
+	bool started;
+	/*! The number of the oldest frame put since playout stopped */
+	u_int32_t first_num;
+
+	/*! The transit time of the last frame, for the jitter */
+	int last_transit;
+	bool have_transit;
+	/*! The average transit time, scaled by 16 */
+	int avg_transit;
+	/*! The RFC 3550 jitter, scaled by 16 */
+	unsigned int jitter;
+	/*! The playout delay, which follows target_delay() */
+	unsigned int delay;
+
+	iax2_jb_slot slots[IAX2_JB_SLOTS];
+};
+
+#endif /* IAX2_JITTERBUFFER_H */
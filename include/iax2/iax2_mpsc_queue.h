@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2006, Russell Bryant <russell@russellbryant.net> 
+ *
+ * This file is part of LibIAX2xx.
+ *
+ * LibIAX2xx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * LibIAX2xx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LibIAX2xx; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*!
+ * \file
+ * \author Russell Bryant <russell@russellbryant.net>
+ *
+ * \brief Lock-free multiple producer, single consumer queue definitions
+ */
+
+#ifndef IAX2_MPSC_QUEUE_H
+#define IAX2_MPSC_QUEUE_H
+
+#include <stdlib.h>
+
+/*!
+ * \brief The link for an object that can be put in an iax2_mpsc_queue
+ *
+ * Objects that are passed through a queue inherit from this, so that pushing
+ * them does not allocate anything.  An object can only be in one queue at a
+ * time.
+ */
+struct iax2_mpsc_node {
+	iax2_mpsc_node * volatile mpsc_next;
+};
+
+/*!
+ * \brief A lock-free queue with many producers and a single consumer
+ *
+ * Any number of threads may push() at the same time without taking a lock,
+ * while the thread that owns the queue calls pop().  Pushing is a single
+ * atomic exchange.  This is the intrusive queue described by Dmitry Vyukov.
+ *
+ * If a producer has been preempted in the middle of a push(), pop() can
+ * return NULL even though the queue is not empty.  The producer must then
+ * alert the consumer after its push() is done, which is how it is used
+ * anyway.
+ */
+class iax2_mpsc_queue {
+public:
+	iax2_mpsc_queue(void);
+	~iax2_mpsc_queue(void);
+
+	/*!
+	 * \brief Add an object to the end of the queue
+	 *
+	 * This is safe to call from any thread.
+	 */
+	void push(iax2_mpsc_node *node);
+
+	/*!
+	 * \brief Remove the object from the front of the queue
+	 *
+	 * \return the object, or NULL if there is none
+	 *
+	 * This must only be called from the thread that owns the queue.
+	 */
+	iax2_mpsc_node *pop(void);
+
+private:
+	/*! Where producers add objects */
+	iax2_mpsc_node * volatile head;
+	/*! Where the consumer removes them */
+	iax2_mpsc_node *tail;
+	/*! Kept in the queue so that it is never really empty */
+	iax2_mpsc_node stub;
+};
+
+#endif /* IAX2_MPSC_QUEUE_H */
@@ -33,9 +33,9 @@
 #include <netinet/in.h>
 #include <sys/time.h>
 
-#include <map>
 #include <list>
 #include <queue>
+#include <tr1/unordered_map>
 
 using namespace std;
 
@@ -43,34 +43,93 @@ using namespace std;
 #include "iax2/iax2_event.h"
 #include "iax2/iax2_command.h"
 #include "iax2/iax2_frame.h"
+#include "iax2/iax2_tx_queue.h"
+#include "iax2/iax2_trace.h"
+#include "iax2/iax2_timer_wheel.h"
+#include "iax2/iax2_mpsc_queue.h"
+#include "iax2/iax2_event_queue.h"
+#include "iax2/iax2_alert.h"
+#include "iax2/iax2_jitterbuffer.h"
+#include "iax2/iax2_rtt.h"
+#include "iax2/iax2_trunk.h"
+#include "iax2/iax2_call_num.h"
 #include "iax2/time.h"
 
 /*! The default IAX2 port */
 #define DEFAULT_IAX2_PORT    4569
 
+/*! The largest packet that will be read from the socket */
+#define IAX2_MAX_PACKET_LEN  4096
+
+/*! The default number of packets read from the socket per wakeup */
+#define IAX2_DEFAULT_RECV_BATCH_SIZE 32
+
+/*! By default, full frames on a call are acknowledged right away */
+#define IAX2_DEFAULT_ACK_DELAY 0
+
+/*! A typical interval for sending trunk frames, see set_trunking() */
+#define IAX2_DEFAULT_TRUNK_INTERVAL 20
+
+struct iax2_recv_batch;
+struct iax2_handoff_packet;
+struct iax2_dispatcher;
+class iax2_shard_group;
+class iax2_reactor;
+
+/*! The default number of threads that dispatch events */
+#define IAX2_DEFAULT_EVENT_DISPATCHERS 1
+
+/*! The most events passed to the event handlers at once */
+#define IAX2_EVENT_BATCH_SIZE 64
+
+/*! The most file descriptors the event loop handles per wakeup */
+#define IAX2_PEER_MAX_READY 8
+
 /*!
- * \brief A scheduled callback event
+ * \brief The table of active dialogs, indexed by call number
  *
- * This class is used internally to a peer to keep track of a scheduled
- * callback event that was created by an iax2_dialog.
+ * This class is used internally to a peer to find the dialog that owns a
+ * call number.  Since call numbers are only 15 bits, it is a flat array with
+ * a slot for every possible call number, so finding the dialog for a full
+ * frame is a single array load, and frames for unknown call numbers can not
+ * make the table grow.
  */
-class iax2_timer_event {
+class iax2_dialog_table {
 public:
-	iax2_timer_event(void);
-	iax2_timer_event(iax2_dialog *dialog, struct timeval tv, unsigned int id_num);
-	~iax2_timer_event(void);
+	iax2_dialog_table(void);
+	~iax2_dialog_table(void);
+
+	/*!
+	 * \brief Find the dialog for a call number
+	 *
+	 * \return the dialog, or NULL if the call number is not in use
+	 */
+	inline iax2_dialog *find(unsigned short num) const
+		{ return slots[num & (IAX2_MAX_CALL_NUMS - 1)]; }
+
+	/*!
+	 * \brief Add a dialog to the table, using its call number as the index
+	 *
+	 * \retval 0 success
+	 * \retval -1 the call number belongs to another dialog, which is left
+	 *         in place
+	 */
+	int insert(iax2_dialog *dialog);
 
-	inline unsigned int get_id(void) const { return id; }
-	inline iax2_dialog *get_dialog(void) const { return dialog; }
-	inline struct timeval get_time_to_run(void) const { return time_to_run; }
+	/*!
+	 * \brief Remove the dialog for a call number from the table
+	 */
+	void erase(unsigned short num);
 
-	bool operator<(const iax2_timer_event& event) const;
+	/*!
+	 * \brief Get the number of dialogs in the table
+	 */
+	inline unsigned int size(void) const
+		{ return count; }
 
 private:
-	unsigned int id;
-
-	iax2_dialog *dialog;
-	struct timeval time_to_run;
+	iax2_dialog **slots;
+	unsigned int count;
 };
 
 /*!
@@ -163,6 +222,43 @@ public:
 	 */
 	int register_event_handler(iax2_event_handler handler);
 
+	/*!
+	 * \brief This is the type for an event handler that takes a batch of events
+	 */
+	typedef void (*iax2_event_batch_handler)(iax2_event **events, unsigned int num_events);
+
+	/*!
+	 * \brief Register a handler for batches of events from this peer.
+	 *
+	 * \param handler the event handler
+	 *
+	 * The handler is called with all of the events that were waiting each time
+	 * the dispatcher wakes up, up to IAX2_EVENT_BATCH_SIZE at a time, which
+	 * is cheaper than a call per event when events arrive quickly.  The events
+	 * are deleted once all of the handlers return.
+	 */
+	int register_event_batch_handler(iax2_event_batch_handler handler);
+
+	/*!
+	 * \brief Set a handler that is called right away for some types of events
+	 *
+	 * \param handler the event handler
+	 * \param type_mask the event types to pass to it, built with
+	 *        IAX2_EVENT_MASK()
+	 *
+	 * Events of these types are passed to this handler from the thread
+	 * running run(), as soon as they happen, instead of being queued for the
+	 * other event handlers.  Nothing is allocated for them.  This is for
+	 * events where latency matters most, such as LAG.
+	 *
+	 * The handler holds up all network processing while it runs, so it must
+	 * not block.  The event, and its payload, are only valid until the
+	 * handler returns.  Use iax2_event::dup() to keep a copy.
+	 *
+	 * This MUST be called BEFORE run().
+	 */
+	void set_inline_event_handler(iax2_event_handler handler, unsigned int type_mask);
+
 	/*!
 	 * \brief Add an outbound registration for this peer
 	 *
@@ -184,7 +280,7 @@ public:
 	 * \param uri the URI that identifies the IAX2 peer to call
 	 *
 	 * \return the call number for the new call. 0 is returned
-	 *         for an error.
+	 *         for an error, such as when every call number is in use.
  	 */
 	unsigned short new_call(const char *uri);
 
@@ -194,7 +290,7 @@ public:
 	 * \param uri the URI that identifies the IAX2 peer to send lag request to
 	 *
 	 * \return the call number for the new call. 0 is returned
-	 *         for an error.
+	 *         for an error, such as when every call number is in use.
  	 */
 	unsigned short new_lag(const char *uri);
 
@@ -205,9 +301,30 @@ public:
 	 *        allocated using the new operator.
 	 *
 	 * \return whether or not the command was successful
+	 *
+	 * This is safe to call from any number of threads at once, and does not
+	 * take any locks.  The command is processed by the thread running run().
 	 */
 	enum iax2_command_result send_command(iax2_command *command);
 
+	/*!
+	 * \brief Take the audio that is due to be played from a jitter buffer
+	 *
+	 * \param call_num the call, which must have its jitter buffer turned on
+	 *        with IAX2_COMMAND_TYPE_JITTERBUFFER
+	 * \param frame where to store the details of the frame
+	 * \param buf where to copy the frame
+	 * \param buflen the size of buf
+	 *
+	 * \return the result, see iax2_jb_result.  IAX2_JB_EMPTY is returned if
+	 *         the call has no jitter buffer.
+	 *
+	 * This is meant to be called once per frame interval from the thread that
+	 * plays the audio, on its own clock.  It is safe to call from any thread.
+	 */
+	enum iax2_jb_result get_audio(unsigned short call_num, iax2_jb_frame *frame,
+		void *buf, size_t buflen);
+
 	/*!
 	 * \brief Set the codec capabilities for this peer.
 	 *
@@ -220,6 +337,130 @@ public:
  	 */
 	void set_capabilities(unsigned int cap);
 
+	/*!
+	 * \brief Set how many packets are read from the socket per wakeup
+	 *
+	 * \param size the maximum number of packets to read at once
+	 *
+	 * When the socket becomes readable, up to this many packets are read
+	 * with a single system call and then processed in one pass.  A size of
+	 * 1 reads one packet per wakeup.  The default is
+	 * IAX2_DEFAULT_RECV_BATCH_SIZE.  Batching is only available on systems
+	 * that have recvmmsg(); elsewhere, packets are always read one at a time.
+	 *
+	 * This MUST be called BEFORE run().
+	 */
+	void set_recv_batch_size(unsigned int size);
+
+	/*!
+	 * \brief Set how long the ACK for a full frame on a call may be held back
+	 *
+	 * \param ms the delay in milliseconds, or 0 to send each ACK right away
+	 *
+	 * While an ACK is held back, the next full frame sent on the call
+	 * acknowledges everything received so far, so no separate ACK is needed.
+	 * If nothing is sent before the delay is up, one ACK covers all of the
+	 * frames received in the meantime.  This cuts down on packets for calls
+	 * that send a lot of signalling.  The delay should be well below the
+	 * retransmission timeout of the other side.  The default is
+	 * IAX2_DEFAULT_ACK_DELAY.
+	 */
+	void set_ack_delay(unsigned int ms);
+
+	/*!
+	 * \brief Send the audio of calls to the same host in trunk frames
+	 *
+	 * \param ms how often trunk frames are sent, in milliseconds, or 0 to
+	 *        send each call's audio in its own mini frames
+	 * \param timestamps whether each call in a trunk frame carries its own
+	 *        timestamp
+	 *
+	 * Audio that would have gone out in mini frames is collected for each
+	 * remote host and sent as one meta trunk frame per host every ms
+	 * milliseconds.  This delays the audio by up to ms.  Trunking is off by
+	 * default.  A typical interval is IAX2_DEFAULT_TRUNK_INTERVAL.  The other
+	 * side must understand trunk frames.
+	 *
+	 * This MUST be called BEFORE run().
+	 */
+	void set_trunking(unsigned int ms, bool timestamps);
+
+	/*!
+	 * \brief Set how many threads dispatch events to the event handlers
+	 *
+	 * \param num the number of threads, or 0 for none
+	 *
+	 * \retval 0 success
+	 * \retval -1 failure
+	 *
+	 * Events are spread across the threads by call number.  All of the events
+	 * for a call are handled by the same thread, in order, while the events
+	 * for different calls can be handled at the same time.  With more than one
+	 * thread, the event handlers must be safe to call from several threads at
+	 * once.  The default is IAX2_DEFAULT_EVENT_DISPATCHERS.
+	 *
+	 * With no threads, the peer is in pull mode.  The event handlers are not
+	 * called, and the application takes the events with poll_events()
+	 * instead.
+	 *
+	 * This MUST be called BEFORE run().
+	 */
+	int set_event_dispatchers(unsigned int num);
+
+	/*!
+	 * \brief Take the events that are waiting, in pull mode
+	 *
+	 * \param events where to store the events
+	 * \param max the most events to take
+	 * \param timeout the most milliseconds to wait for an event.  0 returns
+	 *        right away, and -1 waits until there is one.
+	 *
+	 * \return the number of events, or -1 if the peer is not in pull mode
+	 *
+	 * The events are taken straight from the thread running run(), without
+	 * going through a dispatcher thread.  The caller owns the events, and must
+	 * delete them.  Only one thread at a time may take events.
+	 *
+	 * This is only available after calling set_event_dispatchers(0).
+	 */
+	int poll_events(iax2_event **events, unsigned int max, int timeout);
+
+	/*!
+	 * \brief Get a file descriptor that is readable when events are waiting
+	 *
+	 * \return the descriptor, or -1 if the peer is not in pull mode
+	 *
+	 * This is for an application that waits in its own poll() or epoll loop.
+	 * Once the descriptor is readable, call poll_events() until it returns 0,
+	 * which also resets the descriptor.  Do not read from it directly.
+	 */
+	int get_event_fd(void) const;
+
+	/*!
+	 * \brief Run this peer as one shard of a group
+	 *
+	 * \param group the group, which must outlive this peer
+	 *
+	 * \retval 0 success
+	 * \retval non-zero the group already has all of its shards
+	 *
+	 * All of the peers in a group must be the same type and use the same
+	 * local port.  Each one is then run in its own thread.  See
+	 * iax2_shard_group for how the work is split between them.
+	 *
+	 * This MUST be called BEFORE run().
+	 */
+	int join_shard_group(iax2_shard_group &group);
+
+	/*!
+	 * \brief Process a packet that another shard received for this one
+	 *
+	 * \note This is called by iax2_shard_group::hand_off() from the thread of
+	 *       the shard that received the packet.
+	 */
+	void queue_handoff(const unsigned char *buf, size_t len, 
+		const struct sockaddr_in *sin);
+
 	/*!
 	 * \brief Get the currently set codec capabilities for this peer.
 	 *	 
@@ -231,6 +472,12 @@ public:
 
 	u_int32_t choose_formats(u_int32_t peer_capabilities);
 
+	/*!
+	 * \brief Get how long an ACK may be held back, see set_ack_delay()
+	 */
+	inline unsigned int get_ack_delay(void) const
+		{ return ack_delay; }
+
 	/*!
 	 * \brief Get the preferred format, based on capabilities
 	 *
@@ -279,17 +526,46 @@ public:
 	 */
 	int stop_timer(unsigned int id);
 
+	/*!
+	 * \brief Make the jitter buffer of a call available to get_audio()
+	 *
+	 * \note This is called by call dialogs, which own their jitter buffers.
+	 */
+	void add_jitterbuffer(unsigned short call_num, iax2_jitterbuffer *jb);
+
+	/*!
+	 * \brief Remove the jitter buffer of a call, so that it can be deleted
+	 *
+	 * \note This is called by call dialogs, which own their jitter buffers.
+	 */
+	void remove_jitterbuffer(unsigned short call_num);
+
 	/*!
 	 * \brief Queue an event to be dispatched to the event event_handlers
 	 *
 	 * \note This function should not be used by the application using the
 	 *       library.  It is used by objects internal to the library to
-	 *       communicate information back to the application.
+	 *       communicate information back to the application.  It must only be
+	 *       called from the thread running run().
 	 *
 	 * \todo It would be nice if this were moved so it was not public.
 	 */ 
 	void queue_event(iax2_event *event);
 
+	/*!
+	 * \brief Pass an event to the application
+	 *
+	 * \param event the event, which may have a borrowed payload
+	 *
+	 * If the event type is handled inline, the event is passed straight to
+	 * the inline event handler.  Otherwise, a copy of it is queued with
+	 * queue_event().
+	 *
+	 * \note This function should not be used by the application using the
+	 *       library.  It must only be called from the thread running run().
+	 */
+	void post_event(iax2_event &event);
+
 	/*!
 	 * \brief Get the reference time
 	 *
@@ -302,6 +578,76 @@ public:
 	inline struct timeval get_reference_time(void) const 
 		{ return reference_time; }
 
+	/*!
+	 * \brief File a dialog in the media frame index
+	 *
+	 * \param dialog the dialog, which must have its remote address and
+	 *        remote call number set
+	 *
+	 * \return the key the dialog was filed under
+	 *
+	 * If the dialog was already in the index under a different key, the old
+	 * entry is removed.
+	 *
+	 * \note This function should not be used by the application using the
+	 *       library.  It is called by dialogs, which are internal to the
+	 *       library.
+	 */
+	u_int64_t index_dialog_media(iax2_dialog *dialog);
+
+	/*!
+	 * \brief Remove a dialog from the media frame index
+	 *
+	 * \note This function should not be used by the application using the
+	 *       library.  It is called by dialogs, which are internal to the
+	 *       library.
+	 */
+	void unindex_dialog_media(iax2_dialog *dialog);
+
+	/*!
+	 * \brief Get the queue that outgoing frames are batched in
+	 *
+	 * \note This is for internal use by dialogs.  The queue is flushed by the
+	 *       network thread each time it finishes a round of work.
+	 */
+	inline iax2_tx_queue &get_tx_queue(void)
+		{ return tx_queue; }
+
+	/*!
+	 * \brief Get the tracer for the frames this peer sends and receives
+	 *
+	 * Tracing is off by default.  An application can turn it on, or limit it
+	 * to certain calls, at any time.
+	 */
+	inline iax2_tracer &get_tracer(void)
+		{ return tracer; }
+
+	/*!
+	 * \brief Get the round trip time estimates for the remote peers
+	 *
+	 * \note This is for internal use by dialogs, to time retransmissions.
+	 */
+	inline iax2_rtt_table &get_rtt_table(void)
+		{ return rtt_table; }
+
+	/*!
+	 * \brief Get the trunk frames being filled for the remote hosts
+	 *
+	 * \note This is for internal use by dialogs.  The trunk frames are sent by
+	 *       the network thread when they are due.
+	 */
+	inline iax2_trunk &get_trunk(void)
+		{ return trunk; }
+
+	/*!
+	 * \brief Give back the call number of a dialog that is going away
+	 *
+	 * \note This is for internal use by dialogs.  The number is not handed
+	 *       out again until IAX2_CALL_NUM_QUARANTINE has passed.
+	 */
+	inline void release_call_num(unsigned short num)
+		{ call_nums.release(num); }
+
 protected:
 	/*!
 	 * \brief Determine when the next callback is scheduled for
@@ -325,14 +671,32 @@ protected:
 	 */
 	void run_callbacks(void);
   
+	/*!
+	 * \brief Claim a call number that is not in use
+	 *
+	 * \return the call number, or 0 if every call number is in use
+	 *
+	 * This can be called from any thread.
+	 */
 	unsigned short get_next_call_num(void);
 
+	/*!
+	 * \brief Add a new dialog to the table of active dialogs
+	 *
+	 * \retval 0 success
+	 * \retval -1 the call number of the dialog is already in use.  The new
+	 *         dialog has been deleted, and the dialog that had the call number
+	 *         keeps it.
+	 */
+	int add_dialog(iax2_dialog *dialog);
+
 	/*
 	 * \brief Find the dialog for a media frame
 	 *
 	 * This function returns a pointer for the active dialog that a media frame
 	 * is destined for.  It must match the dialog based on source call number,
-	 * IP address, and port number.
+	 * IP address, and port number.  The match is a single lookup in the
+	 * media index, no matter how many dialogs are active.
 	 */
 	iax2_dialog *find_dialog_media(iax2_frame &frame, const struct sockaddr_in *sin);
 
@@ -351,14 +715,12 @@ protected:
 	 * \brief the currently active dialogs 
  	 *
 	 * This is the container for all of the active dialogs for this peer.
-	 * It is implemented as a map for convenience.  The unsigned short used
-	 * for the mapping should be the call number associated with the dialog.
-	 * Every incoming frame has an associated call number, so this makes it
-	 * very easy to look up which dialog the incoming frame is associated
-	 * with.
+	 * It is indexed by the call number associated with the dialog.  Every
+	 * incoming full frame carries our call number as its destination call
+	 * number, so this makes it very easy to look up which dialog the
+	 * incoming frame is associated with.
 	 */
-	map<unsigned short, iax2_dialog *> dialogs;
-	typedef map<unsigned short, iax2_dialog *>::const_iterator dialogs_iterator;
+	iax2_dialog_table dialogs;
 
 private:
 	/*!
@@ -382,14 +744,88 @@ private:
 	/*!
 	 * \brief Read a packet from the socket
 	 *
-	 * This function gets called after polling the socket has indicated that
-	 * there is input available on the socket so that this function will
-	 * never block when it tries to read from the socket.
+	 * \return the number of packets read, 0 if none were waiting
+	 *
+	 * This function gets called after the reactor has indicated that there
+	 * is input available on the socket.  It never blocks.
+	 */
+	int recv_packet(void);
+
+	/*!
+	 * \brief Read a batch of packets from the socket
+	 *
+	 * \return the number of packets read, 0 if none were waiting
+	 *
+	 * Like recv_packet(), but reads as many as recv_batch_size packets that
+	 * are already waiting on the socket with one system call, and then
+	 * processes all of them.
+	 */
+	int recv_packet_batch(void);
+
+	/*!
+	 * \brief Read the packets waiting on the socket
+	 *
+	 * With an edge-triggered reactor, this reads until the socket is empty.
+	 * Otherwise, it reads one batch, and the reactor reports the socket
+	 * again if there is more.
+	 */
+	void recv_packets(void);
+
+	/*!
+	 * \brief Parse a packet read from the socket and process it
+	 *
+	 * \param handed_off the packet was passed on by another shard, so it must
+	 *        be processed here
+	 */
+	void handle_packet(const unsigned char *buf, size_t len, const struct sockaddr_in *sin,
+		bool handed_off = false);
+
+	/*!
+	 * \brief Pass a packet to the shard that owns its call, if it is not this one
+	 *
+	 * \retval true the packet was handed off
+	 * \retval false the packet should be processed here
+	 */
+	bool hand_off_packet(const iax2_frame &frame, const unsigned char *buf, size_t len,
+		const struct sockaddr_in *sin);
+
+	/*!
+	 * \brief Split up a meta trunk frame and pass each call to its dialog
+	 *
+	 * \param handed_off the frame was passed on by another shard
+	 *
+	 * Each call is looked up in the media index and handed to its dialog
+	 * as a view into the trunk frame.  With a shard group, a call owned by
+	 * another shard is handed off to it in a trunk frame of its own.
 	 */
-	void recv_packet(void);
+	void process_trunk_frame(const iax2_frame &frame, const struct sockaddr_in *sin,
+		bool handed_off);
 
+	/*!
+	 * \brief Process the packets that other shards have handed to this one
+	 */
+	void handle_handoffs(void);
+
+	/*!
+	 * \brief Process all of the queued commands
+	 *
+	 * \retval 0 success
+	 * \retval -1 a shutdown command was received
+	 */
 	int handle_command(void);
 
+	/*!
+	 * \brief Wake up run(), unless it has already been woken up
+	 *
+	 * This is called after adding to one of the queues that run() drains.
+	 */
+	void signal_alert(void);
+
+	/*!
+	 * \brief Reset the alert, before the queues are drained
+	 */
+	void clear_alert(void);
+
 	/*!
 	 * \brief the list of outbound registrations
 	 *
@@ -425,43 +861,133 @@ private:
 	/*! Local port and address to bind to */
 	struct sockaddr_in local_addr;
 
+	/*! What the event loop waits in, created by network_init() */
+	iax2_reactor *reactor;
+
+	/*! Maximum number of packets to read per wakeup */
+	unsigned int recv_batch_size;
+	/*! Buffers for reading a batch of packets, allocated by network_init() */
+	iax2_recv_batch *recv_batch;
+
+	/*! Outgoing packets waiting to be sent by the network thread */
+	iax2_tx_queue tx_queue;
+
+	/*! Frame tracing for this peer */
+	iax2_tracer tracer;
+
+	/*! Round trip times to the remote peers, for retransmission timeouts */
+	iax2_rtt_table rtt_table;
+
+	/*! Audio waiting to go out in trunk frames, sent through tx_queue */
+	iax2_trunk trunk;
+
 	/*! 
-	 * \brief next call number to use
+	 * \brief The call numbers this peer hands out
 	 *
-	 * This number is used to figure out what number should be used for the
-	 * next call number for a dialog.  After this number is used for creating
-	 * a new dialog, it should be incremented.
+	 * With a shard group, this only covers the shard's own range.
 	 */
-	unsigned short next_call_num;
-	pthread_mutex_t next_call_num_lock;
+	iax2_call_num_allocator call_nums;
 
-	priority_queue<iax2_timer_event> callback_queue;
-	unsigned int next_timer_id;
+	/*! The group this peer is a shard of, if any */
+	iax2_shard_group *shard_group;
+	/*! The index of this peer in shard_group */
+	unsigned int shard_index;
+	/*!
+	 * \brief Packets handed off to this shard by the other shards
+	 *
+	 * The queue holds iax2_handoff_packet objects.  Each packet added also
+	 * signals the alert to wake up run().
+	 */
+	iax2_mpsc_queue handoff_queue;
+
+	/*!
+	 * \brief Dialogs indexed for media frame lookup
+	 *
+	 * The key packs the remote IP address, port, and call number together,
+	 * see media_key().  It is only used from the thread running run().
+	 */
+	tr1::unordered_map<u_int64_t, iax2_dialog *> media_dialogs;
+	typedef tr1::unordered_map<u_int64_t, iax2_dialog *>::iterator media_dialogs_iterator;
+
+	/*!
+	 * \brief Build the media index key for a remote address and call number
+	 */
+	static inline u_int64_t media_key(const struct sockaddr_in *sin, unsigned short num)
+		{ return ((u_int64_t) sin->sin_addr.s_addr << 32) | 
+			((u_int64_t) sin->sin_port << 16) | (u_int64_t) (num | 0x8000); }
+
+	/*!
+	 * \brief The jitter buffers of the calls that have one, by call number
+	 *
+	 * This is changed by the thread running run(), and read by the threads
+	 * that call get_audio().
+	 */
+	tr1::unordered_map<unsigned short, iax2_jitterbuffer *> jitterbuffers;
+	typedef tr1::unordered_map<unsigned short, iax2_jitterbuffer *>::iterator jitterbuffers_iterator;
+	pthread_rwlock_t jitterbuffers_lock;
+
+	/*! The timers started by the dialogs of this peer */
+	iax2_timer_wheel timers;
 
 	static void *event_dispatcher(void *data);
 
-	/*! Set to false to notify the event_dispatcher to return */
-	bool event_dispatch;
-	pthread_t event_dispatch_thread;
-	pthread_cond_t event_cond;
-	pthread_mutex_t event_cond_lock;
+	/*!
+	 * \brief Start a thread for each of the event dispatchers
+	 */
+	int start_event_dispatchers(void);
 
-	pthread_mutex_t event_handlers_lock;
+	/*!
+	 * \brief Stop the event dispatcher threads and free the dispatchers
+	 */
+	void destroy_event_dispatchers(void);
+
+	/*!
+	 * \brief Call the event handlers for a batch of events, then delete them
+	 */
+	void dispatch_events(iax2_event **events, unsigned int num_events);
+
+	/*! Held for reading while the dispatchers call the event handlers */
+	pthread_rwlock_t event_handlers_lock;
 	list<iax2_event_handler> event_handlers;
 	typedef list<iax2_event_handler>::const_iterator iax2_event_handler_iterator;
+	list<iax2_event_batch_handler> event_batch_handlers;
+	typedef list<iax2_event_batch_handler>::const_iterator iax2_event_batch_handler_iterator;
+
+	/*! Events with types in inline_event_mask go straight to this, see post_event() */
+	iax2_event_handler inline_event_handler;
+	unsigned int inline_event_mask;
 
-	pthread_mutex_t event_queue_lock;
-	queue<iax2_event *> event_queue;
+	/*!
+	 * \brief The event dispatchers, each with its own queue and thread
+	 *
+	 * The threads are not started until run() is called.
+	 */
+	iax2_dispatcher **event_dispatchers;
+	unsigned int num_event_dispatchers;
+	bool event_dispatchers_started;
+	/*! There are no dispatcher threads, see poll_events() */
+	bool event_pull_mode;
 
-	pthread_mutex_t command_queue_lock;
-	queue<iax2_command *> command_queue;
+	/*! Commands sent by the application, see send_command() */
+	iax2_mpsc_queue command_queue;
 
-	int command_alert_pipe[2];
+	/*! Wakes up run() when commands or handoffs have been queued */
+	iax2_alert alert;
+	/*!
+	 * \brief Set once alert has been signalled, until run() wakes up
+	 *
+	 * Only the thread that sets this signals the alert, so a burst of
+	 * commands costs a single system call.
+	 */
+	volatile int alert_signalled;
 
 	struct timeval reference_time;
 
 	unsigned int capabilities;
 	unsigned int preferred_format;
+
+	/*! How long an ACK may be held back, in milliseconds */
+	unsigned int ack_delay;
 };
 
 #endif /* IAX2_PEER_H */
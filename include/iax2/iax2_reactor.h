@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2006, Russell Bryant <russell@russellbryant.net> 
+ *
+ * This file is part of LibIAX2xx.
+ *
+ * LibIAX2xx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * LibIAX2xx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LibIAX2xx; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*!
+ * \file
+ * \author Russell Bryant <russell@russellbryant.net>
+ *
+ * \brief IAX2 event loop reactor definitions
+ */
+
+#ifndef IAX2_REACTOR_H
+#define IAX2_REACTOR_H
+
+/*!
+ * \brief Waits for input on a set of file descriptors
+ *
+ * A reactor is what a peer's event loop sleeps in.  Each file descriptor is
+ * added with an id, and wait() reports the ids of the ones that have input.
+ * Any number of file descriptors may be added.
+ *
+ * There are two implementations.  On Linux, epoll is used in edge-triggered
+ * mode.  Everywhere else, or if epoll can not be set up, poll() is used.
+ *
+ * \note With an edge-triggered reactor, a file descriptor is only reported
+ *       again once new input arrives.  Whoever handles it must read until
+ *       there is nothing left.  See is_edge_triggered().
+ */
+class iax2_reactor {
+public:
+	/*!
+	 * \brief Create the best reactor available on this system
+	 *
+	 * \return a new reactor, which must be freed with delete
+	 */
+	static iax2_reactor *create(void);
+
+	virtual ~iax2_reactor(void) { }
+
+	/*!
+	 * \brief Start watching a file descriptor for input
+	 *
+	 * \param fd the file descriptor
+	 * \param id what wait() reports when fd has input
+	 *
+	 * \retval 0 success
+	 * \retval non-zero failure
+	 */
+	virtual int add(int fd, unsigned int id) = 0;
+
+	/*!
+	 * \brief Stop watching a file descriptor
+	 *
+	 * \retval 0 success
+	 * \retval non-zero failure
+	 */
+	virtual int remove(int fd) = 0;
+
+	/*!
+	 * \brief Wait for input
+	 *
+	 * \param timeout the maximum time to wait in milliseconds, or -1 to wait
+	 *        forever
+	 * \param ids filled in with the ids of the file descriptors that have input
+	 * \param max the number of entries in ids
+	 *
+	 * \return the number of ids filled in, 0 if the timeout expired, or -1 on
+	 *         error, with errno set
+	 */
+	virtual int wait(int timeout, unsigned int *ids, unsigned int max) = 0;
+
+	/*!
+	 * \brief Whether input must be drained completely each time it is reported
+	 */
+	virtual bool is_edge_triggered(void) const = 0;
+};
+
+#endif /* IAX2_REACTOR_H */
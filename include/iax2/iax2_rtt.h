@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2006, Russell Bryant <russell@russellbryant.net> 
+ *
+ * This file is part of LibIAX2xx.
+ *
+ * LibIAX2xx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * LibIAX2xx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LibIAX2xx; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*!
+ * \file
+ * \author Russell Bryant <russell@russellbryant.net>
+ *
+ * \brief IAX2 round trip time estimation definitions
+ */
+
+#ifndef IAX2_RTT_H
+#define IAX2_RTT_H
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <tr1/unordered_map>
+
+/*! The retransmission timeout before anything is known about a remote peer */
+#define IAX2_RTO_INITIAL 1000
+/*! The retransmission timeout never goes below this many milliseconds */
+#define IAX2_RTO_MIN 100
+/*! Backing off never takes the retransmission timeout above this */
+#define IAX2_RTO_MAX 8000
+
+/*! The most remote addresses that estimates are kept for */
+#define IAX2_RTT_TABLE_MAX 4096
+
+/*!
+ * \brief The round trip time estimate for a remote address
+ */
+struct iax2_rtt {
+	/*! Smoothed round trip time, in milliseconds */
+	unsigned int srtt;
+	/*! Round trip time variation, in milliseconds */
+	unsigned int rttvar;
+	/*! Retransmission timeout, in milliseconds */
+	unsigned int rto;
+};
+
+/*!
+ * \brief Round trip time estimates, by remote address
+ *
+ * The estimates are kept as in RFC 6298.  They are fed by the dialogs with
+ * the time between sending a frame and getting the reply to it.  Following
+ * Karn's algorithm, a frame that had to be retransmitted must not be used, as
+ * there is no telling which copy the reply was for.
+ *
+ * This must only be used from the thread running the peer.
+ */
+class iax2_rtt_table {
+public:
+	/*!
+	 * \brief Get the retransmission timeout for a remote address
+	 *
+	 * \return the timeout in milliseconds
+	 */
+	unsigned int get_rto(const struct sockaddr_in *sin) const;
+
+	/*!
+	 * \brief Add a round trip time measurement
+	 *
+	 * \param sin the remote address the reply came from
+	 * \param rtt the round trip time, in milliseconds
+	 */
+	void sample(const struct sockaddr_in *sin, unsigned int rtt);
+
+	/*!
+	 * \brief Back off a retransmission timeout
+	 *
+	 * \param rto the timeout from get_rto()
+	 * \param count the number of times the frame has been retransmitted
+	 *
+	 * \return rto doubled count times, but no more than IAX2_RTO_MAX
+	 */
+	static unsigned int backoff(unsigned int rto, unsigned int count);
+
+private:
+	static inline u_int64_t key(const struct sockaddr_in *sin)
+		{ return ((u_int64_t) sin->sin_addr.s_addr << 16) | sin->sin_port; }
+
+	std::tr1::unordered_map<u_int64_t, iax2_rtt> table;
+	typedef std::tr1::unordered_map<u_int64_t, iax2_rtt>::iterator table_iterator;
+	typedef std::tr1::unordered_map<u_int64_t, iax2_rtt>::const_iterator table_const_iterator;
+};
+
+#endif /* IAX2_RTT_H */
@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2006, Russell Bryant <russell@russellbryant.net> 
+ *
+ * This file is part of LibIAX2xx.
+ *
+ * LibIAX2xx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * LibIAX2xx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LibIAX2xx; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*!
+ * \file
+ * \author Russell Bryant <russell@russellbryant.net>
+ *
+ * \brief IAX2 shard group definitions
+ */
+
+#ifndef IAX2_SHARD_H
+#define IAX2_SHARD_H
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
+#include <tr1/unordered_map>
+
+using namespace std;
+
+class iax2_peer;
+
+/*!
+ * \brief A group of peers that share one local port
+ *
+ * A single peer runs everything on one thread.  To use more cores, an
+ * application creates several peers of the same type on the same port and
+ * adds them all to a shard group, one shard per peer.  Each peer is then run
+ * in its own thread, just as it would be on its own.
+ *
+ * Every shard binds its own socket to the port with SO_REUSEPORT, so the
+ * kernel spreads incoming packets across the shards.  Each shard has its own
+ * dialogs and timers, and only touches them from its own thread.
+ *
+ * The call numbers are split into one contiguous range per shard, so the
+ * owner of a full frame can be found from its destination call number.
+ * Mini and meta frames only carry the call number of the remote side, so the
+ * group also keeps a table of which shard handles the media for each remote
+ * call.  A packet that arrives on a shard that does not own its call is
+ * handed off to the shard that does.
+ *
+ * \note Registrations received by an iax2_server are kept by the shard that
+ *       received them.  Calls to a registered peer must be started on that
+ *       shard.
+ */
+class iax2_shard_group {
+public:
+	/*!
+	 * \brief Constructor for an iax2_shard_group
+	 *
+	 * \param num_shards the number of peers that will join the group
+	 */
+	iax2_shard_group(unsigned int num_shards);
+	~iax2_shard_group(void);
+
+	inline unsigned int get_num_shards(void) const
+		{ return num_shards; }
+
+	/*!
+	 * \brief Add a peer to this group
+	 *
+	 * \return the index of the shard the peer runs, or -1 if the group is full
+	 *
+	 * \note This is called by iax2_peer::join_shard_group().
+	 */
+	int join(iax2_peer *peer);
+
+	/*!
+	 * \brief Get the range of call numbers a shard hands out
+	 *
+	 * \param shard the index of the shard
+	 * \param first set to the first call number in the range
+	 * \param last set to the last call number in the range
+	 */
+	void get_call_num_range(unsigned int shard, unsigned short *first, 
+		unsigned short *last) const;
+
+	/*!
+	 * \brief Find the shard that owns a local call number
+	 */
+	unsigned int shard_for_call_num(unsigned short num) const;
+
+	/*!
+	 * \brief Record which shard handles the media for a remote call
+	 *
+	 * \param key the media key of the remote call, as built by the peer
+	 * \param shard the index of the shard
+	 */
+	void add_media_route(u_int64_t key, unsigned int shard);
+
+	/*!
+	 * \brief Forget a route added with add_media_route()
+	 *
+	 * The route is only removed if it still points to the given shard.
+	 */
+	void remove_media_route(u_int64_t key, unsigned int shard);
+
+	/*!
+	 * \brief Find the shard that handles the media for a remote call
+	 *
+	 * \return the index of the shard, or -1 if the call is not known
+	 */
+	int find_media_route(u_int64_t key);
+
+	/*!
+	 * \brief Pass a received packet to the shard that should process it
+	 *
+	 * \param shard the index of the shard
+	 * \param buf the raw packet, which is copied
+	 * \param len the length of the packet
+	 * \param sin the address the packet came from
+	 */
+	void hand_off(unsigned int shard, const unsigned char *buf, size_t len, 
+		const struct sockaddr_in *sin);
+
+private:
+	unsigned int num_shards;
+	unsigned int num_joined;
+	/*! The number of call numbers in each shard's range */
+	unsigned int call_nums_per_shard;
+	/*! The peer running each shard */
+	iax2_peer **shards;
+	pthread_mutex_t shards_lock;
+
+	/*! The shard that handles the media for each remote call */
+	tr1::unordered_map<u_int64_t, unsigned int> media_routes;
+	typedef tr1::unordered_map<u_int64_t, unsigned int>::iterator media_routes_iterator;
+	pthread_rwlock_t media_routes_lock;
+};
+
+#endif /* IAX2_SHARD_H */
@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2006, Russell Bryant <russell@russellbryant.net> 
+ *
+ * This file is part of LibIAX2xx.
+ *
+ * LibIAX2xx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * LibIAX2xx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LibIAX2xx; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*!
+ * \file
+ * \author Russell Bryant <russell@russellbryant.net>
+ *
+ * \brief IAX2 timer wheel definitions
+ */
+
+#ifndef IAX2_TIMER_WHEEL_H
+#define IAX2_TIMER_WHEEL_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <vector>
+
+class iax2_dialog;
+
+/*! The number of slots in the first level of the wheel, one per millisecond */
+#define IAX2_TIMER_WHEEL_L0_BITS 8
+#define IAX2_TIMER_WHEEL_L0_SIZE (1 << IAX2_TIMER_WHEEL_L0_BITS)
+#define IAX2_TIMER_WHEEL_L0_MASK (IAX2_TIMER_WHEEL_L0_SIZE - 1)
+
+/*! The number of slots in each of the outer levels of the wheel */
+#define IAX2_TIMER_WHEEL_LN_BITS 6
+#define IAX2_TIMER_WHEEL_LN_SIZE (1 << IAX2_TIMER_WHEEL_LN_BITS)
+#define IAX2_TIMER_WHEEL_LN_MASK (IAX2_TIMER_WHEEL_LN_SIZE - 1)
+
+/*! The number of outer levels.  Together, the levels cover 2^32 milliseconds. */
+#define IAX2_TIMER_WHEEL_LEVELS 4
+
+/*! The number of bits of a timer id that hold the index of the timer */
+#define IAX2_TIMER_INDEX_BITS 20
+#define IAX2_TIMER_INDEX_MASK ((1 << IAX2_TIMER_INDEX_BITS) - 1)
+
+/*! The number of timers allocated at a time */
+#define IAX2_TIMER_CHUNK_SIZE 1024
+
+/*!
+ * \brief A timer in a timer wheel
+ *
+ * This is used internally to a timer wheel.  Timers are never freed, they
+ * are put on a free list and reused.
+ */
+struct iax2_timer {
+	iax2_timer *next;
+	iax2_timer *prev;
+	/*! The list that the timer is on, or NULL if it is not running */
+	iax2_timer *list;
+	/*! The dialog to call back when the timer expires */
+	iax2_dialog *dialog;
+	/*! The tick, in milliseconds since the wheel was created, that the timer
+	 *  expires on */
+	unsigned int expires;
+	/*! The position of this timer in the pool */
+	unsigned int index;
+	/*! Bumped each time the timer is freed so stale ids don't match */
+	unsigned int generation;
+};
+
+/*!
+ * \brief A hierarchical timer wheel
+ *
+ * This holds the timers started by the dialogs of a peer.  Starting and
+ * stopping a timer are constant time operations, no matter how many timers
+ * are running.
+ *
+ * The first level of the wheel has a slot for each of the next 256
+ * milliseconds.  Each of the outer levels has 64 slots, each covering a full
+ * turn of the level inside it.  When the inner level wraps around, the timers
+ * in the next slot of the outer level are cascaded down into it.  A bitmap of
+ * the occupied slots of each level is kept so that the time until the next
+ * timer can be found without walking empty slots.
+ *
+ * Timers are identified by an id that holds the index of the timer in the pool
+ * and its generation, so stopping a timer that has already expired, or whose
+ * slot has been reused, is harmless.  An id of 0 is never handed out.
+ *
+ * A timer wheel must only be used from the thread running the peer.
+ */
+class iax2_timer_wheel {
+public:
+	iax2_timer_wheel(void);
+	~iax2_timer_wheel(void);
+
+	/*!
+	 * \brief Start a timer
+	 *
+	 * \param dialog the dialog to call back
+	 * \param tv the time that the timer expires
+	 *
+	 * \return the id of the timer, or 0 if no more timers could be allocated
+	 */
+	unsigned int start(iax2_dialog *dialog, struct timeval tv);
+
+	/*!
+	 * \brief Stop a timer
+	 *
+	 * \param id the id returned from start()
+	 *
+	 * \retval 0 success
+	 * \retval -1 the timer was not running
+	 */
+	int stop(unsigned int id);
+
+	/*!
+	 * \brief Determine when the wheel next needs attention
+	 *
+	 * \return the number of milliseconds until the next timer expires, 0 if
+	 *         one already has, or -1 if there are no timers running.
+	 *
+	 * This may be a bit early when the next timer is still in one of the
+	 * outer levels, since it is the time that the timer gets cascaded down.
+	 */
+	int next_expiry(void);
+
+	/*!
+	 * \brief Remove an expired timer
+	 *
+	 * \return the dialog of a timer that has expired, or NULL if none have.
+	 *
+	 * Timers are returned in the order that they expire.  It is safe to start
+	 * and stop timers between calls to this function.
+	 */
+	iax2_dialog *expire(void);
+
+	inline unsigned int get_count(void) const
+		{ return count; }
+
+private:
+	unsigned int get_tick(struct timeval tv, bool round_up) const;
+	unsigned int next_tick(void) const;
+	void add(iax2_timer *timer);
+	void unlink(iax2_timer *timer);
+	unsigned int cascade(unsigned int level, unsigned int index);
+	void run_tick(void);
+	iax2_timer *alloc(void);
+	void release(iax2_timer *timer);
+
+	/*! The time that tick 0 refers to */
+	struct timeval base;
+	/*! The next tick that has not been processed */
+	unsigned int clk;
+	/*! The number of timers running */
+	unsigned int count;
+
+	iax2_timer l0[IAX2_TIMER_WHEEL_L0_SIZE];
+	iax2_timer ln[IAX2_TIMER_WHEEL_LEVELS][IAX2_TIMER_WHEEL_LN_SIZE];
+	u_int64_t l0_map[IAX2_TIMER_WHEEL_L0_SIZE / 64];
+	u_int64_t ln_map[IAX2_TIMER_WHEEL_LEVELS];
+
+	/*! Timers that have expired but have not been returned from expire() */
+	iax2_timer expired;
+
+	std::vector<iax2_timer *> chunks;
+	iax2_timer *free_head;
+	iax2_timer *free_tail;
+};
+
+#endif /* IAX2_TIMER_WHEEL_H */
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2006, Russell Bryant <russell@russellbryant.net> 
+ *
+ * This file is part of LibIAX2xx.
+ *
+ * LibIAX2xx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * LibIAX2xx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LibIAX2xx; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*!
+ * \file
+ * \author Russell Bryant <russell@russellbryant.net>
+ *
+ * \brief IAX2 frame tracing definitions
+ */
+
+#ifndef IAX2_TRACE_H
+#define IAX2_TRACE_H
+
+#include <stdlib.h>
+#include <netinet/in.h>
+
+class iax2_frame;
+
+/*! The number of call numbers that the call filter of a tracer covers */
+#define IAX2_TRACE_CALL_NUMS 32768
+
+/*! The number of records the trace log holds before it starts dropping them */
+#define IAX2_TRACE_LOG_SIZE 256
+
+/*!
+ * \brief How much an iax2_tracer traces
+ */
+enum iax2_trace_level {
+	/*! Trace nothing */
+	IAX2_TRACE_NONE,
+	/*! Trace full frames, which covers all of the signalling */
+	IAX2_TRACE_FULL_FRAMES,
+	/*! Trace all frames, including mini and meta frames carrying media */
+	IAX2_TRACE_ALL_FRAMES,
+};
+
+/*!
+ * \brief The trace log
+ *
+ * Trace records are handed to the log, and a background thread writes them
+ * to stderr.  The thread that produced a record only has to copy it into a
+ * ring buffer.  If the writer falls behind and the ring fills up, new records
+ * are dropped, and the number dropped is reported once there is room again.
+ *
+ * There is a single trace log for the process.  Its thread is started the
+ * first time something is written to it.  The records still in the ring
+ * when the process exits are written out before it goes away.
+ */
+class iax2_trace_log {
+public:
+	/*!
+	 * \brief Add a record to the trace log
+	 *
+	 * \param text the text of the record
+	 * \param len the length of text.  Records longer than
+	 *        IAX2_FRAME_FORMAT_LEN - 1 are cut off.
+	 */
+	static void write(const char *text, size_t len);
+
+	/*!
+	 * \brief Wait until every record in the trace log has been written
+	 *
+	 * This is done automatically when the process exits.
+	 */
+	static void flush(void);
+};
+
+/*!
+ * \brief Frame tracing for a peer
+ *
+ * Each peer has its own tracer, so tracing can be turned on for a single
+ * peer.  A tracer can also be limited to a set of call numbers.  When the
+ * level is IAX2_TRACE_NONE, checking whether a frame should be traced is
+ * a single comparison.
+ *
+ * The level and the call filter may be changed from any thread while the
+ * peer is running.
+ */
+class iax2_tracer {
+public:
+	iax2_tracer(void);
+	~iax2_tracer(void);
+
+	inline enum iax2_trace_level get_level(void) const
+		{ return level; }
+	inline void set_level(enum iax2_trace_level l)
+		{ level = l; }
+
+	/*!
+	 * \brief Limit tracing to a call
+	 *
+	 * \param num the call number
+	 *
+	 * Once a call number has been added, only frames that have it as their
+	 * source or destination call number are traced.  Received mini and meta
+	 * frames only carry the call number of the remote side.
+	 */
+	void add_call(unsigned short num);
+
+	/*!
+	 * \brief Stop tracing a call added with add_call()
+	 */
+	void remove_call(unsigned short num);
+
+	/*!
+	 * \brief Remove all calls from the filter, so that every call is traced
+	 */
+	void clear_calls(void);
+
+	/*!
+	 * \brief Trace a frame that is being sent or was received
+	 *
+	 * \param frame the frame
+	 * \param sin the address the frame is going to or coming from
+	 */
+	inline void trace(const iax2_frame &frame, const struct sockaddr_in *sin)
+		{ if (level != IAX2_TRACE_NONE) trace_frame(frame, sin); }
+
+private:
+	void trace_frame(const iax2_frame &frame, const struct sockaddr_in *sin);
+	bool call_filtered(unsigned short num) const;
+
+	volatile enum iax2_trace_level level;
+	/*! The number of call numbers in the call filter */
+	volatile unsigned int num_calls;
+	/*! A bit for each call number in the call filter */
+	unsigned int *calls;
+};
+
+#endif /* IAX2_TRACE_H */
@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2006, Russell Bryant <russell@russellbryant.net> 
+ *
+ * This file is part of LibIAX2xx.
+ *
+ * LibIAX2xx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * LibIAX2xx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LibIAX2xx; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*!
+ * \file
+ * \author Russell Bryant <russell@russellbryant.net>
+ *
+ * \brief IAX2 trunking definitions
+ */
+
+#ifndef IAX2_TRUNK_H
+#define IAX2_TRUNK_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include <vector>
+#include <tr1/unordered_map>
+
+class iax2_tx_queue;
+
+/*! The largest trunk frame that is sent, to stay within a typical MTU */
+#define IAX2_TRUNK_MAX_LEN 1400
+
+/*! The most remote hosts that trunk buffers are kept for */
+#define IAX2_TRUNK_TABLE_MAX 4096
+
+/*!
+ * \brief The trunk frame being filled for one remote host
+ */
+struct iax2_trunk_bucket {
+	struct sockaddr_in sin;
+	/*! The number of bytes in buf, 0 if nothing is waiting */
+	size_t len;
+	/*! This bucket is in the pending list */
+	bool pending;
+	unsigned char buf[IAX2_TRUNK_MAX_LEN];
+};
+
+/*!
+ * \brief Combines the audio of calls to the same host into trunk frames
+ *
+ * Instead of sending a mini frame, a call adds its audio to the trunk frame
+ * for the remote address.  Every interval, one meta trunk frame is sent to
+ * each address that has audio waiting.  With many calls between two hosts,
+ * this sends one packet where there would have been one per call.
+ *
+ * This must only be used from the thread running the peer.
+ */
+class iax2_trunk {
+public:
+	iax2_trunk(iax2_tx_queue &queue);
+	~iax2_trunk(void);
+
+	/*!
+	 * \brief Set how often trunk frames are sent
+	 *
+	 * \param ms the interval in milliseconds, or 0 to turn trunking off
+	 */
+	void set_interval(unsigned int ms);
+
+	/*!
+	 * \brief Set whether each call in a trunk frame has its own timestamp
+	 *
+	 * Without them, the receiver uses the timestamp of the trunk frame for
+	 * every call in it.  They cost 2 bytes per call.
+	 */
+	inline void set_timestamps(bool on)
+		{ timestamps = on; }
+
+	inline bool is_enabled(void) const
+		{ return interval != 0; }
+
+	/*!
+	 * \brief Add the audio of a call to the trunk frame for its remote address
+	 *
+	 * \param sin the remote address
+	 * \param call_num the source call number
+	 * \param ts the low 16 bits of the timestamp, as in a mini frame
+	 * \param data the audio
+	 * \param len the length of the audio
+	 *
+	 * \retval 0 success
+	 * \retval -1 the audio does not fit in a trunk frame, send a mini frame
+	 */
+	int add(const struct sockaddr_in *sin, unsigned short call_num, u_int16_t ts,
+		const void *data, size_t len);
+
+	/*!
+	 * \brief Determine when the trunk frames are due to be sent
+	 *
+	 * \return the number of milliseconds until then, or -1 if nothing is
+	 *         waiting
+	 */
+	int next_flush_time(void) const;
+
+	/*!
+	 * \brief Queue the trunk frames for every address that has audio waiting
+	 */
+	void flush(void);
+
+	/*!
+	 * \brief Queue the trunk frame for one address now, if it has audio waiting
+	 *
+	 * A call sends this before a full frame that must not pass the audio
+	 * that came before it.
+	 */
+	void flush(const struct sockaddr_in *sin);
+
+private:
+	void send_bucket(iax2_trunk_bucket *bucket);
+
+	static inline u_int64_t key(const struct sockaddr_in *sin)
+		{ return ((u_int64_t) sin->sin_addr.s_addr << 16) | sin->sin_port; }
+
+	iax2_tx_queue &tx_queue;
+	/*! How often trunk frames are sent, in milliseconds */
+	unsigned int interval;
+	/*! Each entry carries its own timestamp */
+	bool timestamps;
+	/*! Trunk frame timestamps count from here */
+	struct timeval start;
+	/*! When the waiting trunk frames are to be sent */
+	struct timeval next_flush;
+
+	std::tr1::unordered_map<u_int64_t, iax2_trunk_bucket *> buckets;
+	typedef std::tr1::unordered_map<u_int64_t, iax2_trunk_bucket *>::iterator buckets_iterator;
+	/*! The buckets that have audio waiting */
+	std::vector<iax2_trunk_bucket *> pending;
+};
+
+#endif /* IAX2_TRUNK_H */
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2006, Russell Bryant <russell@russellbryant.net> 
+ *
+ * This file is part of LibIAX2xx.
+ *
+ * LibIAX2xx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * LibIAX2xx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LibIAX2xx; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*!
+ * \file
+ * \author Russell Bryant <russell@russellbryant.net>
+ *
+ * \brief IAX2 transmit queue definitions
+ */
+
+#ifndef IAX2_TX_QUEUE_H
+#define IAX2_TX_QUEUE_H
+
+#include <stdlib.h>
+#include <netinet/in.h>
+
+struct iax2_tx_queue_entry;
+class iax2_tracer;
+
+/*! The default number of packets a transmit queue holds before it is flushed */
+#define IAX2_DEFAULT_TX_QUEUE_SIZE 64
+
+/*! The largest packet that can be held in a transmit queue */
+#define IAX2_TX_QUEUE_MAX_PACKET_LEN 4096
+
+/*!
+ * \brief A queue of outgoing packets
+ *
+ * Frames produced while a peer handles a batch of incoming packets, commands,
+ * or timers are encoded straight into this queue instead of being sent right
+ * away.  When the batch is done, the peer flushes the queue, which sends all
+ * of the packets with as few system calls as possible.
+ *
+ * A transmit queue is bound to a single socket and must only be used from the
+ * thread running the peer.
+ */
+class iax2_tx_queue {
+public:
+	/*!
+	 * \brief Constructor for an iax2_tx_queue
+	 *
+	 * \param size the number of packets that can be queued before the queue
+	 *        has to be flushed
+	 */
+	iax2_tx_queue(unsigned int size = IAX2_DEFAULT_TX_QUEUE_SIZE);
+	~iax2_tx_queue(void);
+
+	/*!
+	 * \brief Set the socket that queued packets are sent on
+	 */
+	inline void set_sockfd(int fd)
+		{ sockfd = fd; }
+
+	inline int get_sockfd(void) const
+		{ return sockfd; }
+
+	/*!
+	 * \brief Set the tracer that frames are traced with as they are queued
+	 */
+	inline void set_tracer(iax2_tracer *t)
+		{ tracer = t; }
+
+	inline iax2_tracer *get_tracer(void) const
+		{ return tracer; }
+
+	/*!
+	 * \brief Get space to encode a packet in
+	 *
+	 * \param len the length of the packet
+	 *
+	 * \return a buffer of at least len bytes, or NULL if the packet is too
+	 *         large to be queued.
+	 *
+	 * If the queue is full, it is flushed first.  The packet is not queued
+	 * until commit() is called.
+	 */
+	unsigned char *reserve(size_t len);
+
+	/*!
+	 * \brief Queue the packet that was encoded into the buffer from reserve()
+	 *
+	 * \param len the length of the packet
+	 * \param sin the address to send the packet to
+	 */
+	void commit(size_t len, const struct sockaddr_in *sin);
+
+	/*!
+	 * \brief Queue a packet that is already encoded
+	 *
+	 * \param buf the packet
+	 * \param len the length of the packet
+	 * \param sin the address to send the packet to
+	 *
+	 * \retval 0 success
+	 * \retval -1 failure
+	 *
+	 * A packet too large to be queued is sent right away.  The packet is not
+	 * traced.
+	 */
+	int queue(const unsigned char *buf, size_t len, const struct sockaddr_in *sin);
+
+	/*!
+	 * \brief Send all of the queued packets
+	 *
+	 * \retval 0 success
+	 * \retval non-zero at least one packet could not be sent
+	 */
+	int flush(void);
+
+	inline bool empty(void) const
+		{ return !count; }
+
+private:
+	int sockfd;
+	iax2_tracer *tracer;
+	unsigned int size;
+	unsigned int count;
+	unsigned char *bufs;
+	iax2_tx_queue_entry *entries;
+};
+
+#endif /* IAX2_TX_QUEUE_H */
@@ -90,7 +90,7 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	iax2_frame frame_accept = iax2_frame(pkt_buf, res);
+	iax2_frame frame_accept(pkt_buf, res);
 	if (frame_accept.get_type() != IAX2_FRAME_TYPE_IAX2) {
 		printf("Did not receive ACCEPT\n");
 		exit(1);
@@ -89,7 +89,7 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	iax2_frame frame_accept = iax2_frame(pkt_buf, res);
+	iax2_frame frame_accept(pkt_buf, res);
 	if (frame_accept.get_type() != IAX2_FRAME_TYPE_IAX2 || frame_accept.get_subclass() != IAX2_SUBCLASS_ACCEPT) {
 		printf("Did not receive ACCEPT\n");
 		exit(1);
@@ -114,7 +114,7 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	iax2_frame frame_answer = iax2_frame(pkt_buf, res);
+	iax2_frame frame_answer(pkt_buf, res);
 	if (frame_answer.get_type() != IAX2_FRAME_TYPE_CONTROL || frame_answer.get_subclass() != 4) {
 		printf("Did not receive ANSWER\n");
 		exit(1);
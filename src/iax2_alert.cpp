@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2006, Russell Bryant <russell@russellbryant.net> 
+ *
+ * This file is part of LibIAX2xx.
+ *
+ * LibIAX2xx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * LibIAX2xx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LibIAX2xx; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*!
+ * \file
+ * \author Russell Bryant <russell@russellbryant.net>
+ *
+ * \brief IAX2 alert descriptor
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/* eventfd() is Linux only.  Everywhere else, a pipe is used. */
+#ifdef __linux__
+#define HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+using namespace std;
+
+#include "iax2/iax2_alert.h"
+
+iax2_alert::iax2_alert(void)
+{
+	fds[0] = fds[1] = -1;
+}
+
+iax2_alert::~iax2_alert(void)
+{
+	if (fds[1] > -1 && fds[1] != fds[0])
+		close(fds[1]);
+	if (fds[0] > -1)
+		close(fds[0]);
+}
+
+int iax2_alert::open(void)
+{
+#ifdef HAVE_EVENTFD
+	if ((fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK)) < 0) {
+		printf("Failed to create alert eventfd! (%s)\n", strerror(errno));
+		return -1;
+	}
+#else
+	if (pipe(fds)) {
+		printf("Failed to create alert pipe! (%s)\n", strerror(errno));
+		fds[0] = fds[1] = -1;
+		return -1;
+	}
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+#endif
+
+	return 0;
+}
+
+void iax2_alert::signal(void)
+{
+#ifdef HAVE_EVENTFD
+	eventfd_write(fds[1], 1);
+#else
+	char alert = 0;
+	write(fds[1], &alert, sizeof(alert));
+#endif
+}
+
+void iax2_alert::clear(void)
+{
+#ifdef HAVE_EVENTFD
+	eventfd_t value;
+	eventfd_read(fds[0], &value);
+#else
+	char alerts[32];
+	while (read(fds[0], alerts, sizeof(alerts)) > 0);
+#endif
+}
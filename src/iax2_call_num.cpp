@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2006, Russell Bryant <russell@russellbryant.net> 
+ *
+ * This file is part of LibIAX2xx.
+ *
+ * LibIAX2xx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * LibIAX2xx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LibIAX2xx; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*!
+ * \file
+ * \author Russell Bryant <russell@russellbryant.net>
+ *
+ * \brief IAX2 call number allocation
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+using namespace std;
+
+#include "iax2/iax2_call_num.h"
+#include "iax2/time.h"
+
+using namespace iax2xx;
+
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+
+iax2_call_num_allocator::iax2_call_num_allocator(void) :
+	quarantine_head(0), quarantine_count(0)
+{
+	quarantine = (iax2_quarantined_call_num *) 
+		calloc(IAX2_MAX_CALL_NUMS, sizeof(*quarantine));
+	start = tvnow();
+
+	set_range(1, IAX2_MAX_CALL_NUMS - 1);
+}
+
+iax2_call_num_allocator::~iax2_call_num_allocator(void)
+{
+	free(quarantine);
+}
+
+void iax2_call_num_allocator::set_range(unsigned short first, unsigned short last)
+{
+	if (!first)
+		first = 1;
+	if (last >= IAX2_MAX_CALL_NUMS)
+		last = IAX2_MAX_CALL_NUMS - 1;
+
+	// Numbers outside of the range are marked as taken for good, so alloc()
+	// only has to look for a clear bit.
+	for (unsigned int i = 0; i < IAX2_MAX_CALL_NUMS / BITS_PER_WORD; i++)
+		bits[i] = ~0UL;
+	for (unsigned int num = first; num <= last; num++)
+		bits[num / BITS_PER_WORD] &= ~(1UL << (num % BITS_PER_WORD));
+
+	first_word = first / BITS_PER_WORD;
+	num_words = last / BITS_PER_WORD - first_word + 1;
+	next_word = first_word;
+}
+
+unsigned short iax2_call_num_allocator::alloc(void)
+{
+	unsigned int begin = next_word - first_word;
+
+	for (unsigned int n = 0; n < num_words; n++) {
+		unsigned int word = first_word + (begin + n) % num_words;
+		unsigned long old = bits[word];
+
+		// Another thread may take a bit first, so try again with what is
+		// left of the word until it is full.
+		while (~old) {
+			unsigned int bit = __builtin_ctzl(~old);
+			if (__sync_bool_compare_and_swap(&bits[word], old, old | (1UL << bit))) {
+				next_word = word;
+				return word * BITS_PER_WORD + bit;
+			}
+			old = bits[word];
+		}
+	}
+
+	return 0;
+}
+
+void iax2_call_num_allocator::release(unsigned short num)
+{
+	if (!num || num >= IAX2_MAX_CALL_NUMS)
+		return;
+
+	// It was never handed out, so there is nothing to give back
+	if (!(bits[num / BITS_PER_WORD] & (1UL << (num % BITS_PER_WORD))))
+		return;
+
+	expire();
+
+	// Every number is in quarantine at most once, so this only happens if a
+	// number was released twice.  Make room by ending the oldest one early.
+	if (quarantine_count == IAX2_MAX_CALL_NUMS) {
+		unsigned short oldest = quarantine[quarantine_head].num;
+		__sync_fetch_and_and(&bits[oldest / BITS_PER_WORD], ~(1UL << (oldest % BITS_PER_WORD)));
+		quarantine_head = (quarantine_head + 1) % IAX2_MAX_CALL_NUMS;
+		quarantine_count--;
+	}
+
+	iax2_quarantined_call_num *entry = 
+		&quarantine[(quarantine_head + quarantine_count) % IAX2_MAX_CALL_NUMS];
+	entry->num = num;
+	entry->expires = now() + IAX2_CALL_NUM_QUARANTINE;
+	quarantine_count++;
+}
+
+void iax2_call_num_allocator::expire(void)
+{
+	if (!quarantine_count)
+		return;
+
+	unsigned int t = now();
+
+	while (quarantine_count) {
+		iax2_quarantined_call_num *entry = &quarantine[quarantine_head];
+		if ((int) (t - entry->expires) < 0)
+			break;
+
+		__sync_fetch_and_and(&bits[entry->num / BITS_PER_WORD], 
+			~(1UL << (entry->num % BITS_PER_WORD)));
+		quarantine_head = (quarantine_head + 1) % IAX2_MAX_CALL_NUMS;
+		quarantine_count--;
+	}
+}
+
+unsigned int iax2_call_num_allocator::now(void) const
+{
+	return tvdiff_ms(tvnow(), start);
+}
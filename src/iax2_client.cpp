@@ -63,25 +63,32 @@ iax2_client::~iax2_client(void)
 void iax2_client::process_incoming_frame(iax2_frame &frame, const struct sockaddr_in *sin)
 {
 	iax2_dialog *dialog = NULL;
+	unsigned short num;
 
  	if (frame.get_shell() == IAX2_FRAME_FULL &&
 	    frame.get_type() == IAX2_FRAME_TYPE_IAX2 &&
 	    frame.get_subclass() == IAX2_SUBCLASS_NEW) {
-		if (!(dialog = new iax2_call_dialog(this, get_next_call_num(), sockfd, sin)))
+		if (!(num = get_next_call_num()))
+			return;
+		if (!(dialog = new iax2_call_dialog(this, num, sockfd, sin)))
+			return;
+		if (add_dialog(dialog))
 			return;
-		dialogs[dialog->get_call_num()] = dialog;
 	}
         // Create a new dialog for the LAG request just received	
 	else if (frame.get_shell() == IAX2_FRAME_FULL &&
 		 frame.get_type() == IAX2_FRAME_TYPE_IAX2 &&
 		 frame.get_subclass() == IAX2_SUBCLASS_LAGRQ) {
-		if (!(dialog = new iax2_lag_dialog(this, get_next_call_num(), sockfd, sin)))
+		if (!(num = get_next_call_num()))
+			return;
+		if (!(dialog = new iax2_lag_dialog(this, num, sockfd, sin)))
+			return;
+		if (add_dialog(dialog))
 			return;
-		dialogs[dialog->get_call_num()] = dialog;
 	} else {
 		// destined for an existing dialog, we hope.
 		if (frame.get_shell() == IAX2_FRAME_FULL)
-			dialog = dialogs[frame.get_dest_call_num()];
+			dialog = dialogs.find(frame.get_dest_call_num());
 		else
 			dialog = find_dialog_media(frame, sin);
 
@@ -109,10 +116,12 @@ void iax2_client::process_incoming_frame(iax2_frame &frame, const struct sockadd
 void iax2_client::handle_newcall_command(iax2_command &command)
 {
 	printf("Client newcall command ... shouldn't happen!\n");
+	release_call_num(command.get_call_num());
 }
 
 
 void iax2_client::handle_lagrq_command(iax2_command &command)
 {
 	printf("Client lag request command ... shouldn't happen!\n");
+	release_call_num(command.get_call_num());
 }
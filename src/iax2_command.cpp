@@ -84,6 +84,7 @@ const char *iax2_command::type2str(void) const
 	ST(IAX2_COMMAND_TYPE_VIDEO)
 	ST(IAX2_COMMAND_TYPE_TEXT)
 	ST(IAX2_COMMAND_TYPE_LAGRQ)
+	ST(IAX2_COMMAND_TYPE_JITTERBUFFER)
 	ST(IAX2_COMMAND_TYPE_SHUTDOWN)
 	default:
 		str = "Unknown Type, this is bad.";
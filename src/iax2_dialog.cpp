@@ -38,12 +38,14 @@ using namespace std;
 #include "iax2/iax2_peer.h"
 #include "iax2/iax2_server.h"
 #include "iax2/iax2_frame.h"
+#include "iax2/iax2_jitterbuffer.h"
 
 using namespace iax2xx;
 
 iax2_dialog::iax2_dialog(iax2_peer *peer, unsigned short num, int sock) :
 	call_num(num), dest_call_num(0), out_seq_num(0), in_seq_num(0),
-	sockfd(sock), parent_peer(peer), timer_id(0)
+	sockfd(sock), parent_peer(peer), timer_id(0), media_key(0), rtx_count(0),
+	held_frames(NULL), num_held_frames(0), vnak_sent(false)
 {
 }
 
@@ -54,32 +56,169 @@ iax2_dialog::~iax2_dialog(void)
 	// after it is gone, it will go BOOM!
 	if (timer_id)
 		parent_peer->stop_timer(timer_id);
+
+	// Likewise, media frames must not be routed to this dialog any more.
+	if (media_key)
+		parent_peer->unindex_dialog_media(this);
+
+	if (held_frames) {
+		for (unsigned int i = 0; i < IAX2_SEQ_SPACE; i++)
+			delete held_frames[i].frame;
+		delete [] held_frames;
+	}
+
+	// The call number can be handed out again once it has been quiet a while
+	if (parent_peer && call_num)
+		parent_peer->release_call_num(call_num);
+}
+
+void iax2_dialog::set_remote_call_num(unsigned short num)
+{
+	dest_call_num = num;
+
+	media_key = parent_peer->index_dialog_media(this);
+}
+
+void iax2_dialog::start_retransmit_timer(void)
+{
+	unsigned int rto = parent_peer->get_rtt_table().get_rto(&remote_addr);
+
+	if (timer_id)
+		parent_peer->stop_timer(timer_id);
+
+	rtx_sent = tvnow();
+	rtx_count = 0;
+	timer_id = parent_peer->start_timer(this, tvadd(rtx_sent, samp2tv(rto, 1000)));
+}
+
+void iax2_dialog::restart_retransmit_timer(void)
+{
+	unsigned int rto = iax2_rtt_table::backoff(
+		parent_peer->get_rtt_table().get_rto(&remote_addr), ++rtx_count);
+
+	timer_id = parent_peer->start_timer(this, tvadd(tvnow(), samp2tv(rto, 1000)));
+}
+
+void iax2_dialog::stop_retransmit_timer(void)
+{
+	if (!timer_id)
+		return;
+
+	parent_peer->stop_timer(timer_id);
+	timer_id = 0;
+
+	// Karn's algorithm: if the frame went out more than once, there is no
+	// telling which one this is the reply to.
+	if (!rtx_count)
+		parent_peer->get_rtt_table().sample(&remote_addr, tvdiff_ms(tvnow(), rtx_sent));
+}
+
+void iax2_dialog::hold_frame(const iax2_frame &frame, const struct sockaddr_in *rcv_addr)
+{
+	if (!held_frames) {
+		held_frames = new iax2_held_frame[IAX2_SEQ_SPACE];
+		for (unsigned int i = 0; i < IAX2_SEQ_SPACE; i++)
+			held_frames[i].frame = NULL;
+	}
+
+	iax2_held_frame *held = &held_frames[frame.get_out_seq_num()];
+	if (held->frame) {
+		// This one is already waiting its turn
+		return;
+	}
+
+	if (!(held->frame = frame.dup()))
+		return;
+	memcpy(&held->sin, rcv_addr, sizeof(held->sin));
+	num_held_frames++;
+}
+
+void iax2_dialog::send_vnak(const iax2_frame &frame_in)
+{
+	if (vnak_sent)
+		return;
+
+	// Unlike an ACK, a VNAK does not use up a sequence number.  The other side
+	// handles it before checking sequence numbers.
+	iax2_frame frame;
+	frame.set_direction(IAX2_DIRECTION_OUT).set_shell(IAX2_FRAME_FULL). \
+		set_type(IAX2_FRAME_TYPE_IAX2).set_subclass(IAX2_SUBCLASS_VNAK). \
+		set_source_call_num(call_num). \
+		set_dest_call_num(dest_call_num). \
+		set_in_seq_num(in_seq_num). \
+		set_out_seq_num(out_seq_num). \
+		set_timestamp(frame_in.get_timestamp()). \
+		queue(&remote_addr, parent_peer->get_tx_queue());
+
+	vnak_sent = true;
 }
 
 enum iax2_dialog_result iax2_dialog::process_incoming_frame(iax2_frame &frame_in,
 	const struct sockaddr_in *rcv_addr)
 {
-	if (frame_in.get_shell() == IAX2_FRAME_FULL) {
-		// XXX Special handling for sequence numbers on an ACK perhaps?
-
-		if (frame_in.get_out_seq_num() < in_seq_num) {
-			// This frame has already been received.  Silently ignore it.
-			printf("Duplicate frame received for call_num '%u'\n", call_num);
-			return IAX2_DIALOG_RESULT_SUCCESS;
-		} else if (frame_in.get_out_seq_num() > in_seq_num) {
-			// This frame arrived out of order.  We're still waiting for a previous frame
-			// to arrive.  For now, it is just dropped.  However, this should be queued
-			// and processed after the preceeding frames are receivied.
-			printf("Frame received out of order for call num '%u'.  Got '%u', expecting '%u'\n", 
-				call_num, frame_in.get_out_seq_num(), in_seq_num);
-			return IAX2_DIALOG_RESULT_SUCCESS;
-		}
+	if (frame_in.get_shell() != IAX2_FRAME_FULL)
+		return process_frame(frame_in, rcv_addr);
+
+	// XXX Special handling for sequence numbers on an ACK perhaps?
+
+	// A VNAK is outside of the sequence numbering, and it must get through
+	// even when frames from the other side are missing.
+	if (frame_in.get_type() == IAX2_FRAME_TYPE_IAX2
+		&& frame_in.get_subclass() == IAX2_SUBCLASS_VNAK) {
+		retransmit_from(frame_in.get_in_seq_num());
+		return IAX2_DIALOG_RESULT_SUCCESS;
+	}
+
+	// The distance ahead of the frame we expect, modulo the sequence space
+	unsigned char ahead = frame_in.get_out_seq_num() - in_seq_num;
+
+	if (ahead >= IAX2_DIALOG_REORDER_WINDOW) {
+		// This frame has already been received.  Do not process it again.
+		printf("Duplicate frame received for call_num '%u'\n", call_num);
+		process_duplicate(frame_in);
+		return IAX2_DIALOG_RESULT_SUCCESS;
+	} else if (ahead) {
+		// This frame arrived out of order.  Hold on to it until the frames
+		// before it have been received, so that they are all processed in
+		// order without waiting for the other side to send them again.
+		printf("Frame received out of order for call num '%u'.  Got '%u', expecting '%u'\n", 
+			call_num, frame_in.get_out_seq_num(), in_seq_num);
+		hold_frame(frame_in, rcv_addr);
+		send_vnak(frame_in);
+		return IAX2_DIALOG_RESULT_SUCCESS;
+	}
+
+	// Increment the counter for the next sequence number we expect to receive
+	in_seq_num++;
+	vnak_sent = false;
+
+	enum iax2_dialog_result res = process_frame(frame_in, rcv_addr);
 
-		// Increment the counter for the next sequence number we expect to receive
+	// Now process any frames that were waiting for this one
+	while (num_held_frames && res != IAX2_DIALOG_RESULT_DESTROY 
+		&& res != IAX2_DIALOG_RESULT_DELETE) {
+		iax2_held_frame *held = &held_frames[in_seq_num];
+		if (!held->frame)
+			break;
+
+		iax2_frame *frame = held->frame;
+		held->frame = NULL;
+		num_held_frames--;
 		in_seq_num++;
+
+		enum iax2_dialog_result held_res = process_frame(*frame, &held->sin);
+		delete frame;
+
+		if (held_res == IAX2_DIALOG_RESULT_DESTROY || held_res == IAX2_DIALOG_RESULT_DELETE)
+			res = held_res;
 	}
 
-	return process_frame(frame_in, rcv_addr);
+	// Frames are still waiting behind another gap
+	if (num_held_frames && res != IAX2_DIALOG_RESULT_DESTROY 
+		&& res != IAX2_DIALOG_RESULT_DELETE)
+		send_vnak(frame_in);
+
+	return res;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -112,8 +251,7 @@ enum iax2_dialog_result iax2_register_dialog::process_frame(iax2_frame &frame_in
 		return IAX2_DIALOG_RESULT_INVAL;
 
 	// Remove the timer for retransmission of the REGREQ
-	parent_peer->stop_timer(timer_id);
-	timer_id = 0;
+	stop_retransmit_timer();
 
 	// Send an ACK, which then completes this dialog.
 	iax2_frame frame;
@@ -124,7 +262,7 @@ enum iax2_dialog_result iax2_register_dialog::process_frame(iax2_frame &frame_in
 		set_in_seq_num(in_seq_num). \
 		set_out_seq_num(out_seq_num++). \
 		set_timestamp(frame_in.get_timestamp()). \
-		send(&remote_addr, sockfd);
+		queue(&remote_addr, parent_peer->get_tx_queue());
 
 	state = IAX2_REGISTER_STATE_NONE;
 	
@@ -156,12 +294,12 @@ enum iax2_dialog_result iax2_register_dialog::timer_callback(void)
 		set_type(IAX2_FRAME_TYPE_IAX2).set_subclass(IAX2_SUBCLASS_REGREQ). \
 		set_source_call_num(call_num).add_ie_string(IAX2_IE_USERNAME, username). \
 		set_in_seq_num(in_seq_num).set_out_seq_num(out_seq_num - 1). \
-		set_retransmission(true).send(&remote_addr, sockfd);
+		set_retransmission(true).queue(&remote_addr, parent_peer->get_tx_queue());
 
-	parent_peer->queue_event(new iax2_event(
-		IAX2_EVENT_TYPE_REGISTRATION_RETRANSMITTED, call_num));
+	iax2_event event(IAX2_EVENT_TYPE_REGISTRATION_RETRANSMITTED, call_num);
+	parent_peer->post_event(event);
 
-	timer_id = parent_peer->start_timer(this, tvadd(tvnow(), create_tv(1, 0)));
+	restart_retransmit_timer();
 	
 	return IAX2_DIALOG_RESULT_SUCCESS;
 }
@@ -188,9 +326,9 @@ int iax2_register_dialog::start(const char *un)
 		set_source_call_num(call_num).add_ie_string(IAX2_IE_USERNAME, username);
 
 	// just in case the packet must be retransmitted
-	timer_id = parent_peer->start_timer(this, tvadd(tvnow(), create_tv(1, 0)));
+	start_retransmit_timer();
 	
-	if (frame.send(&remote_addr, sockfd))
+	if (frame.queue(&remote_addr, parent_peer->get_tx_queue()))
 		return -1;
 
 	return 0;
@@ -228,14 +366,16 @@ enum iax2_dialog_result iax2_registrar_dialog::process_frame(iax2_frame &frame_i
 			|| frame_in.get_subclass() != IAX2_SUBCLASS_REGREQ)
 			return res;
 
-		if (!(username = frame_in.get_ie_string(IAX2_IE_USERNAME)))
+		const char *ie_username;
+		unsigned int ie_username_len;
+		if (!(ie_username = (const char *) frame_in.get_ie(IAX2_IE_USERNAME, &ie_username_len)))
 			return res;
-		username = strdup(username);
-
-		dest_call_num = frame_in.get_source_call_num();
+		username = strndup(ie_username, ie_username_len);
 
 		memcpy(&remote_addr, rcv_addr, sizeof(remote_addr));
 
+		set_remote_call_num(frame_in.get_source_call_num());
+
 		iax2_frame frame;
 		frame.set_direction(IAX2_DIRECTION_OUT).set_shell(IAX2_FRAME_FULL). \
 			set_type(IAX2_FRAME_TYPE_IAX2).set_subclass(IAX2_SUBCLASS_REGACK). \
@@ -245,7 +385,7 @@ enum iax2_dialog_result iax2_registrar_dialog::process_frame(iax2_frame &frame_i
 			set_out_seq_num(out_seq_num++). \
 			set_timestamp(frame_in.get_timestamp()). \
 			add_ie_unsigned_short(IAX2_IE_REFRESH, (unsigned short) IAX2_DEFAULT_REFRESH). \
-			send(rcv_addr, sockfd);
+			queue(rcv_addr, parent_peer->get_tx_queue());
 
 		state = IAX2_REGISTRAR_STATE_REGREQ_RCVD;
 		res = IAX2_DIALOG_RESULT_SUCCESS;
@@ -283,9 +423,9 @@ enum iax2_dialog_result iax2_registrar_dialog::timer_callback(void)
 		set_source_call_num(call_num).set_dest_call_num(dest_call_num). \
 		add_ie_unsigned_short(IAX2_IE_REFRESH, (unsigned short) IAX2_DEFAULT_REFRESH). \
 		set_in_seq_num(in_seq_num).set_out_seq_num(out_seq_num - 1). \
-		set_retransmission(true).send(&remote_addr, sockfd);
+		set_retransmission(true).queue(&remote_addr, parent_peer->get_tx_queue());
 
-	timer_id = parent_peer->start_timer(this, tvadd(tvnow(), create_tv(1, 0)));
+	restart_retransmit_timer();
 	
 	return IAX2_DIALOG_RESULT_SUCCESS;
 }
@@ -295,9 +435,12 @@ enum iax2_dialog_result iax2_registrar_dialog::timer_callback(void)
 iax2_call_dialog::iax2_call_dialog(iax2_peer *peer, unsigned short num, int sock,
 	const struct sockaddr_in *sin) :
 	iax2_dialog(peer, num, sock), state(IAX2_CALL_STATE_DOWN),
-	peer_capabilities(0), actual_formats(0)
+	peer_capabilities(0), actual_formats(0), tx_audio_format(0), tx_audio_ts(0),
+	rx_audio_format(0), rx_audio_ts(0), rx_trunk_offset(0), rx_trunk_synced(false),
+	jb(NULL), ack_pending(false), ack_ts(0)
 {
 	memcpy(&remote_addr, sin, sizeof(remote_addr));
+	rx_voice_time = tvnow();
 }
 
 iax2_call_dialog::~iax2_call_dialog(void)
@@ -307,6 +450,11 @@ iax2_call_dialog::~iax2_call_dialog(void)
 	// after it is gone, it will go BOOM!
 	if (timer_id)
 		parent_peer->stop_timer(timer_id);
+
+	set_jitterbuffer(0);
+
+	for (frame_queue_iterator i = frame_queue.begin(); i != frame_queue.end(); i++)
+		free(i->buf);
 }
 
 enum iax2_dialog_result iax2_call_dialog::process_frame(iax2_frame &frame_in, 
@@ -321,7 +469,8 @@ enum iax2_dialog_result iax2_call_dialog::process_frame(iax2_frame &frame_in,
 			return res;
 
 		start_time = tvnow();
-		dest_call_num = frame_in.get_source_call_num();
+		memcpy(&remote_addr, rcv_addr, sizeof(remote_addr));
+		set_remote_call_num(frame_in.get_source_call_num());
 		peer_capabilities = frame_in.get_ie_unsigned_long(IAX2_IE_CAPABILITY);
 		u_int32_t our_cap = parent_peer->get_capabilities();
 		u_int32_t common_cap = peer_capabilities & our_cap;
@@ -329,8 +478,6 @@ enum iax2_dialog_result iax2_call_dialog::process_frame(iax2_frame &frame_in,
 		printf("our capabilities: %u peer_capabilities: %u  common formats: %u  actual formats: %u\n", 
 			our_cap, peer_capabilities, common_cap, actual_formats);
 
-		memcpy(&remote_addr, rcv_addr, sizeof(remote_addr));
-
 		iax2_frame frame;
 		if (actual_formats) {
 			frame.set_subclass(IAX2_SUBCLASS_ACCEPT);
@@ -347,7 +494,7 @@ enum iax2_dialog_result iax2_call_dialog::process_frame(iax2_frame &frame_in,
 			set_out_seq_num(out_seq_num++). \
 			set_timestamp(0). \
 			add_ie_unsigned_long(IAX2_IE_FORMAT, actual_formats). \
-			send(&remote_addr, sockfd);
+			queue(&remote_addr, parent_peer->get_tx_queue());
 
 		if (timer_id) {
 			parent_peer->stop_timer(timer_id);
@@ -364,7 +511,7 @@ enum iax2_dialog_result iax2_call_dialog::process_frame(iax2_frame &frame_in,
 			return res;
 		}
 
-		dest_call_num = frame_in.get_source_call_num();
+		set_remote_call_num(frame_in.get_source_call_num());
 
 		iax2_frame frame;
 		frame.set_direction(IAX2_DIRECTION_OUT).set_shell(IAX2_FRAME_FULL). \
@@ -374,14 +521,12 @@ enum iax2_dialog_result iax2_call_dialog::process_frame(iax2_frame &frame_in,
 			set_in_seq_num(in_seq_num). \
 			set_out_seq_num(out_seq_num++). \
 			set_timestamp(tvdiff_ms(tvnow(), start_time)). \
-			send(&remote_addr, sockfd);
+			queue(&remote_addr, parent_peer->get_tx_queue());
 
-		if (timer_id) {
-			parent_peer->stop_timer(timer_id);
-			timer_id = 0;
-		}
+		stop_retransmit_timer();
 
 		if (frame_in.get_subclass() == IAX2_SUBCLASS_ACCEPT) {
+			actual_formats = frame_in.get_ie_unsigned_long(IAX2_IE_FORMAT);
 			res = IAX2_DIALOG_RESULT_SUCCESS;
 			state = IAX2_CALL_STATE_UP;
 		} else { // REJECT
@@ -399,8 +544,9 @@ enum iax2_dialog_result iax2_call_dialog::process_frame(iax2_frame &frame_in,
 			timer_id = 0;
 		}
 
-		parent_peer->queue_event(new iax2_event(IAX2_EVENT_TYPE_CALL_ESTABLISHED, 
-			call_num, inet_ntoa(remote_addr.sin_addr)));
+		iax2_event event(IAX2_EVENT_TYPE_CALL_ESTABLISHED, call_num, 
+			inet_ntoa(remote_addr.sin_addr), true);
+		parent_peer->post_event(event);
 	
 		res = IAX2_DIALOG_RESULT_SUCCESS;
 		state = IAX2_CALL_STATE_UP;
@@ -423,28 +569,24 @@ enum iax2_dialog_result iax2_call_dialog::process_frame(iax2_frame &frame_in,
 			|| frame_in.get_subclass() != IAX2_SUBCLASS_ACK)
 			return res;
 
+		stop_retransmit_timer();
 		res = IAX2_DIALOG_RESULT_DESTROY;
 	} else if (state == IAX2_CALL_STATE_UP) {
+		// Every full frame tells how far the other side has received, not
+		// just an ACK, since the ACK may have been folded into it.
+		if (frame_in.get_shell() == IAX2_FRAME_FULL)
+			ack_frames(frame_in.get_in_seq_num());
+
 		if (frame_in.get_shell() == IAX2_FRAME_FULL
 		    && frame_in.get_type() == IAX2_FRAME_TYPE_TEXT) {
 			unsigned int len = frame_in.get_raw_data_len() + 1;
 			char *str = (char *) alloca(len);
 			memcpy(str, frame_in.get_raw_data(), len - 1);
 			str[len - 1] = '\0';
-			parent_peer->queue_event(new iax2_event(IAX2_EVENT_TYPE_TEXT, 
-				call_num, str));
-
-			retransmit_frame_queue();
+			iax2_event event(IAX2_EVENT_TYPE_TEXT, call_num, str, true);
+			parent_peer->post_event(event);
 
-			iax2_frame frame;
-			frame.set_direction(IAX2_DIRECTION_OUT).set_shell(IAX2_FRAME_FULL). \
-				set_type(IAX2_FRAME_TYPE_IAX2).set_subclass(IAX2_SUBCLASS_ACK). \
-				set_source_call_num(call_num). \
-				set_dest_call_num(dest_call_num). \
-				set_in_seq_num(in_seq_num). \
-				set_out_seq_num(out_seq_num++). \
-				set_timestamp(tvdiff_ms(tvnow(), start_time)). \
-				send(&remote_addr, sockfd);
+			ack_received(tvdiff_ms(tvnow(), start_time));
 
 			res = IAX2_DIALOG_RESULT_SUCCESS;
 		} else if (frame_in.get_shell() == IAX2_FRAME_FULL
@@ -458,29 +600,43 @@ enum iax2_dialog_result iax2_call_dialog::process_frame(iax2_frame &frame_in,
 				set_in_seq_num(in_seq_num). \
 				set_out_seq_num(out_seq_num++). \
 				set_timestamp(tvdiff_ms(tvnow(), start_time)). \
-				send(&remote_addr, sockfd);
+				queue(&remote_addr, parent_peer->get_tx_queue());
 
-			parent_peer->queue_event(new iax2_event(IAX2_EVENT_TYPE_CALL_HANGUP,
-				call_num, inet_ntoa(remote_addr.sin_addr)));
+			iax2_event event(IAX2_EVENT_TYPE_CALL_HANGUP, call_num, 
+				inet_ntoa(remote_addr.sin_addr), true);
+			parent_peer->post_event(event);
 
 			res = IAX2_DIALOG_RESULT_DESTROY;
 		} else if (frame_in.get_shell() == IAX2_FRAME_FULL
 				&& frame_in.get_type() == IAX2_FRAME_TYPE_IAX2
 				&& frame_in.get_subclass() == IAX2_SUBCLASS_ACK) {
-			// Delete all queued full frames that have been ACKed
-			while (!frame_queue.empty()) {
-				iax2_frame *frame = frame_queue.front();
-				if (frame->get_out_seq_num() >= frame_in.get_in_seq_num())
-					break;
-				frame_queue.pop_front();
-				delete frame;
-			}
-			retransmit_frame_queue();
+			// The frames were already trimmed above
+			res = IAX2_DIALOG_RESULT_SUCCESS;
+		} else if (frame_in.get_shell() == IAX2_FRAME_MINI) {
+			process_mini_audio(frame_in.get_raw_data(), frame_in.get_raw_data_len(),
+				frame_in.get_timestamp());
+			res = IAX2_DIALOG_RESULT_SUCCESS;
+		} else if (frame_in.get_shell() == IAX2_FRAME_FULL
+				&& frame_in.get_type() == IAX2_FRAME_TYPE_VOICE) {
+			rx_audio_format = frame_in.get_format();
+			rx_audio_ts = frame_in.get_timestamp();
+			rx_trunk_synced = false;
+			rx_voice_time = tvnow();
+
+			deliver_audio(frame_in.get_raw_data(), frame_in.get_raw_data_len(), 
+				rx_audio_ts, rx_audio_format);
+
+			ack_received(rx_audio_ts);
+
+			res = IAX2_DIALOG_RESULT_SUCCESS;
 		} else if (frame_in.get_shell() == IAX2_FRAME_META
 				&& frame_in.get_meta_type() == IAX2_META_VIDEO) {
-			parent_peer->queue_event(new iax2_event(IAX2_EVENT_TYPE_VIDEO, call_num,
-				new iax2_video_event_payload(frame_in.get_raw_data(), 
-					frame_in.get_raw_data_len(), frame_in.get_timestamp())));
+			// The frame is only a view of the receive buffer, so the event
+			// borrows from it, and is copied if it has to be queued.
+			iax2_video_event_payload video(frame_in.get_raw_data(), 
+				frame_in.get_raw_data_len(), frame_in.get_timestamp(), true);
+			iax2_event event(IAX2_EVENT_TYPE_VIDEO, call_num, &video, true);
+			parent_peer->post_event(event);
 			res = IAX2_DIALOG_RESULT_SUCCESS;
 		}
 	}
@@ -492,9 +648,10 @@ enum iax2_command_result iax2_call_dialog::process_command(iax2_command &command
 {
 	enum iax2_command_result res = IAX2_COMMAND_RESULT_UNSUPPORTED;
 
-	if (command.get_type() == IAX2_COMMAND_TYPE_HANGUP) {
-		retransmit_frame_queue();
-
+	if (command.get_type() == IAX2_COMMAND_TYPE_JITTERBUFFER) {
+		set_jitterbuffer(command.get_payload_uint());
+		res = IAX2_COMMAND_RESULT_SUCCESS;
+	} else if (command.get_type() == IAX2_COMMAND_TYPE_HANGUP) {
 		iax2_frame frame;
 		frame.set_direction(IAX2_DIRECTION_OUT).set_shell(IAX2_FRAME_FULL). \
 			set_type(IAX2_FRAME_TYPE_IAX2).set_subclass(IAX2_SUBCLASS_HANGUP). \
@@ -502,26 +659,67 @@ enum iax2_command_result iax2_call_dialog::process_command(iax2_command &command
 			set_source_call_num(call_num). \
 			set_dest_call_num(dest_call_num). \
 			set_timestamp(tvdiff_ms(tvnow(), start_time)). \
-			send(&remote_addr, sockfd);
+			queue(&remote_addr, parent_peer->get_tx_queue());
+
+		ack_pending = false;
+		start_retransmit_timer();
 
 		state = IAX2_CALL_STATE_HANGUP_SENT;
 		res = IAX2_COMMAND_RESULT_SUCCESS;
 	} else if (state == IAX2_CALL_STATE_UP 
 		&& command.get_type() == IAX2_COMMAND_TYPE_TEXT) {
-		retransmit_frame_queue();
-
-		iax2_frame *frame = new iax2_frame();;
-		frame->set_direction(IAX2_DIRECTION_OUT).set_shell(IAX2_FRAME_FULL). \
+		iax2_frame frame;
+		frame.set_direction(IAX2_DIRECTION_OUT).set_shell(IAX2_FRAME_FULL). \
 			set_type(IAX2_FRAME_TYPE_TEXT). \
 			set_in_seq_num(in_seq_num).set_out_seq_num(out_seq_num++). \
 			set_source_call_num(call_num). \
 			set_dest_call_num(dest_call_num). \
 			set_timestamp(tvdiff_ms(tvnow(), start_time)). \
-			set_raw_data(command.get_payload_str(), strlen(command.get_payload_str())). \
-			send(&remote_addr, sockfd);
-		
-		frame_queue.push_back(frame);
+			set_raw_data(command.get_payload_str(), strlen(command.get_payload_str()));
+		send_reliable(frame);
 
+		res = IAX2_COMMAND_RESULT_SUCCESS;
+	} else if (state == IAX2_CALL_STATE_UP
+		&& command.get_type() == IAX2_COMMAND_TYPE_AUDIO) {
+		u_int32_t format = audio_format();
+		u_int32_t ts = tvdiff_ms(tvnow(), start_time);
+		iax2_trunk &trunk = parent_peer->get_trunk();
+
+		if (!format)
+			return res;
+
+		// Voice goes out in mini frames, except that a full voice frame
+		// tells the other side what the format is, and carries the high bits
+		// of the timestamp each time the 16 bits in a mini frame wrap.  With
+		// trunking on, the mini frames are combined with those of the other
+		// calls to the same host.
+		if (format != tx_audio_format 
+			|| (ts & 0xffff0000) != (tx_audio_ts & 0xffff0000)) {
+			iax2_frame frame;
+			frame.set_direction(IAX2_DIRECTION_OUT).set_shell(IAX2_FRAME_FULL). \
+				set_type(IAX2_FRAME_TYPE_VOICE).set_format(format). \
+				set_in_seq_num(in_seq_num).set_out_seq_num(out_seq_num++). \
+				set_source_call_num(call_num). \
+				set_dest_call_num(dest_call_num). \
+				set_timestamp(ts). \
+				set_raw_data(command.get_payload_raw(), command.get_raw_datalen());
+			// The audio waiting in the trunk frame must get there first, with
+			// the timestamp period and format that it was sent with
+			if (trunk.is_enabled())
+				trunk.flush(&remote_addr);
+			send_reliable(frame);
+			tx_audio_format = format;
+		} else if (!trunk.is_enabled() || trunk.add(&remote_addr, call_num, ts & 0xffff, 
+			command.get_payload_raw(), command.get_raw_datalen())) {
+			iax2_frame frame;
+			frame.set_direction(IAX2_DIRECTION_OUT).set_shell(IAX2_FRAME_MINI). \
+				set_source_call_num(call_num). \
+				set_timestamp(ts & 0xffff). \
+				set_raw_data(command.get_payload_raw(), command.get_raw_datalen()). \
+				queue(&remote_addr, parent_peer->get_tx_queue());
+		}
+
+		tx_audio_ts = ts;
 		res = IAX2_COMMAND_RESULT_SUCCESS;
 	} else if (state == IAX2_CALL_STATE_UP
 		&& command.get_type() == IAX2_COMMAND_TYPE_VIDEO) {
@@ -533,7 +731,7 @@ enum iax2_command_result iax2_call_dialog::process_command(iax2_command &command
 			set_meta_type(IAX2_META_VIDEO).set_source_call_num(call_num). \
 			set_timestamp(tvdiff_ms(tvnow(), start_time)). \
 			set_raw_data(command.get_payload_raw(), command.get_raw_datalen()). \
-			send(&remote_addr, sockfd);
+			queue(&remote_addr, parent_peer->get_tx_queue());
 
 		res = IAX2_COMMAND_RESULT_SUCCESS;
 	}
@@ -541,12 +739,283 @@ enum iax2_command_result iax2_call_dialog::process_command(iax2_command &command
 	return res;
 }
 
-void iax2_call_dialog::retransmit_frame_queue(void)
+u_int32_t iax2_call_dialog::audio_format(void) const
 {
-	for (frame_queue_iterator i = frame_queue.begin(); 
-		i != frame_queue.end(); i++) {
-		(*i)->set_retransmission(true).send(&remote_addr, sockfd);
+	u_int32_t audio = actual_formats & IAX2_FORMAT_AUDIO_MASK;
+
+	// choose_formats() picks a single audio format, but the format IE
+	// in an ACCEPT from someone else may have more than one set.
+	return audio & (~audio + 1);
+}
+
+void iax2_call_dialog::deliver_audio(const void *data, size_t len, u_int32_t ts,
+	u_int32_t format)
+{
+	if (jb) {
+		jb->put(data, len, ts, format, tvnow());
+		return;
+	}
+
+	// The data is only a view of the receive buffer, so the event borrows
+	// from it, and is copied if it has to be queued.
+	iax2_audio_event_payload audio(data, len, ts, format, true);
+	iax2_event event(IAX2_EVENT_TYPE_AUDIO, call_num, &audio, true);
+	parent_peer->post_event(event);
+}
+
+void iax2_call_dialog::set_jitterbuffer(unsigned int interval)
+{
+	if (jb) {
+		parent_peer->remove_jitterbuffer(call_num);
+		delete jb;
+		jb = NULL;
+	}
+
+	if (!interval)
+		return;
+
+	jb = new iax2_jitterbuffer(interval);
+	parent_peer->add_jitterbuffer(call_num, jb);
+}
+
+int iax2_call_dialog::send_reliable(const iax2_frame &frame)
+{
+	iax2_tx_queue &tx_queue = parent_peer->get_tx_queue();
+	iax2_unacked_frame unacked;
+	iax2_tracer *tracer;
+	bool was_empty;
+
+	if (!(unacked.len = frame.get_wire_len()) 
+		|| !(unacked.buf = (unsigned char *) malloc(unacked.len)))
+		return -1;
+
+	if (frame.encode(unacked.buf)) {
+		free(unacked.buf);
+		return -1;
 	}
+
+	if ((tracer = tx_queue.get_tracer()))
+		tracer->trace(frame, &remote_addr);
+	tx_queue.queue(unacked.buf, unacked.len, &remote_addr);
+
+	// This frame acknowledges everything received so far
+	ack_pending = false;
+
+	// Every copy sent from now on is a retransmission
+	((iax2_full_header *) unacked.buf)->dcallno |= htons(0x8000);
+
+	unacked.out_seq_num = frame.get_out_seq_num();
+	unacked.sent = tvnow();
+	unacked.deadline = tvadd(unacked.sent, 
+		samp2tv(parent_peer->get_rtt_table().get_rto(&remote_addr), 1000));
+	unacked.retries = 0;
+
+	was_empty = frame_queue.empty();
+	frame_queue.push_back(unacked);
+
+	if (was_empty || tvdiff_ms(unacked.deadline, timer_time) < 0)
+		schedule_timer();
+
+	return 0;
+}
+
+void iax2_call_dialog::ack_frames(unsigned char seq)
+{
+	struct timeval now = tvnow();
+	bool trimmed = false;
+	int rtt = -1;
+
+	while (!frame_queue.empty()) {
+		iax2_unacked_frame &unacked = frame_queue.front();
+
+		// Everything before seq has been received, modulo the sequence space
+		if ((unsigned char) (seq - unacked.out_seq_num - 1) >= IAX2_DIALOG_REORDER_WINDOW)
+			break;
+
+		// Karn's algorithm: only time frames that were sent once
+		if (!unacked.retries)
+			rtt = tvdiff_ms(now, unacked.sent);
+
+		free(unacked.buf);
+		frame_queue.pop_front();
+		trimmed = true;
+	}
+
+	if (rtt >= 0)
+		parent_peer->get_rtt_table().sample(&remote_addr, rtt);
+
+	if (trimmed)
+		schedule_timer();
+}
+
+void iax2_call_dialog::retransmit_frames(void)
+{
+	unsigned int rto = parent_peer->get_rtt_table().get_rto(&remote_addr);
+	struct timeval now = tvnow();
+
+	for (frame_queue_iterator i = frame_queue.begin(); i != frame_queue.end(); i++) {
+		if (tvdiff_ms(i->deadline, now) <= 0)
+			resend_frame(*i, rto, now);
+	}
+
+	schedule_timer();
+}
+
+void iax2_call_dialog::retransmit_from(unsigned char seq)
+{
+	if (state != IAX2_CALL_STATE_UP)
+		return;
+
+	// Everything before seq made it, and everything left has to be resent
+	ack_frames(seq);
+
+	if (frame_queue.empty())
+		return;
+
+	unsigned int rto = parent_peer->get_rtt_table().get_rto(&remote_addr);
+	struct timeval now = tvnow();
+
+	for (frame_queue_iterator i = frame_queue.begin(); i != frame_queue.end(); i++)
+		resend_frame(*i, rto, now);
+
+	schedule_timer();
+}
+
+void iax2_call_dialog::resend_frame(iax2_unacked_frame &unacked, unsigned int rto,
+	const struct timeval &now)
+{
+	iax2_tx_queue &tx_queue = parent_peer->get_tx_queue();
+	iax2_tracer *tracer;
+
+	if ((tracer = tx_queue.get_tracer())) {
+		iax2_frame frame(unacked.buf, unacked.len, true);
+		frame.set_direction(IAX2_DIRECTION_OUT);
+		tracer->trace(frame, &remote_addr);
+	}
+	tx_queue.queue(unacked.buf, unacked.len, &remote_addr);
+
+	unacked.retries++;
+	unacked.deadline = tvadd(now, samp2tv(iax2_rtt_table::backoff(rto, unacked.retries), 1000));
+}
+
+void iax2_call_dialog::schedule_timer(void)
+{
+	bool armed = false;
+
+	if (timer_id) {
+		parent_peer->stop_timer(timer_id);
+		timer_id = 0;
+	}
+
+	if (ack_pending) {
+		timer_time = ack_deadline;
+		armed = true;
+	}
+
+	for (frame_queue_iterator i = frame_queue.begin(); i != frame_queue.end(); i++) {
+		if (!armed || tvdiff_ms(i->deadline, timer_time) < 0) {
+			timer_time = i->deadline;
+			armed = true;
+		}
+	}
+
+	if (armed)
+		timer_id = parent_peer->start_timer(this, timer_time);
+}
+
+void iax2_call_dialog::ack_received(u_int32_t ts)
+{
+	unsigned int delay = parent_peer->get_ack_delay();
+
+	if (!delay) {
+		send_ack(ts);
+		return;
+	}
+
+	ack_ts = ts;
+	if (ack_pending)
+		return;
+
+	ack_pending = true;
+	ack_deadline = tvadd(tvnow(), samp2tv(delay, 1000));
+	if (!timer_id || tvdiff_ms(ack_deadline, timer_time) < 0)
+		schedule_timer();
+}
+
+void iax2_call_dialog::send_ack(u_int32_t ts)
+{
+	iax2_frame frame;
+	frame.set_direction(IAX2_DIRECTION_OUT).set_shell(IAX2_FRAME_FULL). \
+		set_type(IAX2_FRAME_TYPE_IAX2).set_subclass(IAX2_SUBCLASS_ACK). \
+		set_source_call_num(call_num). \
+		set_dest_call_num(dest_call_num). \
+		set_in_seq_num(in_seq_num). \
+		set_out_seq_num(out_seq_num++). \
+		set_timestamp(ts). \
+		queue(&remote_addr, parent_peer->get_tx_queue());
+
+	ack_pending = false;
+}
+
+u_int32_t iax2_call_dialog::unwrap_mini_ts(u_int32_t last, unsigned short ts16)
+{
+	u_int32_t ts = (last & 0xffff0000) | ts16;
+
+	if (ts < last && last - ts > 0x8000)
+		ts += 0x10000;
+	else if (ts > last && ts - last > 0x8000 && (ts & 0xffff0000))
+		ts -= 0x10000;
+
+	return ts;
+}
+
+void iax2_call_dialog::process_mini_audio(const void *data, size_t len, unsigned short ts16)
+{
+	// A mini frame only has the low 16 bits of the timestamp, so the rest
+	// comes from the audio received before it.  The high bits only ever come
+	// from a full voice frame, since a guess across a wrap can be wrong.
+	u_int32_t ts = unwrap_mini_ts(rx_audio_ts, ts16);
+	if (ts > rx_audio_ts && (ts & 0xffff0000) == (rx_audio_ts & 0xffff0000))
+		rx_audio_ts = ts;
+
+	deliver_audio(data, len, ts, rx_audio_format ? rx_audio_format : audio_format());
+}
+
+void iax2_call_dialog::process_trunk_call(const iax2_frame &trunk, 
+	const iax2_trunk_call &call)
+{
+	if (state != IAX2_CALL_STATE_UP)
+		return;
+
+	if (trunk.has_trunk_timestamps()) {
+		process_mini_audio(call.data, call.len, call.timestamp);
+		return;
+	}
+
+	// The trunk timestamp is on the clock of the whole trunk, not of this
+	// call.  The first trunk frame after the call's last full voice frame
+	// lines the two up, going by how long ago that frame arrived.
+	if (!rx_trunk_synced) {
+		rx_trunk_offset = rx_audio_ts + tvdiff_ms(tvnow(), rx_voice_time) 
+			- trunk.get_timestamp();
+		rx_trunk_synced = true;
+	}
+
+	u_int32_t ts = trunk.get_timestamp() + rx_trunk_offset;
+	if (ts > rx_audio_ts)
+		rx_audio_ts = ts;
+
+	deliver_audio(call.data, call.len, ts, rx_audio_format ? rx_audio_format : audio_format());
+}
+
+void iax2_call_dialog::process_duplicate(const iax2_frame &frame)
+{
+	if (state != IAX2_CALL_STATE_UP || (frame.get_type() == IAX2_FRAME_TYPE_IAX2 
+		&& frame.get_subclass() == IAX2_SUBCLASS_ACK))
+		return;
+
+	// The ACK got lost, so waiting any longer would only bring more of these
+	send_ack(frame.get_timestamp());
 }
 
 enum iax2_dialog_result iax2_call_dialog::timer_callback(void)
@@ -559,23 +1028,29 @@ enum iax2_dialog_result iax2_call_dialog::timer_callback(void)
 			set_source_call_num(call_num).add_ie_unsigned_short(IAX2_IE_VERSION, 2). \
 			add_ie_unsigned_long(IAX2_IE_CAPABILITY, parent_peer->get_capabilities()). \
 			add_ie_unsigned_long(IAX2_IE_FORMAT, parent_peer->get_preferred_format()). \
-			set_retransmission(true).send(&remote_addr, sockfd);
+			set_retransmission(true).queue(&remote_addr, parent_peer->get_tx_queue());
 	} else if (state == IAX2_CALL_STATE_HANGUP_SENT) {
 		iax2_frame frame;
 		frame.set_direction(IAX2_DIRECTION_OUT).set_shell(IAX2_FRAME_FULL). \
 			set_type(IAX2_FRAME_TYPE_IAX2).set_subclass(IAX2_SUBCLASS_HANGUP). \
 			set_in_seq_num(in_seq_num).set_out_seq_num(out_seq_num - 1). \
-			set_source_call_num(call_num). \
-			set_retransmission(true).send(&remote_addr, sockfd);
+			set_source_call_num(call_num).set_dest_call_num(dest_call_num). \
+			set_timestamp(tvdiff_ms(tvnow(), start_time)). \
+			set_retransmission(true).queue(&remote_addr, parent_peer->get_tx_queue());
 	} else if (state == IAX2_CALL_STATE_UP) {
-		retransmit_frame_queue();
+		// The timer has fired; the queued frames keep their own deadlines
+		timer_id = 0;
+		if (ack_pending && tvdiff_ms(ack_deadline, tvnow()) <= 0)
+			send_ack(ack_ts);
+		retransmit_frames();
+		return IAX2_DIALOG_RESULT_SUCCESS;
 	} else {
 		printf("timer_callback for call dialog in weird state '%d'\n", state);
 		// return early so that the timer is not restarted
 		return IAX2_DIALOG_RESULT_SUCCESS;
 	}
 
-	timer_id = parent_peer->start_timer(this, tvadd(tvnow(), create_tv(1, 0)));
+	restart_retransmit_timer();
 	
 	return IAX2_DIALOG_RESULT_SUCCESS;
 }
@@ -585,7 +1060,7 @@ int iax2_call_dialog::start(void)
 	state = IAX2_CALL_STATE_NEW_SENT;
 	
 	// just in case the packet must be retransmitted
-	timer_id = parent_peer->start_timer(this, tvadd(tvnow(), create_tv(1, 0)));
+	start_retransmit_timer();
 
 	start_time = tvnow();
 	
@@ -598,7 +1073,7 @@ int iax2_call_dialog::start(void)
 		add_ie_unsigned_long(IAX2_IE_CAPABILITY, parent_peer->get_capabilities()). \
 		add_ie_unsigned_long(IAX2_IE_FORMAT, parent_peer->get_preferred_format());
 	
-	if (frame.send(&remote_addr, sockfd))
+	if (frame.queue(&remote_addr, parent_peer->get_tx_queue()))
 		return -1;
 
 	return 0;
@@ -35,16 +35,21 @@ using namespace std;
 #include "iax2/iax2_event.h"
 
 iax2_event::iax2_event(enum iax2_event_type t, unsigned short num) :
-	type(t), payload_type(IAX2_EVENT_PAYLOAD_TYPE_NONE), call_num(num)
+	type(t), payload_type(IAX2_EVENT_PAYLOAD_TYPE_NONE), call_num(num), borrowed(false)
 {
 	payload.raw = NULL;
 }
 
 iax2_event::iax2_event(enum iax2_event_type t, unsigned short num,
-	const void *data, unsigned int data_len) : 
+	const void *data, unsigned int data_len, bool borrow) : 
 	type(t), payload_type(IAX2_EVENT_PAYLOAD_TYPE_RAW), call_num(num),
-	raw_payload_len(data_len)
+	borrowed(borrow), raw_payload_len(data_len)
 {
+	if (borrowed) {
+		payload.raw = (void *) data;
+		return;
+	}
+
 	if (!(payload.raw = malloc(data_len)))
 		return;
 	
@@ -52,34 +57,73 @@ iax2_event::iax2_event(enum iax2_event_type t, unsigned short num,
 }
 
 iax2_event::iax2_event(enum iax2_event_type t, unsigned short num,
-	const char *s) : 
-	type(t), payload_type(IAX2_EVENT_PAYLOAD_TYPE_STR), call_num(num)
+	const char *s, bool borrow) : 
+	type(t), payload_type(IAX2_EVENT_PAYLOAD_TYPE_STR), call_num(num),
+	borrowed(borrow)
 {
-	payload.str = s ? strdup(s) : NULL;
+	payload.str = (s && !borrowed) ? strdup(s) : s;
 }
 
 iax2_event::iax2_event(enum iax2_event_type t, unsigned short num,
 	unsigned int u) : 
-	type(t), payload_type(IAX2_EVENT_PAYLOAD_TYPE_UINT), call_num(num)
+	type(t), payload_type(IAX2_EVENT_PAYLOAD_TYPE_UINT), call_num(num), borrowed(false)
 {
 	payload.uint = u;
 }
 
 iax2_event::iax2_event(enum iax2_event_type t, unsigned short num,
-	struct iax2_video_event_payload *vid) : 
-	type(t), payload_type(IAX2_EVENT_PAYLOAD_TYPE_VIDEO), call_num(num)
+	struct iax2_video_event_payload *vid, bool borrow) : 
+	type(t), payload_type(IAX2_EVENT_PAYLOAD_TYPE_VIDEO), call_num(num),
+	borrowed(borrow)
 {
 	payload.video_frame = vid;
 }
 
+iax2_event::iax2_event(enum iax2_event_type t, unsigned short num,
+	struct iax2_audio_event_payload *aud, bool borrow) : 
+	type(t), payload_type(IAX2_EVENT_PAYLOAD_TYPE_AUDIO), call_num(num),
+	borrowed(borrow)
+{
+	payload.audio_frame = aud;
+}
+
 iax2_event::~iax2_event(void)
 {
+	if (borrowed)
+		return;
+
 	if (payload_type == IAX2_EVENT_PAYLOAD_TYPE_RAW && payload.raw)
 		free(payload.raw);
 	else if (payload_type == IAX2_EVENT_PAYLOAD_TYPE_STR && payload.str)
 		free((void *) payload.str);
 	else if (payload_type == IAX2_EVENT_PAYLOAD_TYPE_VIDEO && payload.video_frame)
 		delete payload.video_frame;
+	else if (payload_type == IAX2_EVENT_PAYLOAD_TYPE_AUDIO && payload.audio_frame)
+		delete payload.audio_frame;
+}
+
+iax2_event *iax2_event::dup(void) const
+{
+	switch (payload_type) {
+	case IAX2_EVENT_PAYLOAD_TYPE_RAW:
+		return new iax2_event(type, call_num, payload.raw, raw_payload_len);
+	case IAX2_EVENT_PAYLOAD_TYPE_STR:
+		return new iax2_event(type, call_num, payload.str);
+	case IAX2_EVENT_PAYLOAD_TYPE_UINT:
+		return new iax2_event(type, call_num, payload.uint);
+	case IAX2_EVENT_PAYLOAD_TYPE_VIDEO:
+		return new iax2_event(type, call_num, new iax2_video_event_payload(
+			payload.video_frame->m_frame, payload.video_frame->m_frame_len,
+			payload.video_frame->m_timestamp));
+	case IAX2_EVENT_PAYLOAD_TYPE_AUDIO:
+		return new iax2_event(type, call_num, new iax2_audio_event_payload(
+			payload.audio_frame->m_frame, payload.audio_frame->m_frame_len,
+			payload.audio_frame->m_timestamp, payload.audio_frame->m_format));
+	case IAX2_EVENT_PAYLOAD_TYPE_NONE:
+		break;
+	}
+
+	return new iax2_event(type, call_num);
 }
 
 const char *iax2_event::type2str(void) const
@@ -125,22 +169,55 @@ void iax2_event::print(void) const
 		printf("Video frame, Len: %u, Timestamp: %u\n\n", 
 			payload.video_frame->m_frame_len, payload.video_frame->m_timestamp);
 		break;
+	case IAX2_EVENT_PAYLOAD_TYPE_AUDIO:
+		printf("Audio frame, Len: %u, Timestamp: %u, Format: %u\n\n", 
+			(unsigned int) payload.audio_frame->m_frame_len, 
+			payload.audio_frame->m_timestamp, payload.audio_frame->m_format);
+		break;
 	}
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 
 iax2_video_event_payload::iax2_video_event_payload(const void *frame, size_t frame_len,
-	unsigned short timestamp)
+	unsigned short timestamp, bool borrow)
 {
-	m_frame = malloc(frame_len);
-	memcpy((void *) m_frame, frame, frame_len);
+	if (borrow)
+		m_frame = frame;
+	else {
+		m_frame = malloc(frame_len);
+		memcpy((void *) m_frame, frame, frame_len);
+	}
 	m_frame_len = frame_len;
 	m_timestamp = timestamp;
+	m_borrowed = borrow;
 }
 
 iax2_video_event_payload::~iax2_video_event_payload()
 {
-	if (m_frame)
+	if (m_frame && !m_borrowed)
+		free((void *) m_frame);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+iax2_audio_event_payload::iax2_audio_event_payload(const void *frame, size_t frame_len,
+	u_int32_t timestamp, u_int32_t format, bool borrow)
+{
+	if (borrow)
+		m_frame = frame;
+	else {
+		m_frame = malloc(frame_len);
+		memcpy((void *) m_frame, frame, frame_len);
+	}
+	m_frame_len = frame_len;
+	m_timestamp = timestamp;
+	m_format = format;
+	m_borrowed = borrow;
+}
+
+iax2_audio_event_payload::~iax2_audio_event_payload()
+{
+	if (m_frame && !m_borrowed)
 		free((void *) m_frame);
 }
@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2006, Russell Bryant <russell@russellbryant.net> 
+ *
+ * This file is part of LibIAX2xx.
+ *
+ * LibIAX2xx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * LibIAX2xx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LibIAX2xx; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*!
+ * \file
+ * \author Russell Bryant <russell@russellbryant.net>
+ *
+ * \brief IAX2 event queue
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#ifdef POLL_COMPAT
+#include "poll-compat.h"
+#else
+#include <poll.h>
+#endif
+
+#include <queue>
+
+using namespace std;
+
+#include "iax2/iax2_event_queue.h"
+#include "iax2/iax2_event.h"
+#include "iax2/time.h"
+
+using namespace iax2xx;
+
+iax2_event_queue::iax2_event_queue(void) :
+	tail(0), head(0), sleeping(0), overflow_count(0), interrupted(false),
+	use_alert(false)
+{
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+iax2_event_queue::~iax2_event_queue(void)
+{
+	while (head != tail)
+		delete ring[head++ & (IAX2_EVENT_RING_SIZE - 1)];
+	while (!overflow.empty()) {
+		delete overflow.front();
+		overflow.pop();
+	}
+
+	pthread_mutex_destroy(&lock);
+	pthread_cond_destroy(&cond);
+}
+
+void iax2_event_queue::push(iax2_event *event)
+{
+	unsigned int cur = tail;
+
+	// Once anything has gone to the overflow list, everything has to until it
+	// has been emptied, or events would get out of order.
+	if (overflow_count || cur - head == IAX2_EVENT_RING_SIZE) {
+		pthread_mutex_lock(&lock);
+		overflow.push(event);
+		overflow_count++;
+		pthread_mutex_unlock(&lock);
+	} else {
+		ring[cur & (IAX2_EVENT_RING_SIZE - 1)] = event;
+		// The event has to be in the ring before the consumer can see it there
+		__sync_synchronize();
+		tail = cur + 1;
+	}
+
+	// The consumer sets sleeping and then checks for events, while this adds
+	// an event and then checks sleeping.  The barriers on both sides make
+	// sure that at least one of them sees what the other did.
+	__sync_synchronize();
+	if (!sleeping)
+		return;
+
+	if (use_alert) {
+		// Only the first event after the consumer went to sleep signals
+		if (__sync_bool_compare_and_swap(&sleeping, 1, 0))
+			alert.signal();
+	} else {
+		pthread_mutex_lock(&lock);
+		pthread_cond_signal(&cond);
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+unsigned int iax2_event_queue::pop(iax2_event **events, unsigned int max)
+{
+	unsigned int cur, num;
+
+	for (;;) {
+		cur = head;
+		num = tail - cur;
+
+		__sync_synchronize();
+
+		if (num > max)
+			num = max;
+		for (unsigned int i = 0; i < num; i++)
+			events[i] = ring[(cur + i) & (IAX2_EVENT_RING_SIZE - 1)];
+
+		// The slots must be read before the producer can reuse them
+		__sync_synchronize();
+		head = cur + num;
+
+		if (num < max && overflow_count) {
+			// Only take from the overflow list once the ring is empty, since
+			// anything in the ring is older.  While the overflow list is in
+			// use, the producer does not add to the ring.
+			pthread_mutex_lock(&lock);
+			if (head == tail) {
+				for (; num < max && !overflow.empty(); num++) {
+					events[num] = overflow.front();
+					overflow.pop();
+				}
+				overflow_count = overflow.size();
+			}
+			pthread_mutex_unlock(&lock);
+		}
+
+		// If the descriptor is still armed, nothing has been pushed since.
+		// Otherwise, reset and re-arm it, and look once more for events that
+		// were pushed before it was armed.
+		if (num || !use_alert || sleeping)
+			return num;
+
+		alert.clear();
+		sleeping = 1;
+		__sync_synchronize();
+	}
+}
+
+void iax2_event_queue::wait(int timeout)
+{
+	struct timespec ts;
+	struct timeval tv;
+
+	if (use_alert) {
+		struct pollfd pfd;
+
+		// pop() leaves the descriptor armed when the queue is empty
+		pfd.fd = alert.get_fd();
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (!interrupted)
+			poll(&pfd, 1, timeout);
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	sleeping = 1;
+	__sync_synchronize();
+	if (head == tail && !overflow_count && !interrupted) {
+		if (timeout < 0)
+			pthread_cond_wait(&cond, &lock);
+		else {
+			tv = tvadd(tvnow(), samp2tv(timeout, 1000));
+			ts.tv_sec = tv.tv_sec;
+			ts.tv_nsec = tv.tv_usec * 1000;
+			pthread_cond_timedwait(&cond, &lock, &ts);
+		}
+	}
+	sleeping = 0;
+	pthread_mutex_unlock(&lock);
+}
+
+int iax2_event_queue::open_fd(void)
+{
+	if (use_alert)
+		return 0;
+
+	if (alert.open())
+		return -1;
+
+	// Armed from the start, so the first event signals it
+	sleeping = 1;
+	use_alert = true;
+
+	return 0;
+}
+
+void iax2_event_queue::interrupt(void)
+{
+	pthread_mutex_lock(&lock);
+	interrupted = true;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+
+	if (use_alert)
+		alert.signal();
+}
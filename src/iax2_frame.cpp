@@ -40,49 +40,140 @@
 using namespace std;
 
 #include "iax2/iax2_frame.h"
+#include "iax2/iax2_tx_queue.h"
+#include "iax2/iax2_trace.h"
 
 iax2_frame::iax2_frame(void) :
 	direction(IAX2_DIRECTION_UNKNOWN), shell(IAX2_FRAME_UNDEFINED), 
 	type(IAX2_FRAME_TYPE_UNDEFINED), source_call_num(0), dest_call_num(0),
 	timestamp(0), out_seq_num(0), in_seq_num(0), retransmission(false), subclass_coded(false),
-	subclass(0), meta_type(IAX2_META_UNDEFINED), raw_data(NULL), raw_data_len(0)
+	subclass(0), ie_buf(ie_inline), ie_buf_size(sizeof(ie_inline)), ie_data_len(0),
+	ies_in_payload(false), meta_type(IAX2_META_UNDEFINED), trunk_timestamps(false),
+	raw_data(NULL), raw_data_len(0),
+	raw_data_borrowed(false)
 {
-	ies.clear();
+	memset(ie_index, 0, sizeof(ie_index));
 }
 
-iax2_frame::iax2_frame(const unsigned char *buf, size_t buflen) :
+iax2_frame::iax2_frame(const unsigned char *buf, size_t buflen, bool borrow) :
 	direction(IAX2_DIRECTION_IN), shell(IAX2_FRAME_UNDEFINED), 
 	type(IAX2_FRAME_TYPE_UNDEFINED), source_call_num(0), dest_call_num(0),
 	timestamp(0), out_seq_num(0), in_seq_num(0), retransmission(false), subclass_coded(false),
-	subclass(0), meta_type(IAX2_META_UNDEFINED), raw_data(NULL), raw_data_len(0)
+	subclass(0), ie_buf(ie_inline), ie_buf_size(sizeof(ie_inline)), ie_data_len(0),
+	ies_in_payload(false), meta_type(IAX2_META_UNDEFINED), trunk_timestamps(false),
+	raw_data(NULL), raw_data_len(0),
+	raw_data_borrowed(false)
 {
-	ies.clear();
+	memset(ie_index, 0, sizeof(ie_index));
+
+	if (buflen < sizeof(unsigned short)) {
+		fprintf(stderr, "Frame too short to parse!\n");
+		return;
+	}
 
 	unsigned short begin = ntohs(*((unsigned short *) buf));
 
 	if (begin & 0x8000)
-		parse_full_frame(buf, buflen);
+		parse_full_frame(buf, buflen, borrow);
 	else if (begin)
-		parse_mini_frame(buf, buflen);
+		parse_mini_frame(buf, buflen, borrow);
 	else
-		parse_meta_frame(buf, buflen);
+		parse_meta_frame(buf, buflen, borrow);
 }
 
-iax2_frame::~iax2_frame(void)
+iax2_frame::iax2_frame(const iax2_frame &frame) :
+	direction(frame.direction), shell(frame.shell), type(frame.type),
+	source_call_num(frame.source_call_num), dest_call_num(frame.dest_call_num),
+	timestamp(frame.timestamp), out_seq_num(frame.out_seq_num),
+	in_seq_num(frame.in_seq_num), retransmission(frame.retransmission),
+	subclass_coded(frame.subclass_coded), subclass(frame.subclass),
+	ie_buf(ie_inline), ie_buf_size(sizeof(ie_inline)), ie_data_len(0),
+	ies_in_payload(false), meta_type(frame.meta_type),
+	trunk_timestamps(frame.trunk_timestamps), raw_data(NULL), raw_data_len(0),
+	raw_data_borrowed(false)
 {
-	iax2_ie *ie;
+	memset(ie_index, 0, sizeof(ie_index));
+
+	if (frame.ie_buf != frame.ie_inline) {
+		if (!(ie_buf = (unsigned char *) malloc(frame.ie_buf_size))) {
+			ie_buf = ie_inline;
+			fprintf(stderr, "Unable to copy frame IEs!\n");
+			return;
+		}
+		ie_buf_size = frame.ie_buf_size;
+	}
+	memcpy(ie_buf, frame.ie_buf, frame.ies_in_payload ? 0 : frame.ie_data_len);
 
-	while (!ies.empty()) {
-		ie = ies.front();
-		ies.pop_front();
-		free(ie);
+	if (frame.raw_data_len) {
+		if (!(raw_data = malloc(frame.raw_data_len))) {
+			fprintf(stderr, "Unable to copy frame payload!\n");
+			return;
+		}
+		memcpy(raw_data, frame.raw_data, frame.raw_data_len);
+		raw_data_len = frame.raw_data_len;
 	}
 
-	if (raw_data)
+	ie_data_len = frame.ie_data_len;
+	ies_in_payload = frame.ies_in_payload;
+	memcpy(ie_index, frame.ie_index, sizeof(ie_index));
+}
+
+iax2_frame::~iax2_frame(void)
+{
+	if (ie_buf != ie_inline)
+		free(ie_buf);
+
+	if (raw_data && !raw_data_borrowed)
 		free(raw_data);
 }
 
-void iax2_frame::parse_full_frame(const unsigned char *buf, size_t buflen)
+void iax2_frame::set_payload(const unsigned char *data, size_t data_len, bool borrow)
+{
+	if (!borrow) {
+		set_raw_data(data, data_len);
+		return;
+	}
+
+	raw_data = (void *) data;
+	raw_data_len = data_len;
+	raw_data_borrowed = true;
+}
+
+iax2_frame &iax2_frame::own(void)
+{
+	void *data = NULL;
+
+	if (!raw_data_borrowed)
+		return *this;
+
+	if (raw_data_len) {
+		if (!(data = malloc(raw_data_len))) {
+			fprintf(stderr, "Unable to copy frame payload!\n");
+			return *this;
+		}
+		memcpy(data, raw_data, raw_data_len);
+	}
+
+	raw_data = data;
+	raw_data_borrowed = false;
+
+	return *this;
+}
+
+iax2_frame *iax2_frame::dup(void) const
+{
+	iax2_frame *frame = new iax2_frame(*this);
+
+	// The copy constructor leaves out what it could not allocate
+	if (frame->raw_data_len != raw_data_len || frame->ie_data_len != ie_data_len) {
+		delete frame;
+		return NULL;
+	}
+
+	return frame;
+}
+
+void iax2_frame::parse_full_frame(const unsigned char *buf, size_t buflen, bool borrow)
 {
 	iax2_full_header *header = (iax2_full_header *) buf;
 
@@ -105,58 +196,69 @@ void iax2_frame::parse_full_frame(const unsigned char *buf, size_t buflen)
 	buf += sizeof(*header);
 	buflen -= sizeof(*header);
 
-	set_raw_data(buf, buflen);
+	set_payload(buf, buflen, borrow);
 
 	if (type != IAX2_FRAME_TYPE_IAX2)
 		return;
 
-	while (buflen) {
-		iax2_ie *ie, *tmp = (iax2_ie *) buf;
-		if (buflen - 2 < tmp->datalen) {
-			fprintf(stderr, "IE datalen '%d' greater than '%d' bytes left in packet!\n",
-				(int) tmp->datalen, (int) buflen);
+	// The IEs are left where they are in the payload.  Make sure they are
+	// well formed, so they can be walked later without any more checks.
+	ies_in_payload = true;
+	while (ie_data_len < buflen) {
+		const iax2_ie *ie = (const iax2_ie *) (buf + ie_data_len);
+		size_t left = buflen - ie_data_len;
+		if (left < sizeof(*ie)) {
+			fprintf(stderr, "Space left in packet (%d) not big enough for an IE!\n", (int) left);
 			break;
 		}
-		if (!(ie = (iax2_ie *) calloc(1, sizeof(*ie) + tmp->datalen)))
-			break;
-		ie->type = tmp->type;
-		ie->datalen = tmp->datalen;
-		memcpy(ie->data, tmp->data, tmp->datalen);
-		ies.push_back(ie);
-		buf += sizeof(*ie) + tmp->datalen;
-		buflen -= sizeof(*ie) + tmp->datalen;
-		if (buflen && buflen < 2) {
-			fprintf(stderr, "Space left in packet (%d) not big enough for an IE!\n", (int) buflen);
+		if (left - sizeof(*ie) < ie->datalen) {
+			fprintf(stderr, "IE datalen '%d' greater than '%d' bytes left in packet!\n",
+				(int) ie->datalen, (int) left);
 			break;
 		}
+		index_ie(ie, ie_data_len);
+		ie_data_len += sizeof(*ie) + ie->datalen;
 	}
 }
 
-void iax2_frame::parse_mini_frame(const unsigned char *buf, size_t buflen)
+void iax2_frame::parse_mini_frame(const unsigned char *buf, size_t buflen, bool borrow)
 {
 	iax2_mini_header *header = (iax2_mini_header *) buf;
 
+	if (buflen < sizeof(*header)) {
+		fprintf(stderr, "Invalid mini frame!\n");
+		return;
+	}
+
 	shell = IAX2_FRAME_MINI;
 	
 	source_call_num = ntohs(header->callno);
 	timestamp = ntohs(header->ts);
 	
-	set_raw_data(header->data, buflen - sizeof(iax2_mini_header));
+	set_payload(header->data, buflen - sizeof(iax2_mini_header), borrow);
 }
 
-void iax2_frame::parse_meta_frame(const unsigned char *buf, size_t buflen)
+void iax2_frame::parse_meta_frame(const unsigned char *buf, size_t buflen, bool borrow)
 {
 	iax2_meta_header *header = (iax2_meta_header *) buf;
 
+	if (buflen < sizeof(*header)) {
+		fprintf(stderr, "Invalid meta frame!\n");
+		return;
+	}
+
 	shell = IAX2_FRAME_META;
 	if (header->metacmd == 0x80) {
 		meta_type = IAX2_META_VIDEO;
-		parse_meta_video_frame(buf, buflen);
+		parse_meta_video_frame(buf, buflen, borrow);
+	} else if (header->metacmd == IAX2_META_CMD_TRUNK) {
+		meta_type = IAX2_META_TRUNK;
+		parse_meta_trunk_frame(buf, buflen, borrow);
 	} else
 		fprintf(stderr, "Unknown meta frame type!\n");
 }
 
-void iax2_frame::parse_meta_video_frame(const unsigned char *buf, size_t buflen)
+void iax2_frame::parse_meta_video_frame(const unsigned char *buf, size_t buflen, bool borrow)
 {
 	iax2_meta_video_header *header = (iax2_meta_video_header *) buf;
 	
@@ -168,7 +270,54 @@ void iax2_frame::parse_meta_video_frame(const unsigned char *buf, size_t buflen)
 	source_call_num = ntohs(header->callno) & 0x7FFF;
 	timestamp = ntohs(header->ts);
 	
-	set_raw_data(header->data, buflen - sizeof(iax2_meta_video_header));
+	set_payload(header->data, buflen - sizeof(iax2_meta_video_header), borrow);
+}
+
+void iax2_frame::parse_meta_trunk_frame(const unsigned char *buf, size_t buflen, bool borrow)
+{
+	iax2_meta_trunk_header *header = (iax2_meta_trunk_header *) buf;
+
+	if (buflen < sizeof(*header)) {
+		printf("Invalid meta trunk frame!\n");
+		return;
+	}
+
+	trunk_timestamps = header->cmddata & IAX2_META_TRUNK_TIMESTAMPS;
+	timestamp = ntohl(header->ts);
+
+	// The calls are taken apart by get_trunk_call()
+	set_payload(header->data, buflen - sizeof(iax2_meta_trunk_header), borrow);
+}
+
+int iax2_frame::get_trunk_call(size_t *offset, iax2_trunk_call *call) const
+{
+	const unsigned char *pos = (const unsigned char *) raw_data + *offset;
+	size_t left = raw_data_len - *offset;
+
+	if (meta_type != IAX2_META_TRUNK || *offset >= raw_data_len)
+		return -1;
+
+	if (trunk_timestamps) {
+		const iax2_meta_trunk_mini *entry = (const iax2_meta_trunk_mini *) pos;
+		if (left < sizeof(*entry) || left - sizeof(*entry) < ntohs(entry->len))
+			return -1;
+		call->call_num = ntohs(entry->callno) & 0x7FFF;
+		call->timestamp = ntohs(entry->ts);
+		call->data = entry->data;
+		call->len = ntohs(entry->len);
+		*offset += sizeof(*entry) + call->len;
+	} else {
+		const iax2_meta_trunk_entry *entry = (const iax2_meta_trunk_entry *) pos;
+		if (left < sizeof(*entry) || left - sizeof(*entry) < ntohs(entry->len))
+			return -1;
+		call->call_num = ntohs(entry->callno) & 0x7FFF;
+		call->timestamp = 0;
+		call->data = entry->data;
+		call->len = ntohs(entry->len);
+		*offset += sizeof(*entry) + call->len;
+	}
+
+	return 0;
 }
 
 const char *iax2_frame::type2str(void) const
@@ -202,6 +351,7 @@ const char *iax2_frame::meta_type2str(void) const
 #define ST(a) case a: str = # a; break;
 	switch (meta_type) {
 	ST(IAX2_META_VIDEO)
+	ST(IAX2_META_TRUNK)
 	default:
 		str = "Unknown";
 	}
@@ -337,120 +487,237 @@ const char *iax2_ie::type2str(void) const
 	return str;
 }
 
-void iax2_frame::print_ies(void) const
+void iax2_frame::index_ie(const iax2_ie *ie, unsigned int offset)
 {
-	char *buf = NULL;
+	// Only the first IE of each type is indexed, which is the one get_ie()
+	// has always returned.
+	if (ie->type < IAX2_IE_INDEX_LEN && !ie_index[ie->type])
+		ie_index[ie->type] = offset + 1;
+}
 
-	for (iax2_ie_iterator i = ies.begin(); i != ies.end(); i++) {
-		switch ((*i)->type) {
+void iax2_frame::clear_ies(void)
+{
+	ie_data_len = 0;
+	ies_in_payload = false;
+	memset(ie_index, 0, sizeof(ie_index));
+}
+
+const iax2_ie *iax2_frame::find_ie(enum iax2_ie_type type) const
+{
+	const unsigned char *data = get_ie_data();
+	const iax2_ie *ie;
+
+	if (type < IAX2_IE_INDEX_LEN) {
+		if (!ie_index[type])
+			return NULL;
+		return (const iax2_ie *) (data + ie_index[type] - 1);
+	}
+
+	for (unsigned int offset = 0; offset < ie_data_len; offset += sizeof(*ie) + ie->datalen) {
+		ie = (const iax2_ie *) (data + offset);
+		if (ie->type == type)
+			return ie;
+	}
+
+	return NULL;
+}
+
+/*!
+ * \brief Append formatted text to a buffer
+ *
+ * \return the new length of the text in buf.  This never goes past the end of
+ *         the buffer, so output that does not fit is cut off.
+ */
+static size_t buf_append(char *buf, size_t len, size_t offset, const char *fmt, ...)
+{
+	va_list ap;
+	int res;
+
+	if (offset + 1 >= len)
+		return offset;
+
+	va_start(ap, fmt);
+	res = vsnprintf(buf + offset, len - offset, fmt, ap);
+	va_end(ap);
+
+	if (res < 0)
+		return offset;
+	if ((size_t) res >= len - offset)
+		return len - 1;
+
+	return offset + res;
+}
+
+static const char *direction2str(enum iax2_frame_direction direction)
+{
+	return direction == IAX2_DIRECTION_IN ? "Rx" : 
+		(direction == IAX2_DIRECTION_OUT ? "Tx" : "Unknown");
+}
+
+size_t iax2_frame::format_ies(char *buf, size_t len, size_t offset) const
+{
+	char str[IAX2_IE_MAX_DATALEN + 1];
+	const unsigned char *data = get_ie_data();
+	const iax2_ie *ie;
+
+	for (unsigned int ie_offset = 0; ie_offset < ie_data_len; ie_offset += sizeof(*ie) + ie->datalen) {
+		ie = (const iax2_ie *) (data + ie_offset);
+		switch (ie->type) {
 		// String Information Elements
 		case IAX2_IE_USERNAME:
-			if (!buf)
-				buf = (char *) alloca(IAX2_IE_MAX_DATALEN + 1);
-			memcpy((void *) buf, (void *) (*i)->data, (*i)->datalen);
-			buf[(*i)->datalen] = '\0';
-			fprintf(stderr, "      IE: Type: %s  Len: %u  Value: %s\n", 
-				(*i)->type2str(), (*i)->datalen, buf);
+			memcpy((void *) str, (void *) ie->data, ie->datalen);
+			str[ie->datalen] = '\0';
+			offset = buf_append(buf, len, offset, "      IE: Type: %s  Len: %u  Value: %s\n", 
+				ie->type2str(), ie->datalen, str);
 			break;
 		// Unsigned Short Information Elements
 		case IAX2_IE_VERSION:
 		case IAX2_IE_REFRESH:
-			fprintf(stderr, "      IE: Type: %s  Len: %u  Value: %hu\n", 
-				(*i)->type2str(), (*i)->datalen, 
-				(unsigned short) ntohs(*((unsigned short *) (*i)->data)));
+			offset = buf_append(buf, len, offset, "      IE: Type: %s  Len: %u  Value: %hu\n", 
+				ie->type2str(), ie->datalen, 
+				(unsigned short) ntohs(*((unsigned short *) ie->data)));
 			break;
 		// Unsigned long IEs
 		case IAX2_IE_CAPABILITY:
 		case IAX2_IE_FORMAT:
-			fprintf(stderr, "      IE: Type: %s  Len: %u  Value: %u\n", 
-				(*i)->type2str(), (*i)->datalen, 
-				(u_int32_t) ntohl(*((u_int32_t *) (*i)->data)));
+			offset = buf_append(buf, len, offset, "      IE: Type: %s  Len: %u  Value: %u\n", 
+				ie->type2str(), ie->datalen, 
+				(u_int32_t) ntohl(*((u_int32_t *) ie->data)));
 			break;
 		default:
-			fprintf(stderr, "      IE: Type: %s  Len: %u\n", 
-				(*i)->type2str(), (*i)->datalen);
+			offset = buf_append(buf, len, offset, "      IE: Type: %s  Len: %u\n", 
+				ie->type2str(), ie->datalen);
 		};
 	}
+
+	return offset;
 }
 
-void iax2_frame::print_full_frame(const struct sockaddr_in *sin) const
+size_t iax2_frame::format_full_frame(char *buf, size_t len, const char *ip, 
+	const struct sockaddr_in *sin) const
 {
-	fprintf(stderr, "%s-[FULL%s] IP: %s:%hu  Type: %s  Subclass: %s\n"
+	size_t offset;
+
+	offset = buf_append(buf, len, 0, "%s-[FULL%s] IP: %s:%hu  Type: %s  Subclass: %s\n"
 		"      Source Callnum: %u  Dest Callnum: %u\n"
 		"      Out Seqnum: %u  In Seqnum: %u  Timestamp: %u\n",
-		direction == IAX2_DIRECTION_IN ? "Rx" : 
-			(direction == IAX2_DIRECTION_OUT ? "Tx" : "Unknown"),
+		direction2str(direction),
 		retransmission ? "-Retransmission" : "", 
-		inet_ntoa(sin->sin_addr), ntohs(sin->sin_port),
+		ip, ntohs(sin->sin_port),
 		type2str(), subclass2str(),
 		source_call_num, dest_call_num,
 		out_seq_num, in_seq_num, timestamp);
 
-	print_ies();
+	offset = format_ies(buf, len, offset);
 	
-	fprintf(stderr, "\n");
+	return buf_append(buf, len, offset, "\n");
 }
 
-void iax2_frame::print_mini_frame(const struct sockaddr_in *sin) const
+size_t iax2_frame::format_mini_frame(char *buf, size_t len, const char *ip, 
+	const struct sockaddr_in *sin) const
 {
-	fprintf(stderr, "%s-[MINI] IP: %s:%hu  Dest Callnum: %u  Timestamp: %u  DataLen: %u\n\n",
-		direction == IAX2_DIRECTION_IN ? "Rx" : 
-			(direction == IAX2_DIRECTION_OUT ? "Tx" : "Unknown"),
-		inet_ntoa(sin->sin_addr), ntohs(sin->sin_port),
-		dest_call_num, timestamp, get_raw_data_len());
+	return buf_append(buf, len, 0, "%s-[MINI] IP: %s:%hu  Source Callnum: %u  Timestamp: %u  DataLen: %u\n\n",
+		direction2str(direction),
+		ip, ntohs(sin->sin_port),
+		source_call_num, timestamp, get_raw_data_len());
 }
 
-void iax2_frame::print_meta_frame(const struct sockaddr_in *sin) const
+size_t iax2_frame::format_meta_frame(char *buf, size_t len, const char *ip, 
+	const struct sockaddr_in *sin) const
 {
-	fprintf(stderr, "%s-[META] IP: %s:%hu  Type: %s  Dest Callnum: %u  Timestamp: %u  DataLen: %u\n\n",
-		direction == IAX2_DIRECTION_IN ? "Rx" : 
-			(direction == IAX2_DIRECTION_OUT ? "Tx" : "Unknown"),
-		inet_ntoa(sin->sin_addr), ntohs(sin->sin_port),
-		meta_type2str(), dest_call_num, 
+	return buf_append(buf, len, 0, "%s-[META] IP: %s:%hu  Type: %s  Source Callnum: %u  Timestamp: %u  DataLen: %u\n\n",
+		direction2str(direction),
+		ip, ntohs(sin->sin_port),
+		meta_type2str(), source_call_num, 
 		timestamp, get_raw_data_len());
 }
 
-void iax2_frame::print(const struct sockaddr_in *sin)
+size_t iax2_frame::format(char *buf, size_t len, const struct sockaddr_in *sin) const
 {
+	char ip[INET_ADDRSTRLEN];
+
+	if (!len)
+		return 0;
+
+	buf[0] = '\0';
+
+	if (!inet_ntop(AF_INET, &sin->sin_addr, ip, sizeof(ip)))
+		strcpy(ip, "?");
+
 	switch (shell) {
 	case IAX2_FRAME_FULL:
-		print_full_frame(sin);
-		break;
+		return format_full_frame(buf, len, ip, sin);
 	case IAX2_FRAME_MINI:
-		print_mini_frame(sin);
-		break;
+		return format_mini_frame(buf, len, ip, sin);
 	case IAX2_FRAME_META:
-		print_meta_frame(sin);
-		break;
+		return format_meta_frame(buf, len, ip, sin);
 	default:
-		fprintf(stderr, "Can not print unknown frame shell '%d'!\n", shell);	
+		return buf_append(buf, len, 0, "Can not print unknown frame shell '%d'!\n", shell);
 	}
 }
 
-size_t iax2_frame::total_ie_len(void) const
+void iax2_frame::print(const struct sockaddr_in *sin) const
 {
-	size_t len = 0;
+	char buf[IAX2_FRAME_FORMAT_LEN];
 
-	for (iax2_ie_iterator i = ies.begin(); i != ies.end(); i++)
-		len += sizeof(**i) + (*i)->datalen;
+	if (format(buf, sizeof(buf), sin))
+		fputs(buf, stderr);
+}
 
-	return len;
+size_t iax2_frame::total_ie_len(void) const
+{
+	// The IEs of a received frame are already counted in the payload
+	return ies_in_payload ? 0 : ie_data_len;
 }
 
-int iax2_frame::send_full_frame(const struct sockaddr_in *sin, const int sockfd)
+size_t iax2_frame::get_wire_len(void) const
 {
-	int res = 0;
-	unsigned int len;
-	struct iax2_full_header *header;
+	switch (shell) {
+	case IAX2_FRAME_FULL:
+		return sizeof(iax2_full_header) + total_ie_len() + raw_data_len;
+	case IAX2_FRAME_META:
+		if (meta_type == IAX2_META_VIDEO)
+			return sizeof(iax2_meta_video_header) + raw_data_len;
+		return 0;
+	case IAX2_FRAME_MINI:
+		return sizeof(iax2_mini_header) + raw_data_len;
+	default:
+		return 0;
+	}
+}
 
+int iax2_frame::encode(unsigned char *buf) const
+{
 	if (direction != IAX2_DIRECTION_OUT) {
 		fprintf(stderr, "Frames must be IAX2_DIRECTION_OUT to be sent!\n");
 		return -1;
 	}
 
-	len = sizeof(*header) + total_ie_len() + raw_data_len;
+	switch (shell) {
+	case IAX2_FRAME_FULL:
+		encode_full_frame(buf);
+		break;
+	case IAX2_FRAME_META:
+		if (meta_type != IAX2_META_VIDEO) {
+			fprintf(stderr, "Can't send Unknown meta frame type!\n");
+			return -1;
+		}
+		encode_meta_video_frame(buf);
+		break;
+	case IAX2_FRAME_MINI:
+		encode_mini_frame(buf);
+		break;
+	default:
+		fprintf(stderr, "Don't know how to send frame with shell '%d'!\n", shell);
+		return -1;
+	}
 
-	header = (struct iax2_full_header *) alloca(len);
+	return 0;
+}
+
+void iax2_frame::encode_full_frame(unsigned char *buf) const
+{
+	struct iax2_full_header *header = (struct iax2_full_header *) buf;
 
 	header->scallno = htons(source_call_num | 0x8000);
 	header->dcallno = htons(dest_call_num | ((retransmission ? 1 : 0) << 15));
@@ -460,101 +727,88 @@ int iax2_frame::send_full_frame(const struct sockaddr_in *sin, const int sockfd)
 	header->type = type;
 	header->csub = subclass | ((subclass_coded ? 1 : 0) << 7);
 
-	size_t offset = 0;
-	for (iax2_ie_iterator i = ies.begin(); i != ies.end(); i++) {
-		memcpy(header->iedata + offset, (void *) *i, 
-			(size_t) sizeof(**i) + (*i)->datalen);
-		offset += sizeof(**i) + (*i)->datalen;
-	}
+	// The IEs are already in wire format
+	size_t offset = total_ie_len();
+	if (offset)
+		memcpy(header->iedata, ie_buf, offset);
 
 	if (raw_data_len)
 		memcpy(header->iedata + offset, raw_data, raw_data_len);
-
-	if (sendto(sockfd, header, len, 0, (const struct sockaddr *) sin, sizeof(*sin)) == -1) {
-		fprintf(stderr, "Error Sending IAX2 Full Frame: %s\n", strerror(errno));
-		res = -1;
-	}
-
-	return res;
-}
-
-int iax2_frame::send_meta_frame(const struct sockaddr_in *sin, const int sockfd)
-{
-	if (direction != IAX2_DIRECTION_OUT) {
-		fprintf(stderr, "Frames must be IAX2_DIRECTION_OUT to be sent!\n");
-		return -1;
-	}
-
-	if (meta_type == IAX2_META_VIDEO)
-		return send_meta_video_frame(sin, sockfd);
-
-	fprintf(stderr, "Can't send Unknown meta frame type!\n");
-	return -1;
 }
 
-int iax2_frame::send_meta_video_frame(const struct sockaddr_in *sin, const int sockfd)
+void iax2_frame::encode_meta_video_frame(unsigned char *buf) const
 {
-	int res = 0;
-	unsigned int len;
-	struct iax2_meta_video_header *header;
-
-	len = sizeof(*header) + get_raw_data_len();
-	header = (iax2_meta_video_header *) alloca(len);
+	struct iax2_meta_video_header *header = (struct iax2_meta_video_header *) buf;
 
 	header->zeros = 0;
-	header->callno = htons(dest_call_num | 0x8000);
+	header->callno = htons(source_call_num | 0x8000);
 	unsigned short ts = timestamp;
 	header->ts = htons(ts);
 
 	if (get_raw_data_len())
 		memcpy(header->data, get_raw_data(), get_raw_data_len());
-
-	if (sendto(sockfd, header, len, 0, (const struct sockaddr *) sin, sizeof(*sin)) == -1) {
-		fprintf(stderr, "Error Sending IAX2 Meta Video Frame: %s\n", strerror(errno));
-		res = -1;
-	}
-
-	return res;
 }
 
-int iax2_frame::send_mini_frame(const struct sockaddr_in *sin, const int sockfd)
+void iax2_frame::encode_mini_frame(unsigned char *buf) const
 {
-	int res = 0;
-	unsigned int len;
-	struct iax2_mini_header *header;
-
-	len = sizeof(*header) + get_raw_data_len();
-	header = (iax2_mini_header *) alloca(len);
+	struct iax2_mini_header *header = (struct iax2_mini_header *) buf;
 
-	header->callno = htons(dest_call_num & ~0x8000);
+	header->callno = htons(source_call_num & ~0x8000);
 	unsigned short ts = timestamp;
 	header->ts = htons(ts);
 
 	if (get_raw_data_len())
 		memcpy(header->data, get_raw_data(), get_raw_data_len());
-	
-	if (sendto(sockfd, header, len, 0, (const struct sockaddr *) sin, sizeof(*sin)) == -1) {
-		fprintf(stderr, "Error Sending IAX2 Mini Frame: %s\n", strerror(errno));
-		res = -1;
+}
+
+int iax2_frame::grow_ie_buf(size_t len)
+{
+	unsigned char *buf;
+	size_t size = ie_buf_size;
+
+	while (size < len)
+		size *= 2;
+
+	if (size > IAX2_FRAME_IE_MAX_LEN) {
+		fprintf(stderr, "Too many IEs in frame!\n");
+		return -1;
 	}
 
-	return res;
+	if (!(buf = (unsigned char *) malloc(size)))
+		return -1;
+
+	memcpy(buf, ie_buf, ie_data_len);
+	if (ie_buf != ie_inline)
+		free(ie_buf);
+
+	ie_buf = buf;
+	ie_buf_size = size;
+
+	return 0;
 }
 
 iax2_frame &iax2_frame::add_ie(enum iax2_ie_type type, const void *data, unsigned char datalen)
 {
 	iax2_ie *ie;
+	size_t len = sizeof(*ie) + datalen;
+
+	if (ies_in_payload) {
+		fprintf(stderr, "Can't add an IE to a received frame!\n");
+		return *this;
+	}
 
-	if (!(ie = (iax2_ie *) calloc(1, sizeof(*ie) + datalen)))
+	if (ie_data_len + len > ie_buf_size && grow_ie_buf(ie_data_len + len))
 		return *this;
 
+	ie = (iax2_ie *) (ie_buf + ie_data_len);
 	ie->type = type;
 	ie->datalen = datalen;
 	if (data && datalen) {
 		memcpy(ie->data, data, (size_t) datalen);
 	}
 
-	ies.push_back(ie);
+	index_ie(ie, ie_data_len);
+	ie_data_len += len;
 
 	return *this;
 }
@@ -688,54 +942,106 @@ int iax2_frame::add_ie_empty(const char *type)
 	add_ie_empty((enum iax2_ie_type) res);
 }
 
-const char *iax2_frame::get_ie_string(enum iax2_ie_type type) const
+const void *iax2_frame::get_ie(enum iax2_ie_type type, unsigned int *datalen) const
 {
-	for (iax2_ie_iterator i = ies.begin(); i != ies.end(); i++) {
-		if ((*i)->type == type)
-			return (const char *) (*i)->data;
-	}
+	const iax2_ie *ie;
 
-	return NULL;
+	if (!(ie = find_ie(type)))
+		return NULL;
+
+	if (datalen)
+		*datalen = ie->datalen;
+
+	return ie->data;
+}
+
+const char *iax2_frame::get_ie_string(enum iax2_ie_type type) const
+{
+	return (const char *) get_ie(type, NULL);
 }
 
 u_int32_t iax2_frame::get_ie_unsigned_long(enum iax2_ie_type type) const
 {
-	for (iax2_ie_iterator i = ies.begin(); i != ies.end(); i++) {
-		if ((*i)->type == type)
-			return ntohl(*((u_int32_t *) (*i)->data));
+	const iax2_ie *ie;
+
+	if (!(ie = find_ie(type)) || ie->datalen < sizeof(u_int32_t))
+		return 0;
+
+	return ntohl(*((u_int32_t *) ie->data));
+}
+
+int iax2_frame::send(const struct sockaddr_in *sin, const int sockfd)
+{
+	unsigned char *buf;
+	size_t len;
+
+	// If the length is unknown, encode() fails and says why.
+	len = get_wire_len();
+	buf = (unsigned char *) alloca(len ? len : 1);
+	if (encode(buf))
+		return -1;
+
+	if (sendto(sockfd, buf, len, 0, (const struct sockaddr *) sin, sizeof(*sin)) == -1) {
+		fprintf(stderr, "Error Sending IAX2 Frame: %s\n", strerror(errno));
+		return -1;
 	}
 
+	retransmission = true;
+
 	return 0;
 }
 
-int iax2_frame::send(const struct sockaddr_in *sin, const int sockfd)
+int iax2_frame::queue(const struct sockaddr_in *sin, iax2_tx_queue &tx_queue)
 {
-	int res = -1;
+	unsigned char *buf;
+	size_t len;
+	iax2_tracer *tracer;
 
-	print(sin);
+	if ((tracer = tx_queue.get_tracer()))
+		tracer->trace(*this, sin);
 
-	switch (shell) {
-	case IAX2_FRAME_FULL:
-		res = send_full_frame(sin, sockfd);
-		break;
-	case IAX2_FRAME_META:
-		res = send_meta_frame(sin, sockfd);
-		break;
-	case IAX2_FRAME_MINI:
-		res = send_mini_frame(sin, sockfd);
-		break;
-	default:
-		fprintf(stderr, "Don't know how to send frame with shell '%d'!\n", shell);
+	if (!(len = get_wire_len()) || !(buf = tx_queue.reserve(len)))
+		return send(sin, tx_queue.get_sockfd());
+
+	if (encode(buf))
+		return -1;
+
+	tx_queue.commit(len, sin);
+
+	retransmission = true;
+
+	return 0;
+}
+
+iax2_frame &iax2_frame::set_format(u_int32_t format)
+{
+	if (format < 0x80) {
+		subclass = format;
+		subclass_coded = false;
+		return *this;
 	}
 
-	if (!res)
-		retransmission = true;
+	unsigned int bit = 0;
+	while (format >>= 1)
+		bit++;
+	subclass = bit;
+	subclass_coded = true;
 
-	return res;
+	return *this;
 }
 
 iax2_frame &iax2_frame::set_raw_data(const void *data, unsigned int data_len)
 {
+	if (raw_data_borrowed) {
+		raw_data = NULL;
+		raw_data_len = 0;
+		raw_data_borrowed = false;
+	}
+
+	// The IEs of a received frame go away with its payload
+	if (ies_in_payload)
+		clear_ies();
+
 	if (raw_data) {
 		if ((raw_data_len != data_len) 
 			&& (!(raw_data = realloc(raw_data, data_len))))
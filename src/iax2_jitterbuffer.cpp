@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2006, Russell Bryant <russell@russellbryant.net> 
+ *
+ * This file is part of LibIAX2xx.
+ *
+ * LibIAX2xx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * LibIAX2xx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LibIAX2xx; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*!
+ * \file
+ * \author Russell Bryant <russell@russellbryant.net>
+ *
+ * \brief IAX2 jitter buffer
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+using namespace std;
+
+#include "iax2/iax2_jitterbuffer.h"
+#include "iax2/time.h"
+
+using namespace iax2xx;
+
+iax2_jitterbuffer::iax2_jitterbuffer(unsigned int ms) :
+	interval(ms ? ms : 20), count(0), next_num(0), started(false), first_num(0),
+	last_transit(0), have_transit(false), avg_transit(0), jitter(0), delay(0)
+{
+	pthread_mutex_init(&lock, NULL);
+	base = tvnow();
+
+	for (unsigned int i = 0; i < IAX2_JB_SLOTS; i++)
+		slots[i].len = 0;
+}
+
+iax2_jitterbuffer::~iax2_jitterbuffer(void)
+{
+	pthread_mutex_destroy(&lock);
+}
+
+int iax2_jitterbuffer::get_ms(struct timeval tv) const
+{
+	return tvdiff_ms(tv, base);
+}
+
+unsigned int iax2_jitterbuffer::target_delay(void) const
+{
+	unsigned int delay = interval + ((IAX2_JB_JITTER_FACTOR * jitter + 8) >> 4);
+	unsigned int max = (IAX2_JB_SLOTS - 2) * interval;
+
+	if (max > IAX2_JB_MAX_DELAY)
+		max = IAX2_JB_MAX_DELAY;
+
+	return delay > max ? max : delay;
+}
+
+void iax2_jitterbuffer::clear(iax2_jb_slot *slot)
+{
+	if (!slot->len)
+		return;
+
+	slot->len = 0;
+	count--;
+}
+
+void iax2_jitterbuffer::discard_before(u_int32_t num)
+{
+	for (unsigned int i = 0; count && i < IAX2_JB_SLOTS; i++) {
+		if ((int) (slots[i].num - num) < 0)
+			clear(&slots[i]);
+	}
+}
+
+int iax2_jitterbuffer::put(const void *data, size_t len, u_int32_t ts,
+	u_int32_t format, struct timeval now)
+{
+	if (!len || len > IAX2_JB_MAX_FRAME_LEN)
+		return -1;
+
+	pthread_mutex_lock(&lock);
+
+	// RFC 3550, section 6.4.1, with the jitter and the average transit
+	// time both kept scaled by 16
+	int transit = get_ms(now) - (int) ts;
+	if (have_transit) {
+		int d = transit - last_transit;
+		if (d < 0)
+			d = -d;
+		jitter += d - ((jitter + 8) >> 4);
+		avg_transit += (transit * 16 - avg_transit) / 64;
+	} else {
+		avg_transit = transit * 16;
+		have_transit = true;
+	}
+	last_transit = transit;
+
+	u_int32_t num = (ts + interval / 2) / interval;
+
+	if (started) {
+		if ((int) (num - next_num) < 0) {
+			// Too late, it has already been played or skipped
+			pthread_mutex_unlock(&lock);
+			return -1;
+		}
+		if (num - next_num >= IAX2_JB_SLOTS) {
+			// Too far ahead to be the same stream, so start over
+			discard_before(num + 1);
+			started = false;
+		}
+	}
+
+	if (!started) {
+		if (!count || (int) (num - first_num) < 0)
+			first_num = num;
+		if (num - first_num >= IAX2_JB_SLOTS) {
+			discard_before(num + 1);
+			first_num = num;
+		}
+	}
+
+	iax2_jb_slot *slot = &slots[num & IAX2_JB_SLOTS_MASK];
+	if (slot->len && slot->num == num) {
+		pthread_mutex_unlock(&lock);
+		return -1;
+	}
+	clear(slot);
+
+	slot->num = num;
+	slot->ts = ts;
+	slot->format = format;
+	slot->len = len;
+	memcpy(slot->data, data, len);
+	count++;
+
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+enum iax2_jb_result iax2_jitterbuffer::get(iax2_jb_frame *frame, void *buf, 
+	size_t buflen, struct timeval now)
+{
+	enum iax2_jb_result res;
+
+	pthread_mutex_lock(&lock);
+
+	int now_ms = get_ms(now) - avg_transit / 16;
+
+	// The jitter estimate is noisy, so the delay follows it up right away,
+	// but only comes back down by a millisecond at a time.
+	unsigned int target_ms = target_delay();
+	if (target_ms > delay)
+		delay = target_ms;
+	else if (target_ms < delay)
+		delay--;
+	int target = delay;
+
+	if (!started) {
+		if (!count) {
+			pthread_mutex_unlock(&lock);
+			return IAX2_JB_EMPTY;
+		}
+		if (now_ms - (int) (first_num * interval) < target) {
+			pthread_mutex_unlock(&lock);
+			return IAX2_JB_NOFRAME;
+		}
+		next_num = first_num;
+		started = true;
+	}
+
+	// How long ago the next frame would have arrived, on average
+	int lag = now_ms - (int) (next_num * interval);
+
+	if (lag < 0) {
+		pthread_mutex_unlock(&lock);
+		return IAX2_JB_NOFRAME;
+	}
+
+	if (!count && lag > IAX2_JB_MAX_DELAY) {
+		// Nothing has come in for a while, so this talkspurt is over
+		started = false;
+		pthread_mutex_unlock(&lock);
+		return IAX2_JB_EMPTY;
+	}
+
+	frame->ts = next_num * interval;
+	frame->format = 0;
+	frame->len = 0;
+
+	if (lag + (int) interval <= target) {
+		// Raise the delay by a frame by not moving on
+		pthread_mutex_unlock(&lock);
+		return IAX2_JB_INTERP;
+	}
+
+	if (lag >= target + (int) interval) {
+		// Lower the delay by dropping a frame, or by as many as it takes
+		// if the application has fallen far behind
+		u_int32_t skip = (lag - target) / interval;
+		if (skip > 1 && lag < target + IAX2_JB_MAX_DELAY)
+			skip = 1;
+		next_num += skip;
+		discard_before(next_num);
+		frame->ts = next_num * interval;
+	}
+
+	iax2_jb_slot *slot = &slots[next_num & IAX2_JB_SLOTS_MASK];
+	if (slot->len && slot->num == next_num && slot->len <= buflen) {
+		frame->ts = slot->ts;
+		frame->format = slot->format;
+		frame->len = slot->len;
+		memcpy(buf, slot->data, slot->len);
+		res = IAX2_JB_OK;
+	} else
+		res = IAX2_JB_INTERP;
+
+	if (slot->num == next_num)
+		clear(slot);
+	next_num++;
+
+	pthread_mutex_unlock(&lock);
+
+	return res;
+}
+
+unsigned int iax2_jitterbuffer::get_jitter(void)
+{
+	pthread_mutex_lock(&lock);
+	unsigned int res = (jitter + 8) >> 4;
+	pthread_mutex_unlock(&lock);
+
+	return res;
+}
+
+unsigned int iax2_jitterbuffer::get_delay(void)
+{
+	pthread_mutex_lock(&lock);
+	unsigned int res = delay;
+	pthread_mutex_unlock(&lock);
+
+	return res;
+}
@@ -70,13 +70,12 @@ enum iax2_dialog_result iax2_lag_dialog::process_frame(iax2_frame &frame_in,
 				set_in_seq_num(in_seq_num). \
 				set_out_seq_num(out_seq_num++). \
 				set_timestamp(frame_in.get_timestamp()). \
-				send(&remote_addr, sockfd);
+				queue(&remote_addr, parent_peer->get_tx_queue());
 
 			state = IAX2_LAG_STATE_LAGRP_SENT;
 
-			// Start the timer to be the refresh time, to make sure that it is successful
-			// by the time it expires, in case there has to be retransmissions.
-			timer_id = parent_peer->start_timer(this, tvadd(tvnow(), create_tv(IAX2_DEFAULT_REFRESH, 0)));
+			// just in case the packet must be retransmitted
+			start_retransmit_timer();
 		       
 			return IAX2_DIALOG_RESULT_SUCCESS;
 		}
@@ -90,6 +89,7 @@ enum iax2_dialog_result iax2_lag_dialog::process_frame(iax2_frame &frame_in,
 			&& frame_in.get_type() == IAX2_FRAME_TYPE_IAX2
 			&& frame_in.get_subclass() == IAX2_SUBCLASS_ACK) {  // Is an ACK received
 		  
+			stop_retransmit_timer();
 			state = IAX2_LAG_STATE_NONE;
 			return IAX2_DIALOG_RESULT_DESTROY;
 		}
@@ -115,19 +115,17 @@ enum iax2_dialog_result iax2_lag_dialog::process_frame(iax2_frame &frame_in,
 				set_dest_call_num(frame_in.get_source_call_num()). \
 				set_in_seq_num(in_seq_num). \
 				set_out_seq_num(out_seq_num++). \
-				set_timestamp(frame_in.get_timestamp()).send(rcv_addr, sockfd);
+				set_timestamp(frame_in.get_timestamp()).queue(rcv_addr, parent_peer->get_tx_queue());
 
 			state = IAX2_LAG_STATE_NONE;
                         
 			// Stop the timer
-			if (timer_id) {
-				parent_peer->stop_timer(timer_id);
-				timer_id = 0;
-			}
-
-			parent_peer->queue_event(new iax2_event(IAX2_EVENT_TYPE_LAG, call_num,
-					tvdiff_ms(tvnow(), parent_peer->get_reference_time()) - 
-					frame_in.get_timestamp()));
+			stop_retransmit_timer();
+
+			iax2_event event(IAX2_EVENT_TYPE_LAG, call_num, (unsigned int)
+				(tvdiff_ms(tvnow(), parent_peer->get_reference_time()) - 
+				frame_in.get_timestamp()));
+			parent_peer->post_event(event);
 			return IAX2_DIALOG_RESULT_DESTROY;
 		}
 		else {
@@ -150,9 +148,9 @@ int iax2_lag_dialog::start(void)
 		set_timestamp(tvdiff_ms(start_time, parent_peer->get_reference_time()));
 
 	// Packet needs to be retransmitted
-	timer_id = parent_peer->start_timer(this, tvadd(tvnow(),create_tv(5,0)));
+	start_retransmit_timer();
 
-	if (frame.send(&remote_addr, sockfd))
+	if (frame.queue(&remote_addr, parent_peer->get_tx_queue()))
 		return -1;
 	return 0;
 }
@@ -173,11 +171,9 @@ enum iax2_dialog_result iax2_lag_dialog::timer_callback(void)
 			set_source_call_num(call_num). \
 			set_retransmission(true). \
 			set_timestamp(tvdiff_ms(start_time, parent_peer->get_reference_time())). \
-			send(&remote_addr, sockfd);
+			queue(&remote_addr, parent_peer->get_tx_queue());
 
-		// Start the timer to be the refresh time, to make sure that it is successful
-		// by the time it expires, in case there has to be retransmissions.
-		timer_id = parent_peer->start_timer(this, tvadd(tvnow(), create_tv(IAX2_DEFAULT_REFRESH, 0)));
+		restart_retransmit_timer();
 	
 		return IAX2_DIALOG_RESULT_SUCCESS;
 	}
@@ -189,10 +185,10 @@ enum iax2_dialog_result iax2_lag_dialog::timer_callback(void)
 			set_source_call_num(call_num). \
 			set_retransmission(true). \
 			set_timestamp(tvdiff_ms(start_time, parent_peer->get_reference_time())). \
-			send(&remote_addr, sockfd);
+			queue(&remote_addr, parent_peer->get_tx_queue());
 
 		// Packet needs to be retransmitted
-		timer_id = parent_peer->start_timer(this, tvadd(tvnow(),create_tv(5,0)));
+		restart_retransmit_timer();
 
 		return IAX2_DIALOG_RESULT_SUCCESS;
 	}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2006, Russell Bryant <russell@russellbryant.net> 
+ *
+ * This file is part of LibIAX2xx.
+ *
+ * LibIAX2xx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * LibIAX2xx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LibIAX2xx; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*!
+ * \file
+ * \author Russell Bryant <russell@russellbryant.net>
+ *
+ * \brief Lock-free multiple producer, single consumer queue
+ */
+
+#include <stdlib.h>
+
+using namespace std;
+
+#include "iax2/iax2_mpsc_queue.h"
+
+iax2_mpsc_queue::iax2_mpsc_queue(void) :
+	head(&stub), tail(&stub)
+{
+	stub.mpsc_next = NULL;
+}
+
+iax2_mpsc_queue::~iax2_mpsc_queue(void)
+{
+}
+
+void iax2_mpsc_queue::push(iax2_mpsc_node *node)
+{
+	iax2_mpsc_node *prev;
+
+	node->mpsc_next = NULL;
+
+	// Everything written to the object so far must be visible before it
+	// can be reached from the queue.  __sync_lock_test_and_set() is only an
+	// acquire barrier, so a full one is needed first.
+	__sync_synchronize();
+	prev = __sync_lock_test_and_set(&head, node);
+
+	// Between the exchange and this store, the consumer can not get past prev.
+	prev->mpsc_next = node;
+}
+
+iax2_mpsc_node *iax2_mpsc_queue::pop(void)
+{
+	iax2_mpsc_node *node = tail;
+	iax2_mpsc_node *next = node->mpsc_next;
+
+	if (node == &stub) {
+		if (!next)
+			return NULL;
+		tail = next;
+		node = next;
+		next = next->mpsc_next;
+	}
+
+	if (next) {
+		tail = next;
+		__sync_synchronize();
+		return node;
+	}
+
+	// node is the last object, unless a producer is in the middle of a push
+	if (node != head)
+		return NULL;
+
+	// Put the stub back behind the last object so it can be removed
+	push(&stub);
+
+	if ((next = node->mpsc_next)) {
+		tail = next;
+		__sync_synchronize();
+		return node;
+	}
+
+	return NULL;
+}
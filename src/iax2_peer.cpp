@@ -34,22 +34,68 @@
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#ifdef POLL_COMPAT
-#include "poll-compat.h"
-#else
-#include <poll.h>
-#endif
 
 using namespace std;
 
 #include "iax2/iax2_peer.h"
 #include "iax2/iax2_frame.h"
 #include "iax2/iax2_dialog.h"
+#include "iax2/iax2_shard.h"
+#include "iax2/iax2_reactor.h"
 
 using namespace iax2xx;
 
+/* recvmmsg() showed up in Linux 2.6.33, and glibc defines MSG_WAITFORONE
+ * right along with it, so use that to tell whether it is available. */
+#ifdef MSG_WAITFORONE
+#define HAVE_RECVMMSG
+#endif
+
+/*!
+ * \brief Buffers for reading a batch of packets from the socket
+ */
+struct iax2_recv_batch {
+	iax2_recv_batch(unsigned int size);
+	~iax2_recv_batch(void);
+
+	unsigned int size;
+	unsigned char *bufs;
+	struct sockaddr_in *addrs;
+	struct iovec *iovs;
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr *msgs;
+#endif
+};
+
+/*! The ids that the peer's file descriptors are added to its reactor with */
+enum iax2_peer_fd_id {
+	/*! The alert, for commands and handoffs */
+	IAX2_PEER_FD_COMMAND,
+	/*! The socket */
+	IAX2_PEER_FD_SOCKET,
+};
+
+/*!
+ * \brief An event dispatcher thread and the queue of events it handles
+ */
+struct iax2_dispatcher {
+	iax2_peer *peer;
+	pthread_t thread;
+	iax2_event_queue queue;
+};
+
+/*!
+ * \brief A packet handed from one shard to another
+ */
+struct iax2_handoff_packet : public iax2_mpsc_node {
+	struct sockaddr_in sin;
+	size_t len;
+	unsigned char buf[0];
+};
+
 /* Borrowed from Asterisk - http://www.asterisk.org/
  * Licensed under the GPL.
  * Copyright (C) 1999 - 2006, Digium, Inc.
@@ -101,8 +147,13 @@ static int iax2_video_prefs[] = {
 };
 
 iax2_peer::iax2_peer(void) : 
-	sockfd(-1), next_call_num(1), next_timer_id(1), event_dispatch(true),
-	capabilities(IAX2_FORMAT_SLINEAR), preferred_format(IAX2_FORMAT_SLINEAR)
+	sockfd(-1), reactor(NULL), recv_batch_size(IAX2_DEFAULT_RECV_BATCH_SIZE), recv_batch(NULL),
+	trunk(tx_queue),
+	shard_group(NULL), shard_index(0), inline_event_handler(NULL), inline_event_mask(0),
+	event_dispatchers(NULL), num_event_dispatchers(0), event_dispatchers_started(false),
+	event_pull_mode(false),
+	capabilities(IAX2_FORMAT_SLINEAR), preferred_format(IAX2_FORMAT_SLINEAR),
+	ack_delay(IAX2_DEFAULT_ACK_DELAY)
 {
 	memset(&local_addr, 0, sizeof(local_addr));
 	local_addr.sin_family = AF_INET;
@@ -112,8 +163,13 @@ iax2_peer::iax2_peer(void) :
 }
 
 iax2_peer::iax2_peer(unsigned short local_port) : 
-	sockfd(-1), next_call_num(1), next_timer_id(1), event_dispatch(true),
-	capabilities(IAX2_FORMAT_SLINEAR), preferred_format(IAX2_FORMAT_SLINEAR)
+	sockfd(-1), reactor(NULL), recv_batch_size(IAX2_DEFAULT_RECV_BATCH_SIZE), recv_batch(NULL),
+	trunk(tx_queue),
+	shard_group(NULL), shard_index(0), inline_event_handler(NULL), inline_event_mask(0),
+	event_dispatchers(NULL), num_event_dispatchers(0), event_dispatchers_started(false),
+	event_pull_mode(false),
+	capabilities(IAX2_FORMAT_SLINEAR), preferred_format(IAX2_FORMAT_SLINEAR),
+	ack_delay(IAX2_DEFAULT_ACK_DELAY)
 {
 	memset(&local_addr, 0, sizeof(local_addr));
 	local_addr.sin_family = AF_INET;
@@ -127,50 +183,36 @@ iax2_peer::~iax2_peer(void)
 	if (sockfd > -1)
 		close(sockfd);
 
-	if (command_alert_pipe[0] > -1)
-		close(command_alert_pipe[0]);
-	if (command_alert_pipe[1] > -1)
-		close(command_alert_pipe[1]);
-
-	// Shut down the event_dispatcher thread.
-	event_dispatch = false;
-	// The event_dispatcher thread may be sleeping at this point, so it must be
-	// signalled to wake up.
-	pthread_mutex_lock(&event_cond_lock);
-	pthread_cond_signal(&event_cond);
-	pthread_mutex_unlock(&event_cond_lock);
-	// Now, wait for the thread to actually exit.
-	pthread_join(event_dispatch_thread, NULL);
-
-	pthread_mutex_destroy(&next_call_num_lock);
-	pthread_mutex_destroy(&event_queue_lock);
-	pthread_mutex_destroy(&command_queue_lock);
-	pthread_mutex_destroy(&event_handlers_lock);
-	pthread_mutex_destroy(&event_cond_lock);
-	
-	pthread_cond_destroy(&event_cond);
+	if (recv_batch)
+		delete recv_batch;
+
+	if (reactor)
+		delete reactor;
+
+	destroy_event_dispatchers();
+
+	iax2_mpsc_node *node;
+	while ((node = handoff_queue.pop()))
+		free(static_cast<iax2_handoff_packet *>(node));
+	while ((node = command_queue.pop()))
+		delete static_cast<iax2_command *>(node);
+
+	pthread_rwlock_destroy(&event_handlers_lock);
+	pthread_rwlock_destroy(&jitterbuffers_lock);
 }
 
 void iax2_peer::common_init(void)
 {
-	pthread_mutex_init(&next_call_num_lock, NULL);
-	pthread_mutex_init(&event_queue_lock, NULL);
-	pthread_mutex_init(&command_queue_lock, NULL);
-	pthread_mutex_init(&event_handlers_lock, NULL);
-	pthread_mutex_init(&event_cond_lock, NULL);
+	pthread_rwlock_init(&event_handlers_lock, NULL);
+	pthread_rwlock_init(&jitterbuffers_lock, NULL);
 
-	pthread_cond_init(&event_cond, NULL);
-
-	pthread_mutex_lock(&event_cond_lock);
-	pthread_create(&event_dispatch_thread, NULL, event_dispatcher, this);
-	pthread_cond_wait(&event_cond, &event_cond_lock);
-	pthread_mutex_unlock(&event_cond_lock);	
+	set_event_dispatchers(IAX2_DEFAULT_EVENT_DISPATCHERS);
 
 	outbound_registrations.clear();
 
-	command_alert_pipe[0] = command_alert_pipe[1] = -1;
-	if (pipe(command_alert_pipe))
-		printf("Failed to create command alert pipe! (%s)\n", strerror(errno));
+	alert_signalled = 0;
+	if (alert.open())
+		printf("Failed to create command alert!\n");
 
 	reference_time = tvnow();
 }
@@ -179,32 +221,229 @@ unsigned short iax2_peer::get_next_call_num(void)
 {
 	unsigned short num;
 
-	pthread_mutex_lock(&next_call_num_lock);
-	num = next_call_num++;
-	pthread_mutex_unlock(&next_call_num_lock);
+	if (!(num = call_nums.alloc()))
+		printf("Every call number is in use!\n");
 
 	return num;
 }
 
-void iax2_peer::recv_packet(void)
+int iax2_peer::add_dialog(iax2_dialog *dialog)
+{
+	if (!dialogs.insert(dialog))
+		return 0;
+
+	// The call number still belongs to the dialog in the table, so it must
+	// not be given back when this one is deleted.
+	dialog->disown_call_num();
+	delete dialog;
+
+	return -1;
+}
+
+void iax2_peer::handle_packet(const unsigned char *buf, size_t len, 
+	const struct sockaddr_in *sin, bool handed_off)
+{
+	// The frame is only a view of buf, which is reused for the next packet.
+	iax2_frame frame(buf, len, true);
+
+	if (shard_group && !handed_off && hand_off_packet(frame, buf, len, sin))
+		return;
+
+	tracer.trace(frame, sin);
+
+	if (frame.get_shell() == IAX2_FRAME_META && frame.get_meta_type() == IAX2_META_TRUNK) {
+		process_trunk_frame(frame, sin, handed_off);
+		return;
+	}
+
+	process_incoming_frame(frame, sin);
+}
+
+bool iax2_peer::hand_off_packet(const iax2_frame &frame, const unsigned char *buf, 
+	size_t len, const struct sockaddr_in *sin)
+{
+	int shard;
+
+	// The calls in a trunk frame can belong to different shards, so it is
+	// split up first.
+	if (frame.get_shell() == IAX2_FRAME_META && frame.get_meta_type() == IAX2_META_TRUNK)
+		return false;
+
+	if (frame.get_shell() == IAX2_FRAME_FULL) {
+		// Frames that start a new dialog are handled wherever they arrive.
+		if (!frame.get_dest_call_num())
+			return false;
+		shard = shard_group->shard_for_call_num(frame.get_dest_call_num());
+	} else {
+		u_int64_t key = media_key(sin, frame.get_source_call_num());
+		if (media_dialogs.find(key) != media_dialogs.end())
+			return false;
+		shard = shard_group->find_media_route(key);
+	}
+
+	if (shard < 0 || (unsigned int) shard == shard_index)
+		return false;
+
+	shard_group->hand_off(shard, buf, len, sin);
+
+	return true;
+}
+
+void iax2_peer::process_trunk_frame(const iax2_frame &frame, const struct sockaddr_in *sin,
+	bool handed_off)
+{
+	iax2_trunk_call call;
+	size_t offset = 0;
+
+	while (!frame.get_trunk_call(&offset, &call)) {
+		u_int64_t key = media_key(sin, call.call_num);
+		media_dialogs_iterator i = media_dialogs.find(key);
+
+		if (i != media_dialogs.end()) {
+			i->second->process_trunk_call(frame, call);
+			continue;
+		}
+
+		int shard = (shard_group && !handed_off) ? shard_group->find_media_route(key) : -1;
+		if (shard < 0 || (unsigned int) shard == shard_index) {
+			printf("Didn't find a dialog for call '%u' in a trunk frame\n", call.call_num);
+			continue;
+		}
+
+		// Give the other shard a trunk frame with just this call in it
+		unsigned char buf[IAX2_MAX_PACKET_LEN];
+		iax2_meta_trunk_header *header = (iax2_meta_trunk_header *) buf;
+		size_t len;
+
+		header->zeros = 0;
+		header->metacmd = IAX2_META_CMD_TRUNK;
+		header->cmddata = frame.has_trunk_timestamps() ? IAX2_META_TRUNK_TIMESTAMPS : 0;
+		header->ts = htonl(frame.get_timestamp());
+
+		if (frame.has_trunk_timestamps()) {
+			iax2_meta_trunk_mini *entry = (iax2_meta_trunk_mini *) header->data;
+			entry->len = htons(call.len);
+			entry->callno = htons(call.call_num);
+			entry->ts = htons(call.timestamp);
+			memcpy(entry->data, call.data, call.len);
+			len = sizeof(*header) + sizeof(*entry) + call.len;
+		} else {
+			iax2_meta_trunk_entry *entry = (iax2_meta_trunk_entry *) header->data;
+			entry->callno = htons(call.call_num);
+			entry->len = htons(call.len);
+			memcpy(entry->data, call.data, call.len);
+			len = sizeof(*header) + sizeof(*entry) + call.len;
+		}
+
+		shard_group->hand_off(shard, buf, len, sin);
+	}
+}
+
+void iax2_peer::queue_handoff(const unsigned char *buf, size_t len, 
+	const struct sockaddr_in *sin)
+{
+	iax2_handoff_packet *packet;
+
+	if (!(packet = (iax2_handoff_packet *) malloc(sizeof(*packet) + len)))
+		return;
+
+	memcpy(&packet->sin, sin, sizeof(packet->sin));
+	packet->len = len;
+	memcpy(packet->buf, buf, len);
+
+	handoff_queue.push(packet);
+	signal_alert();
+}
+
+void iax2_peer::handle_handoffs(void)
+{
+	iax2_mpsc_node *node;
+
+	while ((node = handoff_queue.pop())) {
+		iax2_handoff_packet *packet = static_cast<iax2_handoff_packet *>(node);
+		handle_packet(packet->buf, packet->len, &packet->sin, true);
+		free(packet);
+	}
+}
+
+void iax2_peer::signal_alert(void)
+{
+	if (__sync_bool_compare_and_swap(&alert_signalled, 0, 1))
+		alert.signal();
+}
+
+void iax2_peer::clear_alert(void)
 {
-	unsigned char buf[4096];
+	alert.clear();
+
+	// Anything queued from here on has to signal again.  The barrier keeps
+	// the queues from being read before the flag is cleared.
+	alert_signalled = 0;
+	__sync_synchronize();
+}
+
+int iax2_peer::recv_packet(void)
+{
+	unsigned char buf[IAX2_MAX_PACKET_LEN];
 	ssize_t res;
 	struct sockaddr_in sin;
 	socklen_t len = (socklen_t) sizeof(sin);
 
-	res = recvfrom(sockfd, static_cast<void *>(&buf), sizeof(buf), 0, 
+	res = recvfrom(sockfd, static_cast<void *>(&buf), sizeof(buf), MSG_DONTWAIT, 
 			(struct sockaddr *) &sin, &len);
 
 	if (res < 0) {
-		printf("recv error (%d): %s\n", errno, strerror(errno));
-		return;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			printf("recv error (%d): %s\n", errno, strerror(errno));
+		return 0;
 	}
 	
-	iax2_frame frame(buf, res);
-	frame.print(&sin);
+	handle_packet(buf, res, &sin);
+
+	return 1;
+}
+
+int iax2_peer::recv_packet_batch(void)
+{
+#ifdef HAVE_RECVMMSG
+	if (!recv_batch || recv_batch->size < 2)
+		return recv_packet();
+
+	for (unsigned int i = 0; i < recv_batch->size; i++)
+		recv_batch->msgs[i].msg_hdr.msg_namelen = sizeof(recv_batch->addrs[i]);
+
+	// The reactor has already said that there is at least one packet waiting,
+	// so just pick up whatever else has arrived along with it.
+	int res = recvmmsg(sockfd, recv_batch->msgs, recv_batch->size, MSG_DONTWAIT, NULL);
+
+	if (res < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			printf("recv error (%d): %s\n", errno, strerror(errno));
+		return 0;
+	}
+
+	for (int i = 0; i < res; i++) {
+		handle_packet((const unsigned char *) recv_batch->iovs[i].iov_base,
+			recv_batch->msgs[i].msg_len, &recv_batch->addrs[i]);
+	}
+
+	return res;
+#else
+	return recv_packet();
+#endif
+}
+
+void iax2_peer::recv_packets(void)
+{
+	// An edge-triggered reactor will not report the socket again until more
+	// packets arrive, so everything that is waiting has to be read now.
+	if (!reactor->is_edge_triggered()) {
+		recv_packet_batch();
+		return;
+	}
 
-	process_incoming_frame(frame, &sin);
+	while (recv_packet_batch() > 0)
+		tx_queue.flush();
 }
 
 int iax2_peer::network_init(void)
@@ -214,11 +453,39 @@ int iax2_peer::network_init(void)
 		return -1;
 	}
 
+	if (shard_group) {
+#ifdef SO_REUSEPORT
+		int on = 1;
+		if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) {
+			printf("Unable to set SO_REUSEPORT: %s\n", strerror(errno));
+			return -1;
+		}
+#else
+		printf("Shard groups need SO_REUSEPORT, which this system does not have\n");
+		return -1;
+#endif
+	}
+
 	if (bind(sockfd, (struct sockaddr *) &local_addr, sizeof(local_addr))) {
 		printf("Unable to bind socket to port '%d': %s\n", ntohs(local_addr.sin_port), strerror(errno));
 		return -1;
 	}
 
+#ifdef HAVE_RECVMMSG
+	if (recv_batch_size > 1)
+		recv_batch = new iax2_recv_batch(recv_batch_size);
+#endif
+
+	reactor = iax2_reactor::create();
+	if (reactor->add(alert.get_fd(), IAX2_PEER_FD_COMMAND) 
+		|| reactor->add(sockfd, IAX2_PEER_FD_SOCKET)) {
+		printf("Unable to add file descriptors to the reactor: %s\n", strerror(errno));
+		return -1;
+	}
+
+	tx_queue.set_sockfd(sockfd);
+	tx_queue.set_tracer(&tracer);
+
 	return 0;
 }
 
@@ -227,10 +494,13 @@ void iax2_peer::start_registrations(void)
 	while (!outbound_registrations.empty()) {
 		iax2_outbound_registration *reg = outbound_registrations.front();
 		outbound_registrations.pop_front();
-		iax2_register_dialog *dialog = new iax2_register_dialog(this, 
-			get_next_call_num(), sockfd, reg->get_sin());
- 		dialogs[dialog->get_call_num()] = dialog;
- 		dialog->start(reg->get_username());
+		unsigned short num = get_next_call_num();
+		if (num) {
+			iax2_register_dialog *dialog = new iax2_register_dialog(this, 
+				num, sockfd, reg->get_sin());
+			if (!add_dialog(dialog))
+				dialog->start(reg->get_username());
+		}
 		delete reg;
 	}
 }
@@ -240,19 +510,11 @@ int iax2_peer::run(pthread_cond_t *cond, pthread_mutex_t *cond_lock)
 	if (network_init())
 		return -1;
 
-	start_registrations();
-
-	struct pollfd pollfds[3]; // Need an extra for swapping the order
-	bool switched = false;
-	// Wait for commands from the application
-	pollfds[0].fd = command_alert_pipe[0];
-	pollfds[0].events = POLLIN;
-	pollfds[0].revents = 0;	
+	if (start_event_dispatchers())
+		return -1;
 
-	// Wait for input on the socket
-	pollfds[1].fd = sockfd;
-	pollfds[1].events = POLLIN;
-	pollfds[1].revents = 0;	
+	start_registrations();
+	tx_queue.flush();
 
 	// Signal back to the application that the peer is up and running
 	if (cond && cond_lock) {
@@ -261,157 +523,124 @@ int iax2_peer::run(pthread_cond_t *cond, pthread_mutex_t *cond_lock)
 		pthread_mutex_unlock(cond_lock);
 	}
 
-	for (;;) {
+	for (bool shutdown = false; !shutdown; ) {
+		unsigned int ready[IAX2_PEER_MAX_READY];
 		int res;
 		int timeout = next_callback_time();
+		int trunk_timeout = trunk.next_flush_time();
+		if (trunk_timeout >= 0 && (timeout < 0 || trunk_timeout < timeout))
+			timeout = trunk_timeout;
 		if (!timeout) {
 			run_callbacks();
+			if (!trunk.next_flush_time())
+				trunk.flush();
+			tx_queue.flush();
 			continue;
 		}
-		if ((res = poll(pollfds, sizeof(pollfds) / sizeof(pollfds[0]), 
-			timeout)) >= 1) {
+		if ((res = reactor->wait(timeout, ready, IAX2_PEER_MAX_READY)) >= 1) {
 			// There is input on the socket and/or command pipe
-			if (pollfds[(switched ? 1 : 0)].revents > 0) {
-				if (handle_command()) 
-					break; // IAX2_COMMAND_TYPE_SHUTDOWN
+			for (int i = 0; i < res && !shutdown; i++) {
+				switch (ready[i]) {
+				case IAX2_PEER_FD_COMMAND:
+					// The alert is shared by commands and handoffs
+					clear_alert();
+					handle_handoffs();
+					if (handle_command()) 
+						shutdown = true; // IAX2_COMMAND_TYPE_SHUTDOWN
+					break;
+				case IAX2_PEER_FD_SOCKET:
+					recv_packets();
+					break;
+				}
 			}
-			if (pollfds[(switched ? 0 : 1)].revents > 0)
-				recv_packet();
 		} else if (!res) {
-			// poll() timed out, meaning a timer has expired
+			// The wait timed out, meaning a timer has expired
 			run_callbacks();
-		} else if (res != EINTR) {
-			// poll() returned some kind of error.  However, we ignore it if
+		} else if (errno != EINTR) {
+			// The wait returned some kind of error.  However, we ignore it if
 			// it was just an interrupted system call.
-			printf("iax2_peer::run() - poll returned error: %s\n", 
+			printf("iax2_peer::run() - reactor returned error: %s\n", 
 				strerror(errno));
 		}
 
-		// Swap poll() priority.
-		pollfds[2].fd = pollfds[0].fd;
-		pollfds[0].fd = pollfds[1].fd;
-		pollfds[1].fd = pollfds[2].fd;
-		switched = !switched;
+		call_nums.expire();
+
+		// Send everything that was generated during this round
+		if (!trunk.next_flush_time())
+			trunk.flush();
+		tx_queue.flush();
 	}
 
+	trunk.flush();
+	tx_queue.flush();
+
 	return 0;
 }
 
 int iax2_peer::handle_command(void)
 {
-	pthread_mutex_lock(&command_queue_lock);
-	while (!command_queue.empty()) {
-		int alert;
-		read(command_alert_pipe[0], &alert, sizeof(alert));
-
-		iax2_command *command = command_queue.front();
-		command_queue.pop();
+	iax2_mpsc_node *node;
 
-		// Leave the command queue unlocked while the current command is processed
-		pthread_mutex_unlock(&command_queue_lock);
+	while ((node = command_queue.pop())) {
+		iax2_command *command = static_cast<iax2_command *>(node);
 
 		if (command->get_type() == IAX2_COMMAND_TYPE_NEW) {
 			handle_newcall_command(*command);
 			delete command;
-			pthread_mutex_lock(&command_queue_lock);
 			continue;
 		} else if (command->get_type() == IAX2_COMMAND_TYPE_LAGRQ) {
 			handle_lagrq_command(*command);
 			delete command;
-			pthread_mutex_lock(&command_queue_lock);
 			continue;
 		} else if (command->get_type() == IAX2_COMMAND_TYPE_SHUTDOWN) {
 			delete command;
 			return -1;
 		}
 
-		iax2_dialog *dialog = dialogs[command->get_call_num()];
+		iax2_dialog *dialog = dialogs.find(command->get_call_num());
 		if (!dialog) {
 			printf("Found no dialog for command with call_num '%u'\n", 
 				command->get_call_num());
 			delete command;
-			pthread_mutex_lock(&command_queue_lock);
 			continue;
 		}
 
 		dialog->process_command(*command);
 		delete command;
-		pthread_mutex_lock(&command_queue_lock);
 	}
-	pthread_mutex_unlock(&command_queue_lock);
 
 	return 0;
 }
 
 unsigned int iax2_peer::start_timer(iax2_dialog *dialog, struct timeval tv)
 {
-	int res;
-
-	callback_queue.push(iax2_timer_event(dialog, tv, next_timer_id));
-	res = next_timer_id++;
-
-	return res;
+	return timers.start(dialog, tv);
 }
 
 int iax2_peer::stop_timer(unsigned int id)
 {
-	int res = -1;
-	priority_queue<iax2_timer_event> tmp_queue;
-	iax2_timer_event event;
-
-	while (!callback_queue.empty()) {
-		event = callback_queue.top();
-		callback_queue.pop();
-		if (event.get_id() == id) {
-			res = 0;
-			break;
-		}
-		tmp_queue.push(event);
-	}
-
-	while (!tmp_queue.empty()) {
-		callback_queue.push(tmp_queue.top());
-		tmp_queue.pop();
-	}
-
-	return res;
+	return timers.stop(id);
 }
 
 int iax2_peer::next_callback_time(void)
 {
-	struct timeval now, next;
-	int res;
-
-	if (callback_queue.empty())
-		return -1;
-
-	now = tvnow();
-
-	next = callback_queue.top().get_time_to_run();
-
-	return ((res = tvdiff_ms(next, now)) < 0) ? 0 : res;
+	return timers.next_expiry();
 }
 
 void iax2_peer::run_callbacks(void)
 {
-	iax2_timer_event event;	
-
-	while (!callback_queue.empty()) {
-		if (next_callback_time() > 0)
-			return;
-		
-		event = callback_queue.top();
-		callback_queue.pop();
+	iax2_dialog *dialog;
 
-		switch (event.get_dialog()->timer_callback()) {
+	while ((dialog = timers.expire())) {
+		switch (dialog->timer_callback()) {
 		case IAX2_DIALOG_RESULT_SUCCESS:
 			break;
 		case IAX2_DIALOG_RESULT_DESTROY:
- 			dialogs.erase(event.get_dialog()->get_call_num());
-	 		delete event.get_dialog();
+			dialogs.erase(dialog->get_call_num());
+	 		delete dialog;
  			break;
 		case IAX2_DIALOG_RESULT_DELETE:
-			delete event.get_dialog();
+			delete dialog;
 			break;
 		default:
 			break;			
@@ -421,63 +650,189 @@ void iax2_peer::run_callbacks(void)
 
 int iax2_peer::register_event_handler(iax2_event_handler handler)
 {
-	pthread_mutex_lock(&event_handlers_lock);
+	pthread_rwlock_wrlock(&event_handlers_lock);
 	event_handlers.push_back(handler);
-	pthread_mutex_unlock(&event_handlers_lock);
+	pthread_rwlock_unlock(&event_handlers_lock);
 
 	return 0;
 }
 
+int iax2_peer::register_event_batch_handler(iax2_event_batch_handler handler)
+{
+	pthread_rwlock_wrlock(&event_handlers_lock);
+	event_batch_handlers.push_back(handler);
+	pthread_rwlock_unlock(&event_handlers_lock);
+
+	return 0;
+}
+
+void iax2_peer::set_inline_event_handler(iax2_event_handler handler, unsigned int type_mask)
+{
+	inline_event_handler = handler;
+	inline_event_mask = handler ? type_mask : 0;
+}
+
+void iax2_peer::post_event(iax2_event &event)
+{
+	if (inline_event_mask & IAX2_EVENT_MASK(event.get_type()))
+		inline_event_handler(event);
+	else
+		queue_event(event.dup());
+}
+
 void iax2_peer::queue_event(iax2_event *event)
 {
 	if (!event)
 		return;
 
-	pthread_mutex_lock(&event_queue_lock);
-	event_queue.push(event);
-	pthread_mutex_unlock(&event_queue_lock);
+	// Keep all of the events for a call on the same dispatcher, in order
+	event_dispatchers[event->get_call_num() % num_event_dispatchers]->queue.push(event);
+}
+
+void iax2_peer::dispatch_events(iax2_event **events, unsigned int num_events)
+{
+	unsigned int n;
+
+	pthread_rwlock_rdlock(&event_handlers_lock);
+	for (iax2_event_batch_handler_iterator i = event_batch_handlers.begin(); 
+	     i != event_batch_handlers.end(); i++) {
+		(*i)(events, num_events);
+	}
+	for (n = 0; n < num_events; n++) {
+		for (iax2_event_handler_iterator i = event_handlers.begin(); 
+		     i != event_handlers.end(); i++) {
+			(*i)(*events[n]);
+		}
+	}
+	pthread_rwlock_unlock(&event_handlers_lock);
 
-	pthread_mutex_lock(&event_cond_lock);
-	pthread_cond_signal(&event_cond);
-	pthread_mutex_unlock(&event_cond_lock);
+	for (n = 0; n < num_events; n++)
+		delete events[n];
 }
 
 void *iax2_peer::event_dispatcher(void *data)
 {
-	iax2_peer *_this = (iax2_peer *) data;
-
-	// Notify the constructor that the thread is running
-	pthread_mutex_lock(&_this->event_cond_lock);
-	pthread_cond_signal(&_this->event_cond);
-	pthread_mutex_unlock(&_this->event_cond_lock);
-
-	while (_this->event_dispatch) {
-		pthread_mutex_lock(&_this->event_queue_lock);
-		while (!_this->event_queue.empty()) {
-			iax2_event *event = _this->event_queue.front();
-			_this->event_queue.pop();
-			pthread_mutex_unlock(&_this->event_queue_lock);
-			// Call the event handlers without the event queue locked so that it doesn't
-			// block queueing more events
-			pthread_mutex_lock(&_this->event_handlers_lock);
-			for (iax2_event_handler_iterator i = _this->event_handlers.begin(); 
-			     i != _this->event_handlers.end(); i++) {
-				(*i)(*event);
+	iax2_dispatcher *dispatcher = (iax2_dispatcher *) data;
+	iax2_event *events[IAX2_EVENT_BATCH_SIZE];
+	unsigned int num_events;
+
+	while (!dispatcher->queue.is_interrupted()) {
+		if (!(num_events = dispatcher->queue.pop(events, IAX2_EVENT_BATCH_SIZE))) {
+			// Sleep until there is another event to dispatch, or the thread
+			// needs to stop.
+			dispatcher->queue.wait();
+			continue;
+		}
+		dispatcher->peer->dispatch_events(events, num_events);
+	}
+
+	return NULL;
+}
+
+int iax2_peer::set_event_dispatchers(unsigned int num)
+{
+	if (event_dispatchers_started)
+		return -1;
+
+	destroy_event_dispatchers();
+
+	// In pull mode, there is still a queue for the events, but no thread
+	event_pull_mode = !num;
+	if (event_pull_mode)
+		num = 1;
+
+	event_dispatchers = new iax2_dispatcher *[num];
+	for (unsigned int i = 0; i < num; i++) {
+		event_dispatchers[i] = new iax2_dispatcher;
+		event_dispatchers[i]->peer = this;
+	}
+	num_event_dispatchers = num;
+
+	if (event_pull_mode && event_dispatchers[0]->queue.open_fd())
+		return -1;
+
+	return 0;
+}
+
+int iax2_peer::poll_events(iax2_event **events, unsigned int max, int timeout)
+{
+	struct timeval end;
+	unsigned int num;
+
+	if (!event_pull_mode)
+		return -1;
+
+	iax2_event_queue &queue = event_dispatchers[0]->queue;
+
+	if (timeout > 0)
+		end = tvadd(tvnow(), samp2tv(timeout, 1000));
+
+	while (!(num = queue.pop(events, max)) && timeout) {
+		if (queue.is_interrupted())
+			break;
+		if (timeout > 0 && (timeout = tvdiff_ms(end, tvnow())) <= 0)
+			break;
+		queue.wait(timeout);
+	}
+
+	return num;
+}
+
+int iax2_peer::get_event_fd(void) const
+{
+	if (!event_pull_mode)
+		return -1;
+
+	return event_dispatchers[0]->queue.get_fd();
+}
+
+int iax2_peer::start_event_dispatchers(void)
+{
+	unsigned int i, j;
+
+	// The application takes the events itself with poll_events()
+	if (event_pull_mode)
+		return 0;
+
+	for (i = 0; i < num_event_dispatchers; i++) {
+		if (pthread_create(&event_dispatchers[i]->thread, NULL, event_dispatcher, 
+			event_dispatchers[i])) {
+			printf("Unable to start event dispatcher thread: %s\n", strerror(errno));
+			// Stop the threads that did start
+			for (j = 0; j < i; j++) {
+				event_dispatchers[j]->queue.interrupt();
+				pthread_join(event_dispatchers[j]->thread, NULL);
 			}
-			pthread_mutex_unlock(&_this->event_handlers_lock);
-			delete event;
-			pthread_mutex_lock(&_this->event_queue_lock);
+			destroy_event_dispatchers();
+			return -1;
 		}
-		pthread_mutex_unlock(&_this->event_queue_lock);
+	}
+	event_dispatchers_started = true;
 
-		// Sleep until there is another event to dispatch, or the thread
-		// needs to stop.
-		pthread_mutex_lock(&_this->event_cond_lock);
-		pthread_cond_wait(&_this->event_cond, &_this->event_cond_lock);
-		pthread_mutex_unlock(&_this->event_cond_lock);
+	return 0;
+}
+
+void iax2_peer::destroy_event_dispatchers(void)
+{
+	unsigned int i;
+
+	if (!event_dispatchers)
+		return;
+
+	// The dispatchers may be sleeping at this point, so they must be woken up
+	// before waiting for them to exit.
+	for (i = 0; i < num_event_dispatchers; i++)
+		event_dispatchers[i]->queue.interrupt();
+	for (i = 0; i < num_event_dispatchers; i++) {
+		if (event_dispatchers_started)
+			pthread_join(event_dispatchers[i]->thread, NULL);
+		delete event_dispatchers[i];
 	}
+	delete [] event_dispatchers;
 
-	return NULL;
+	event_dispatchers = NULL;
+	num_event_dispatchers = 0;
+	event_dispatchers_started = false;
 }
 
 void iax2_peer::add_outbound_registration(const char *username, 
@@ -499,6 +854,9 @@ unsigned short iax2_peer::new_call(const char *uri)
 {
 	unsigned short num = get_next_call_num();
 
+	if (!num)
+		return 0;
+
 	send_command(new iax2_command(IAX2_COMMAND_TYPE_NEW, num, uri));
 
 	return num;
@@ -508,6 +866,9 @@ unsigned short iax2_peer::new_lag(const char *uri)
 {
 	unsigned short num = get_next_call_num();
 
+	if (!num)
+		return 0;
+
 	send_command(new iax2_command(IAX2_COMMAND_TYPE_LAGRQ, num, uri));
 
 	return num;
@@ -515,12 +876,71 @@ unsigned short iax2_peer::new_lag(const char *uri)
 
 enum iax2_command_result iax2_peer::send_command(iax2_command *command)
 {
-	int alert = 0;
+	command_queue.push(command);
+	signal_alert();
 
-	pthread_mutex_lock(&command_queue_lock);
-	command_queue.push(command);	
-	write(command_alert_pipe[1], &alert, sizeof(alert));
-	pthread_mutex_unlock(&command_queue_lock);
+	return IAX2_COMMAND_RESULT_SUCCESS;
+}
+
+enum iax2_jb_result iax2_peer::get_audio(unsigned short call_num, iax2_jb_frame *frame,
+	void *buf, size_t buflen)
+{
+	enum iax2_jb_result res = IAX2_JB_EMPTY;
+
+	pthread_rwlock_rdlock(&jitterbuffers_lock);
+	jitterbuffers_iterator i = jitterbuffers.find(call_num);
+	if (i != jitterbuffers.end())
+		res = i->second->get(frame, buf, buflen, tvnow());
+	pthread_rwlock_unlock(&jitterbuffers_lock);
+
+	return res;
+}
+
+void iax2_peer::add_jitterbuffer(unsigned short call_num, iax2_jitterbuffer *jb)
+{
+	pthread_rwlock_wrlock(&jitterbuffers_lock);
+	jitterbuffers[call_num] = jb;
+	pthread_rwlock_unlock(&jitterbuffers_lock);
+}
+
+void iax2_peer::remove_jitterbuffer(unsigned short call_num)
+{
+	pthread_rwlock_wrlock(&jitterbuffers_lock);
+	jitterbuffers.erase(call_num);
+	pthread_rwlock_unlock(&jitterbuffers_lock);
+}
+
+void iax2_peer::set_recv_batch_size(unsigned int size)
+{
+	recv_batch_size = size ? size : 1;
+}
+
+void iax2_peer::set_ack_delay(unsigned int ms)
+{
+	ack_delay = ms;
+}
+
+void iax2_peer::set_trunking(unsigned int ms, bool timestamps)
+{
+	trunk.set_interval(ms);
+	trunk.set_timestamps(timestamps);
+}
+
+int iax2_peer::join_shard_group(iax2_shard_group &group)
+{
+	unsigned short first, last;
+	int shard;
+
+	if ((shard = group.join(this)) < 0)
+		return -1;
+
+	shard_group = &group;
+	shard_index = shard;
+
+	group.get_call_num_range(shard_index, &first, &last);
+	call_nums.set_range(first, last);
+
+	return 0;
 }
 
 void iax2_peer::set_capabilities(unsigned int cap)
@@ -583,25 +1003,36 @@ iax2_dialog *iax2_peer::find_dialog_media(iax2_frame &frame, const struct sockad
 	// is because it's been like this in the protocol for too long.
 	// Oh well.  END RANT.
 
-	// XXX \todo Optimize this search, since it is a VERY frequent operation.
+	media_dialogs_iterator i = media_dialogs.find(media_key(sin, frame.get_source_call_num()));
 
-	iax2_dialog *d = NULL;
-	
-	for (dialogs_iterator i = dialogs.begin(); i != dialogs.end(); ++i) {
-		// Match by source call number, IP address, and port number
-		d = i->second;
-		if (!d)
-			continue;
-		if (d->get_remote_call_num() != frame.get_source_call_num())
-			continue;
-		if (d->get_remote_addr()->sin_addr.s_addr != sin->sin_addr.s_addr)
-			continue;
-		if (d->get_remote_addr()->sin_port != sin->sin_port)
-			continue;
-		break;
-	}
+	return i == media_dialogs.end() ? NULL : i->second;
+}
+
+u_int64_t iax2_peer::index_dialog_media(iax2_dialog *dialog)
+{
+	u_int64_t key = media_key(dialog->get_remote_addr(), dialog->get_remote_call_num());
+
+	if (dialog->get_media_key() && dialog->get_media_key() != key)
+		unindex_dialog_media(dialog);
+
+	media_dialogs[key] = dialog;
+	if (shard_group)
+		shard_group->add_media_route(key, shard_index);
 
-	return d;
+	return key;
+}
+
+void iax2_peer::unindex_dialog_media(iax2_dialog *dialog)
+{
+	media_dialogs_iterator i = media_dialogs.find(dialog->get_media_key());
+
+	// A newer dialog with the same remote call number may have replaced this
+	// one in the index already, so only remove the entry if it is ours.
+	if (i != media_dialogs.end() && i->second == dialog) {
+		media_dialogs.erase(i);
+		if (shard_group)
+			shard_group->remove_media_route(dialog->get_media_key(), shard_index);
+	}
 }
 ///////////////////////////////////////////////////////////////////////////////
 
@@ -624,35 +1055,78 @@ iax2_outbound_registration::~iax2_outbound_registration(void)
 
 ///////////////////////////////////////////////////////////////////////////////
 
-iax2_timer_event::iax2_timer_event(void) :
-	id(0), dialog(NULL)
+iax2_recv_batch::iax2_recv_batch(unsigned int num) :
+	size(num)
 {
-	time_to_run.tv_sec = 0;
-	time_to_run.tv_usec = 0;
+	bufs = (unsigned char *) malloc(size * IAX2_MAX_PACKET_LEN);
+	addrs = (struct sockaddr_in *) calloc(size, sizeof(*addrs));
+	iovs = (struct iovec *) calloc(size, sizeof(*iovs));
+#ifdef HAVE_RECVMMSG
+	msgs = (struct mmsghdr *) calloc(size, sizeof(*msgs));
+#endif
+
+	for (unsigned int i = 0; i < size; i++) {
+		iovs[i].iov_base = bufs + (i * IAX2_MAX_PACKET_LEN);
+		iovs[i].iov_len = IAX2_MAX_PACKET_LEN;
+#ifdef HAVE_RECVMMSG
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+#endif
+	}
 }
 
-iax2_timer_event::iax2_timer_event(iax2_dialog *dlg,
-	struct timeval tv, unsigned int id_num) : 
-	id(id_num), dialog(dlg), time_to_run(tv)
+iax2_recv_batch::~iax2_recv_batch(void)
 {
+	free(bufs);
+	free(addrs);
+	free(iovs);
+#ifdef HAVE_RECVMMSG
+	free(msgs);
+#endif
 }
 
-iax2_timer_event::~iax2_timer_event(void) 
+///////////////////////////////////////////////////////////////////////////////
+
+iax2_dialog_table::iax2_dialog_table(void) :
+	count(0)
 {
+	slots = (iax2_dialog **) calloc(IAX2_MAX_CALL_NUMS, sizeof(*slots));
 }
 
-/* This probably looks kind of backwards.  However, it is the way it is supposed
- * to be.  These entries go into a priority queue and this is how you make them
- * get sorted correctly. */
-bool iax2_timer_event::operator<(const iax2_timer_event &e) const
+iax2_dialog_table::~iax2_dialog_table(void)
 {
-	if (time_to_run.tv_sec < e.time_to_run.tv_sec)
-		return false;
-	else if (time_to_run.tv_sec != e.time_to_run.tv_sec)
-		return true;
-	else if (time_to_run.tv_usec < e.time_to_run.tv_usec)
-		return false;
-	return true;
+	free(slots);
+}
+
+int iax2_dialog_table::insert(iax2_dialog *dialog)
+{
+	unsigned short num = dialog->get_call_num() & (IAX2_MAX_CALL_NUMS - 1);
+
+	if (slots[num] == dialog)
+		return 0;
+
+	if (slots[num]) {
+		printf("Call number '%u' is already in use by another dialog\n", num);
+		return -1;
+	}
+
+	slots[num] = dialog;
+	count++;
+
+	return 0;
+}
+
+void iax2_dialog_table::erase(unsigned short num)
+{
+	num &= IAX2_MAX_CALL_NUMS - 1;
+
+	if (!slots[num])
+		return;
+
+	slots[num] = NULL;
+	count--;
 }
 
 //////////////////////////////////////////////////////////////////////////////////
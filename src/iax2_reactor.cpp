@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2006, Russell Bryant <russell@russellbryant.net> 
+ *
+ * This file is part of LibIAX2xx.
+ *
+ * LibIAX2xx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * LibIAX2xx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LibIAX2xx; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*!
+ * \file
+ * \author Russell Bryant <russell@russellbryant.net>
+ *
+ * \brief IAX2 event loop reactors
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef POLL_COMPAT
+#include "poll-compat.h"
+#else
+#include <poll.h>
+#endif
+
+#if defined(__linux__) && !defined(POLL_COMPAT)
+#define HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#include <vector>
+
+using namespace std;
+
+#include "iax2/iax2_reactor.h"
+
+/*!
+ * \brief A reactor that uses poll()
+ *
+ * The order that file descriptors are reported in is rotated after each
+ * wakeup, so that a busy one is not always handled first.
+ */
+class iax2_poll_reactor : public iax2_reactor {
+public:
+	iax2_poll_reactor(void) : first(0) { }
+
+	int add(int fd, unsigned int id);
+	int remove(int fd);
+	int wait(int timeout, unsigned int *ids, unsigned int max);
+	inline bool is_edge_triggered(void) const
+		{ return false; }
+
+private:
+	vector<struct pollfd> pollfds;
+	vector<unsigned int> fd_ids;
+	/*! The entry in pollfds to start reporting from on the next wakeup */
+	unsigned int first;
+};
+
+int iax2_poll_reactor::add(int fd, unsigned int id)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	pollfds.push_back(pfd);
+	fd_ids.push_back(id);
+
+	return 0;
+}
+
+int iax2_poll_reactor::remove(int fd)
+{
+	for (unsigned int i = 0; i < pollfds.size(); i++) {
+		if (pollfds[i].fd != fd)
+			continue;
+		pollfds.erase(pollfds.begin() + i);
+		fd_ids.erase(fd_ids.begin() + i);
+		return 0;
+	}
+
+	return -1;
+}
+
+int iax2_poll_reactor::wait(int timeout, unsigned int *ids, unsigned int max)
+{
+	unsigned int num = pollfds.size(), count = 0;
+	int res;
+
+	if ((res = poll(num ? &pollfds[0] : NULL, num, timeout)) <= 0)
+		return res;
+
+	for (unsigned int i = 0; i < num && count < max; i++) {
+		unsigned int n = (first + i) % num;
+		if (pollfds[n].revents)
+			ids[count++] = fd_ids[n];
+	}
+
+	if (num)
+		first = (first + 1) % num;
+
+	return count;
+}
+
+#ifdef HAVE_EPOLL
+/*!
+ * \brief A reactor that uses epoll in edge-triggered mode
+ */
+class iax2_epoll_reactor : public iax2_reactor {
+public:
+	iax2_epoll_reactor(int fd) : epfd(fd) { }
+	~iax2_epoll_reactor(void);
+
+	int add(int fd, unsigned int id);
+	int remove(int fd);
+	int wait(int timeout, unsigned int *ids, unsigned int max);
+	inline bool is_edge_triggered(void) const
+		{ return true; }
+
+private:
+	int epfd;
+};
+
+iax2_epoll_reactor::~iax2_epoll_reactor(void)
+{
+	close(epfd);
+}
+
+int iax2_epoll_reactor::add(int fd, unsigned int id)
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | EPOLLET;
+	event.data.u32 = id;
+
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event);
+}
+
+int iax2_epoll_reactor::remove(int fd)
+{
+	struct epoll_event event;
+
+	// Kernels before 2.6.9 want a non-NULL event, even though it is ignored.
+	return epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &event);
+}
+
+int iax2_epoll_reactor::wait(int timeout, unsigned int *ids, unsigned int max)
+{
+	struct epoll_event *events = (struct epoll_event *) alloca(max * sizeof(*events));
+	int res;
+
+	if ((res = epoll_wait(epfd, events, max, timeout)) <= 0)
+		return res;
+
+	for (int i = 0; i < res; i++)
+		ids[i] = events[i].data.u32;
+
+	return res;
+}
+#endif /* HAVE_EPOLL */
+
+iax2_reactor *iax2_reactor::create(void)
+{
+#ifdef HAVE_EPOLL
+	int epfd;
+
+	if ((epfd = epoll_create(16)) > -1)
+		return new iax2_epoll_reactor(epfd);
+
+	fprintf(stderr, "epoll_create failed (%s), falling back to poll()\n", strerror(errno));
+#endif
+
+	return new iax2_poll_reactor();
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2006, Russell Bryant <russell@russellbryant.net> 
+ *
+ * This file is part of LibIAX2xx.
+ *
+ * LibIAX2xx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * LibIAX2xx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LibIAX2xx; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*!
+ * \file
+ * \author Russell Bryant <russell@russellbryant.net>
+ *
+ * \brief IAX2 round trip time estimation
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <tr1/unordered_map>
+
+using namespace std;
+
+#include "iax2/iax2_rtt.h"
+
+unsigned int iax2_rtt_table::get_rto(const struct sockaddr_in *sin) const
+{
+	table_const_iterator i = table.find(key(sin));
+
+	return i == table.end() ? IAX2_RTO_INITIAL : i->second.rto;
+}
+
+void iax2_rtt_table::sample(const struct sockaddr_in *sin, unsigned int rtt)
+{
+	table_iterator i = table.find(key(sin));
+	iax2_rtt *est;
+
+	if (i == table.end()) {
+		// Entries are never aged out, so start over rather than grow
+		// without bound.  The estimates come back quickly.
+		if (table.size() >= IAX2_RTT_TABLE_MAX)
+			table.clear();
+
+		// RFC 6298, section 2.2
+		est = &table[key(sin)];
+		est->srtt = rtt;
+		est->rttvar = rtt / 2;
+	} else {
+		// RFC 6298, section 2.3, with alpha = 1/8 and beta = 1/4
+		est = &i->second;
+		unsigned int err = est->srtt > rtt ? est->srtt - rtt : rtt - est->srtt;
+		est->rttvar = (3 * est->rttvar + err) / 4;
+		est->srtt = (7 * est->srtt + rtt) / 8;
+	}
+
+	est->rto = est->srtt + 4 * est->rttvar;
+	if (est->rto < IAX2_RTO_MIN)
+		est->rto = IAX2_RTO_MIN;
+	else if (est->rto > IAX2_RTO_MAX)
+		est->rto = IAX2_RTO_MAX;
+}
+
+unsigned int iax2_rtt_table::backoff(unsigned int rto, unsigned int count)
+{
+	while (count-- && rto < IAX2_RTO_MAX)
+		rto *= 2;
+
+	return rto > IAX2_RTO_MAX ? IAX2_RTO_MAX : rto;
+}
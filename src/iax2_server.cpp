@@ -65,23 +65,30 @@ iax2_server::~iax2_server(void)
 void iax2_server::process_incoming_frame(iax2_frame &frame, const struct sockaddr_in *sin)
 {
 	iax2_dialog *dialog = NULL;
+	unsigned short num;
 	if (frame.get_shell() == IAX2_FRAME_FULL &&
 	    frame.get_type() == IAX2_FRAME_TYPE_IAX2 &&
 	    frame.get_subclass() == IAX2_SUBCLASS_REGREQ) {
-		if (!(dialog = new iax2_registrar_dialog(this, get_next_call_num(), sockfd)))
+		if (!(num = get_next_call_num()))
+			return;
+		if (!(dialog = new iax2_registrar_dialog(this, num, sockfd)))
+			return;
+		if (add_dialog(dialog))
 			return;
-		dialogs[dialog->get_call_num()] = dialog;
 	}
 	else if (frame.get_shell() == IAX2_FRAME_FULL &&
 	         frame.get_type() == IAX2_FRAME_TYPE_IAX2 &&
 	         frame.get_subclass() == IAX2_SUBCLASS_LAGRQ) {
-	        if (!(dialog = new iax2_lag_dialog(this, get_next_call_num(), sockfd, sin)))
+	        if (!(num = get_next_call_num()))
+	                return;
+	        if (!(dialog = new iax2_lag_dialog(this, num, sockfd, sin)))
+	                return;
+	        if (add_dialog(dialog))
 	                return;
-	        dialogs[dialog->get_call_num()] = dialog;
 	}
 	else {
 		if (frame.get_shell() == IAX2_FRAME_FULL)
-			dialog = dialogs[frame.get_dest_call_num()];
+			dialog = dialogs.find(frame.get_dest_call_num());
 		else
 			dialog = find_dialog_media(frame, sin);
 		
@@ -112,8 +119,11 @@ void iax2_server::handle_newcall_command(iax2_command &command)
 
 	// XXX This function should probably provide some feedback about success/failure ...
 
-	if (strncasecmp("iax2:", uri, 5))
+	if (strncasecmp("iax2:", uri, 5)) {
+		// The call number from new_call() will not be used after all
+		release_call_num(command.get_call_num());
 		return;
+	}
 	uri += 5;
 	
 	// XXX This only supports the uri begin iax2:blah, where blah is a registered peer name
@@ -126,13 +136,16 @@ void iax2_server::handle_newcall_command(iax2_command &command)
 		reg = *i;
 		break;	
 	}
-	if (!reg)
+	if (!reg) {
+		release_call_num(command.get_call_num());
 		return;
+	}
 	
 	iax2_call_dialog *call;
 	if (!(call = new iax2_call_dialog(this, command.get_call_num(), sockfd, reg->get_addr())))
 		return;
-	dialogs[call->get_call_num()] = call;
+	if (add_dialog(call))
+		return;
 
 	call->start();
 }
@@ -144,8 +157,10 @@ void iax2_server::handle_lagrq_command(iax2_command &command)
 
 	// XXX This function should probably provide some feedback about success/failure ...
 
-	if (strncasecmp("iax2:", uri, 5))
+	if (strncasecmp("iax2:", uri, 5)) {
+		release_call_num(command.get_call_num());
 		return;
+	}
 	uri += 5;
 
 	// XXX This only supports the uri begin iax2:blah, where blah is a registered peer name
@@ -158,13 +173,16 @@ void iax2_server::handle_lagrq_command(iax2_command &command)
 		reg = *i;
 		break;	
 	}
-	if (!reg)
+	if (!reg) {
+		release_call_num(command.get_call_num());
 		return;
+	}
 	
 	iax2_lag_dialog *lag;
 	if (!(lag = new iax2_lag_dialog(this, command.get_call_num(), sockfd, reg->get_addr())))
 		return;
-	dialogs[lag->get_call_num()] = lag;
+	if (add_dialog(lag))
+		return;
 
 	lag->start();
 }
@@ -198,8 +216,8 @@ iax2_registration::iax2_registration(iax2_server *server, unsigned short num, in
 
 	username = strdup(un);
 
-	server->queue_event(new iax2_event(IAX2_EVENT_TYPE_REGISTRATION_NEW, 
-		call_num, un));
+	iax2_event event(IAX2_EVENT_TYPE_REGISTRATION_NEW, call_num, un, true);
+	server->post_event(event);
 	timer_id = server->start_timer(this, tvadd(tvnow(), create_tv(IAX2_DEFAULT_REFRESH, 0)));
 }
 
@@ -209,8 +227,8 @@ iax2_registration::~iax2_registration(void)
 
 	server->expire_peer(this);
 
-	server->queue_event(new iax2_event(IAX2_EVENT_TYPE_REGISTRATION_EXPIRED, 
-		call_num, username));
+	iax2_event event(IAX2_EVENT_TYPE_REGISTRATION_EXPIRED, call_num, username, true);
+	server->post_event(event);
 
 	if (username)
 		free((void *) username);
@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2006, Russell Bryant <russell@russellbryant.net> 
+ *
+ * This file is part of LibIAX2xx.
+ *
+ * LibIAX2xx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * LibIAX2xx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LibIAX2xx; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*!
+ * \file
+ * \author Russell Bryant <russell@russellbryant.net>
+ *
+ * \brief IAX2 shard group
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+using namespace std;
+
+#include "iax2/iax2_shard.h"
+#include "iax2/iax2_peer.h"
+
+iax2_shard_group::iax2_shard_group(unsigned int num) :
+	num_shards(num ? num : 1), num_joined(0)
+{
+	// Call number 0 is never used, which leaves IAX2_MAX_CALL_NUMS - 1 to
+	// split up.  The last shard also gets whatever is left over.
+	call_nums_per_shard = (IAX2_MAX_CALL_NUMS - 1) / num_shards;
+
+	shards = (iax2_peer **) calloc(num_shards, sizeof(*shards));
+
+	pthread_mutex_init(&shards_lock, NULL);
+	pthread_rwlock_init(&media_routes_lock, NULL);
+}
+
+iax2_shard_group::~iax2_shard_group(void)
+{
+	free(shards);
+
+	pthread_mutex_destroy(&shards_lock);
+	pthread_rwlock_destroy(&media_routes_lock);
+}
+
+int iax2_shard_group::join(iax2_peer *peer)
+{
+	int res = -1;
+
+	pthread_mutex_lock(&shards_lock);
+	if (shards && num_joined < num_shards) {
+		shards[num_joined] = peer;
+		res = num_joined++;
+	}
+	pthread_mutex_unlock(&shards_lock);
+
+	return res;
+}
+
+void iax2_shard_group::get_call_num_range(unsigned int shard, unsigned short *first,
+	unsigned short *last) const
+{
+	*first = 1 + shard * call_nums_per_shard;
+	if (shard == num_shards - 1)
+		*last = IAX2_MAX_CALL_NUMS - 1;
+	else
+		*last = *first + call_nums_per_shard - 1;
+}
+
+unsigned int iax2_shard_group::shard_for_call_num(unsigned short num) const
+{
+	unsigned int shard;
+
+	if (!num)
+		return 0;
+
+	shard = (unsigned int) (num - 1) / call_nums_per_shard;
+
+	return shard < num_shards ? shard : num_shards - 1;
+}
+
+void iax2_shard_group::add_media_route(u_int64_t key, unsigned int shard)
+{
+	pthread_rwlock_wrlock(&media_routes_lock);
+	media_routes[key] = shard;
+	pthread_rwlock_unlock(&media_routes_lock);
+}
+
+void iax2_shard_group::remove_media_route(u_int64_t key, unsigned int shard)
+{
+	media_routes_iterator i;
+
+	pthread_rwlock_wrlock(&media_routes_lock);
+	if ((i = media_routes.find(key)) != media_routes.end() && i->second == shard)
+		media_routes.erase(i);
+	pthread_rwlock_unlock(&media_routes_lock);
+}
+
+int iax2_shard_group::find_media_route(u_int64_t key)
+{
+	media_routes_iterator i;
+	int res = -1;
+
+	pthread_rwlock_rdlock(&media_routes_lock);
+	if ((i = media_routes.find(key)) != media_routes.end())
+		res = i->second;
+	pthread_rwlock_unlock(&media_routes_lock);
+
+	return res;
+}
+
+void iax2_shard_group::hand_off(unsigned int shard, const unsigned char *buf, 
+	size_t len, const struct sockaddr_in *sin)
+{
+	iax2_peer *peer;
+
+	pthread_mutex_lock(&shards_lock);
+	peer = shard < num_joined ? shards[shard] : NULL;
+	pthread_mutex_unlock(&shards_lock);
+
+	if (!peer) {
+		fprintf(stderr, "No shard '%u' to hand a packet off to!\n", shard);
+		return;
+	}
+
+	peer->queue_handoff(buf, len, sin);
+}
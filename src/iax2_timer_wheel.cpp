@@ -0,0 +1,372 @@
+/*
+ * Copyright (C) 2006, Russell Bryant <russell@russellbryant.net> 
+ *
+ * This file is part of LibIAX2xx.
+ *
+ * LibIAX2xx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * LibIAX2xx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LibIAX2xx; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*!
+ * \file
+ * \author Russell Bryant <russell@russellbryant.net>
+ *
+ * \brief IAX2 timer wheel
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <vector>
+
+using namespace std;
+
+#include "iax2/iax2_timer_wheel.h"
+#include "iax2/time.h"
+
+using namespace iax2xx;
+
+/*! The bit position of the first outer level */
+#define LN_SHIFT(level) (IAX2_TIMER_WHEEL_L0_BITS + (level) * IAX2_TIMER_WHEEL_LN_BITS)
+
+/*! Timers are never placed further away than this many ticks */
+#define MAX_TIMEOUT 0x7fffffff
+
+static inline void list_init(iax2_timer *head)
+{
+	head->next = head->prev = head;
+	head->list = NULL;
+}
+
+static inline bool list_empty(const iax2_timer *head)
+{
+	return head->next == head;
+}
+
+static inline void list_append(iax2_timer *head, iax2_timer *timer)
+{
+	timer->next = head;
+	timer->prev = head->prev;
+	head->prev->next = timer;
+	head->prev = timer;
+	timer->list = head;
+}
+
+/*!
+ * \brief Find the distance from start to the next occupied slot of the first level
+ *
+ * \return the distance, or -1 if no slots are occupied
+ */
+static int l0_distance(const u_int64_t *map, unsigned int start)
+{
+	unsigned int i, word = start >> 6;
+	u_int64_t bits = map[word] & (~0ULL << (start & 63));
+
+	/* The first word is visited twice, the second time for the bits that
+	 * were masked off above. */
+	for (i = 0; i <= IAX2_TIMER_WHEEL_L0_SIZE / 64; i++) {
+		if (bits)
+			return ((word << 6) + __builtin_ctzll(bits) - start) & IAX2_TIMER_WHEEL_L0_MASK;
+		word = (word + 1) % (IAX2_TIMER_WHEEL_L0_SIZE / 64);
+		bits = map[word];
+	}
+
+	return -1;
+}
+
+iax2_timer_wheel::iax2_timer_wheel(void) :
+	clk(0), count(0), free_head(NULL), free_tail(NULL)
+{
+	unsigned int i, j;
+
+	base = tvnow();
+
+	for (i = 0; i < IAX2_TIMER_WHEEL_L0_SIZE; i++)
+		list_init(&l0[i]);
+	for (i = 0; i < IAX2_TIMER_WHEEL_LEVELS; i++) {
+		for (j = 0; j < IAX2_TIMER_WHEEL_LN_SIZE; j++)
+			list_init(&ln[i][j]);
+		ln_map[i] = 0;
+	}
+	for (i = 0; i < IAX2_TIMER_WHEEL_L0_SIZE / 64; i++)
+		l0_map[i] = 0;
+	list_init(&expired);
+}
+
+iax2_timer_wheel::~iax2_timer_wheel(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < chunks.size(); i++)
+		delete [] chunks[i];
+}
+
+unsigned int iax2_timer_wheel::get_tick(struct timeval tv, bool round_up) const
+{
+	long long us;
+
+	us = (tv.tv_sec - base.tv_sec) * 1000000LL + (tv.tv_usec - base.tv_usec);
+	if (us < 0)
+		return 0;
+
+	return (unsigned int) ((us + (round_up ? 999 : 0)) / 1000);
+}
+
+iax2_timer *iax2_timer_wheel::alloc(void)
+{
+	iax2_timer *timer;
+	unsigned int i, first;
+
+	if (!free_head) {
+		first = chunks.size() * IAX2_TIMER_CHUNK_SIZE;
+		if (first + IAX2_TIMER_CHUNK_SIZE > IAX2_TIMER_INDEX_MASK) {
+			fprintf(stderr, "Unable to start timer, too many timers are running\n");
+			return NULL;
+		}
+		timer = new iax2_timer[IAX2_TIMER_CHUNK_SIZE];
+		chunks.push_back(timer);
+		for (i = 0; i < IAX2_TIMER_CHUNK_SIZE; i++) {
+			timer[i].index = first + i;
+			timer[i].generation = 0;
+			timer[i].list = NULL;
+			timer[i].next = (i + 1 < IAX2_TIMER_CHUNK_SIZE) ? &timer[i + 1] : NULL;
+		}
+		free_head = &timer[0];
+		free_tail = &timer[IAX2_TIMER_CHUNK_SIZE - 1];
+	}
+
+	timer = free_head;
+	if (!(free_head = timer->next))
+		free_tail = NULL;
+
+	return timer;
+}
+
+/* Freed timers go on the end of the free list, so that an id is not reused
+ * any sooner than it has to be. */
+void iax2_timer_wheel::release(iax2_timer *timer)
+{
+	timer->list = NULL;
+	timer->dialog = NULL;
+	timer->generation++;
+	timer->next = NULL;
+
+	if (free_tail)
+		free_tail->next = timer;
+	else
+		free_head = timer;
+	free_tail = timer;
+}
+
+void iax2_timer_wheel::add(iax2_timer *timer)
+{
+	unsigned int delta, slot, level;
+
+	delta = timer->expires - clk;
+	if ((int) delta < 0) {
+		timer->expires = clk;
+		delta = 0;
+	} else if (delta > MAX_TIMEOUT) {
+		timer->expires = clk + MAX_TIMEOUT;
+		delta = MAX_TIMEOUT;
+	}
+
+	if (delta < IAX2_TIMER_WHEEL_L0_SIZE) {
+		slot = timer->expires & IAX2_TIMER_WHEEL_L0_MASK;
+		list_append(&l0[slot], timer);
+		l0_map[slot >> 6] |= 1ULL << (slot & 63);
+		return;
+	}
+
+	for (level = 0; level < IAX2_TIMER_WHEEL_LEVELS - 1; level++) {
+		if (delta < (1U << (LN_SHIFT(level) + IAX2_TIMER_WHEEL_LN_BITS)))
+			break;
+	}
+	slot = (timer->expires >> LN_SHIFT(level)) & IAX2_TIMER_WHEEL_LN_MASK;
+	list_append(&ln[level][slot], timer);
+	ln_map[level] |= 1ULL << slot;
+}
+
+void iax2_timer_wheel::unlink(iax2_timer *timer)
+{
+	iax2_timer *head = timer->list;
+	unsigned int slot;
+
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->list = NULL;
+
+	if (!list_empty(head))
+		return;
+
+	/* The slot is empty now, so clear its bit in the map */
+	if (head >= l0 && head < l0 + IAX2_TIMER_WHEEL_L0_SIZE) {
+		slot = head - l0;
+		l0_map[slot >> 6] &= ~(1ULL << (slot & 63));
+	} else if (head >= &ln[0][0] && head < &ln[0][0] + IAX2_TIMER_WHEEL_LEVELS * IAX2_TIMER_WHEEL_LN_SIZE) {
+		slot = head - &ln[0][0];
+		ln_map[slot / IAX2_TIMER_WHEEL_LN_SIZE] &= ~(1ULL << (slot % IAX2_TIMER_WHEEL_LN_SIZE));
+	}
+}
+
+unsigned int iax2_timer_wheel::cascade(unsigned int level, unsigned int index)
+{
+	iax2_timer *head = &ln[level][index];
+	iax2_timer *timer;
+
+	while (!list_empty(head)) {
+		timer = head->next;
+		unlink(timer);
+		add(timer);
+	}
+
+	return index;
+}
+
+void iax2_timer_wheel::run_tick(void)
+{
+	unsigned int index = clk & IAX2_TIMER_WHEEL_L0_MASK;
+	unsigned int level;
+	iax2_timer *timer;
+
+	/* The first level has wrapped around, so move the timers for its next
+	 * turn down from the outer levels. */
+	if (!index) {
+		for (level = 0; level < IAX2_TIMER_WHEEL_LEVELS; level++) {
+			if (cascade(level, (clk >> LN_SHIFT(level)) & IAX2_TIMER_WHEEL_LN_MASK))
+				break;
+		}
+	}
+
+	while (!list_empty(&l0[index])) {
+		timer = l0[index].next;
+		unlink(timer);
+		list_append(&expired, timer);
+	}
+
+	clk++;
+}
+
+/* Find the next tick that something happens on.  That is either the next
+ * occupied slot of the first level or the next time that an occupied slot of
+ * one of the outer levels gets cascaded.  Nothing happens on any of the ticks
+ * before it, so the wheel can skip straight to it. */
+unsigned int iax2_timer_wheel::next_tick(void) const
+{
+	unsigned int level, shift, cur, dist, res = MAX_TIMEOUT;
+	u_int64_t map;
+	int l0_dist;
+
+	if ((l0_dist = l0_distance(l0_map, clk & IAX2_TIMER_WHEEL_L0_MASK)) >= 0)
+		res = l0_dist;
+
+	for (level = 0; level < IAX2_TIMER_WHEEL_LEVELS; level++) {
+		if (!(map = ln_map[level]))
+			continue;
+		shift = LN_SHIFT(level);
+		cur = (clk >> shift) & IAX2_TIMER_WHEEL_LN_MASK;
+		if (cur)
+			map = (map >> cur) | (map << (IAX2_TIMER_WHEEL_LN_SIZE - cur));
+		/* The current slot is only cascaded on this tick if the tick is on
+		 * a boundary.  Otherwise, it holds timers for the next turn. */
+		if ((map & 1) && (clk & ((1U << shift) - 1)))
+			map &= ~1ULL;
+		dist = map ? __builtin_ctzll(map) : IAX2_TIMER_WHEEL_LN_SIZE;
+		dist = (((clk >> shift) + dist) << shift) - clk;
+		if (dist < res)
+			res = dist;
+	}
+
+	return clk + res;
+}
+
+unsigned int iax2_timer_wheel::start(iax2_dialog *dialog, struct timeval tv)
+{
+	iax2_timer *timer;
+
+	if (!(timer = alloc()))
+		return 0;
+
+	timer->dialog = dialog;
+	timer->expires = get_tick(tv, true);
+	add(timer);
+	count++;
+
+	return (timer->generation << IAX2_TIMER_INDEX_BITS) | (timer->index + 1);
+}
+
+int iax2_timer_wheel::stop(unsigned int id)
+{
+	unsigned int index = (id & IAX2_TIMER_INDEX_MASK) - 1;
+	iax2_timer *timer;
+
+	if (index >= chunks.size() * IAX2_TIMER_CHUNK_SIZE)
+		return -1;
+
+	timer = &chunks[index / IAX2_TIMER_CHUNK_SIZE][index % IAX2_TIMER_CHUNK_SIZE];
+	if (!timer->list || ((timer->generation << IAX2_TIMER_INDEX_BITS) | (index + 1)) != id)
+		return -1;
+
+	unlink(timer);
+	release(timer);
+	count--;
+
+	return 0;
+}
+
+int iax2_timer_wheel::next_expiry(void)
+{
+	int res;
+
+	if (!list_empty(&expired))
+		return 0;
+	if (!count)
+		return -1;
+
+	res = next_tick() - get_tick(tvnow(), false);
+
+	return (res < 0) ? 0 : res;
+}
+
+iax2_dialog *iax2_timer_wheel::expire(void)
+{
+	iax2_timer *timer;
+	iax2_dialog *dialog;
+	unsigned int now, next;
+
+	for (;;) {
+		if (!list_empty(&expired)) {
+			timer = expired.next;
+			dialog = timer->dialog;
+			unlink(timer);
+			release(timer);
+			count--;
+			return dialog;
+		}
+
+		now = get_tick(tvnow(), false);
+		next = count ? next_tick() : now + 1;
+		if ((int) (next - now) > 0) {
+			/* Nothing happens until after now, so catch up */
+			if ((int) (now - clk) > 0)
+				clk = now;
+			return NULL;
+		}
+
+		clk = next;
+		run_tick();
+	}
+}
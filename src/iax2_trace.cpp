@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2006, Russell Bryant <russell@russellbryant.net> 
+ *
+ * This file is part of LibIAX2xx.
+ *
+ * LibIAX2xx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * LibIAX2xx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LibIAX2xx; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*!
+ * \file
+ * \author Russell Bryant <russell@russellbryant.net>
+ *
+ * \brief IAX2 frame tracing
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+using namespace std;
+
+#include "iax2/iax2_trace.h"
+#include "iax2/iax2_frame.h"
+
+/*! A record in the trace log */
+struct iax2_trace_record {
+	size_t len;
+	char text[IAX2_FRAME_FORMAT_LEN];
+};
+
+/*!
+ * \brief The state of the trace log
+ *
+ * Records are added at head and written out from tail.  A record stays
+ * counted in count until it has been written, so producers never touch a
+ * record that the writer thread is still using.
+ */
+static struct {
+	iax2_trace_record *records;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int count;
+	unsigned int dropped;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/*! Signalled when the writer has emptied the ring */
+	pthread_cond_t empty;
+	pthread_t thread;
+} trace_log;
+
+static pthread_once_t trace_log_once = PTHREAD_ONCE_INIT;
+
+static void *trace_log_thread(void *)
+{
+	for (;;) {
+		unsigned int tail, count, dropped;
+
+		pthread_mutex_lock(&trace_log.lock);
+		while (!trace_log.count)
+			pthread_cond_wait(&trace_log.cond, &trace_log.lock);
+		tail = trace_log.tail;
+		count = trace_log.count;
+		dropped = trace_log.dropped;
+		trace_log.dropped = 0;
+		pthread_mutex_unlock(&trace_log.lock);
+
+		for (unsigned int i = 0; i < count; i++) {
+			iax2_trace_record *record = &trace_log.records[(tail + i) % IAX2_TRACE_LOG_SIZE];
+			fwrite(record->text, 1, record->len, stderr);
+		}
+		if (dropped)
+			fprintf(stderr, "[IAX2-Trace] %u records dropped\n", dropped);
+
+		pthread_mutex_lock(&trace_log.lock);
+		trace_log.tail = (tail + count) % IAX2_TRACE_LOG_SIZE;
+		if (!(trace_log.count -= count))
+			pthread_cond_broadcast(&trace_log.empty);
+		pthread_mutex_unlock(&trace_log.lock);
+	}
+
+	return NULL;
+}
+
+static void trace_log_exit(void)
+{
+	iax2_trace_log::flush();
+}
+
+static void trace_log_init(void)
+{
+	pthread_attr_t attr;
+
+	pthread_mutex_init(&trace_log.lock, NULL);
+	pthread_cond_init(&trace_log.cond, NULL);
+	pthread_cond_init(&trace_log.empty, NULL);
+
+	if (!(trace_log.records = (iax2_trace_record *) calloc(IAX2_TRACE_LOG_SIZE, 
+		sizeof(*trace_log.records)))) {
+		fprintf(stderr, "Unable to allocate the trace log!\n");
+		return;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&trace_log.thread, &attr, trace_log_thread, NULL)) {
+		fprintf(stderr, "Unable to start the trace log thread!\n");
+		free(trace_log.records);
+		trace_log.records = NULL;
+	} else
+		atexit(trace_log_exit);
+	pthread_attr_destroy(&attr);
+}
+
+void iax2_trace_log::write(const char *text, size_t len)
+{
+	iax2_trace_record *record;
+
+	pthread_once(&trace_log_once, trace_log_init);
+
+	if (!trace_log.records)
+		return;
+
+	if (len > sizeof(record->text))
+		len = sizeof(record->text);
+
+	pthread_mutex_lock(&trace_log.lock);
+	if (trace_log.count == IAX2_TRACE_LOG_SIZE) {
+		trace_log.dropped++;
+		pthread_mutex_unlock(&trace_log.lock);
+		return;
+	}
+	record = &trace_log.records[trace_log.head];
+	record->len = len;
+	memcpy(record->text, text, len);
+	trace_log.head = (trace_log.head + 1) % IAX2_TRACE_LOG_SIZE;
+	if (!trace_log.count++)
+		pthread_cond_signal(&trace_log.cond);
+	pthread_mutex_unlock(&trace_log.lock);
+}
+
+void iax2_trace_log::flush(void)
+{
+	pthread_once(&trace_log_once, trace_log_init);
+
+	if (!trace_log.records)
+		return;
+
+	pthread_mutex_lock(&trace_log.lock);
+	while (trace_log.count)
+		pthread_cond_wait(&trace_log.empty, &trace_log.lock);
+	pthread_mutex_unlock(&trace_log.lock);
+}
+
+#define CALL_BITS (sizeof(unsigned int) * 8)
+
+iax2_tracer::iax2_tracer(void) :
+	level(IAX2_TRACE_NONE), num_calls(0)
+{
+	calls = (unsigned int *) calloc(IAX2_TRACE_CALL_NUMS / CALL_BITS, sizeof(*calls));
+}
+
+iax2_tracer::~iax2_tracer(void)
+{
+	free(calls);
+}
+
+void iax2_tracer::add_call(unsigned short num)
+{
+	unsigned int bit = 1U << (num % CALL_BITS);
+
+	if (!calls || num >= IAX2_TRACE_CALL_NUMS)
+		return;
+
+	if (!(__sync_fetch_and_or(&calls[num / CALL_BITS], bit) & bit))
+		__sync_fetch_and_add(&num_calls, 1);
+}
+
+void iax2_tracer::remove_call(unsigned short num)
+{
+	unsigned int bit = 1U << (num % CALL_BITS);
+
+	if (!calls || num >= IAX2_TRACE_CALL_NUMS)
+		return;
+
+	if (__sync_fetch_and_and(&calls[num / CALL_BITS], ~bit) & bit)
+		__sync_fetch_and_sub(&num_calls, 1);
+}
+
+void iax2_tracer::clear_calls(void)
+{
+	for (unsigned short num = 0; calls && num < IAX2_TRACE_CALL_NUMS; num++)
+		remove_call(num);
+}
+
+bool iax2_tracer::call_filtered(unsigned short num) const
+{
+	if (num >= IAX2_TRACE_CALL_NUMS)
+		return false;
+
+	return calls[num / CALL_BITS] & (1U << (num % CALL_BITS));
+}
+
+void iax2_tracer::trace_frame(const iax2_frame &frame, const struct sockaddr_in *sin)
+{
+	char buf[IAX2_FRAME_FORMAT_LEN];
+	size_t len;
+
+	if (level == IAX2_TRACE_FULL_FRAMES && frame.get_shell() != IAX2_FRAME_FULL)
+		return;
+
+	if (num_calls && !call_filtered(frame.get_source_call_num())
+		&& !call_filtered(frame.get_dest_call_num()))
+		return;
+
+	if ((len = frame.format(buf, sizeof(buf), sin)))
+		iax2_trace_log::write(buf, len);
+}
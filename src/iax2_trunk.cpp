@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2006, Russell Bryant <russell@russellbryant.net> 
+ *
+ * This file is part of LibIAX2xx.
+ *
+ * LibIAX2xx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * LibIAX2xx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LibIAX2xx; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*!
+ * \file
+ * \author Russell Bryant <russell@russellbryant.net>
+ *
+ * \brief IAX2 trunking
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include <vector>
+#include <tr1/unordered_map>
+
+using namespace std;
+
+#include "iax2/iax2_trunk.h"
+#include "iax2/iax2_tx_queue.h"
+#include "iax2/iax2_frame.h"
+#include "iax2/time.h"
+
+using namespace iax2xx;
+
+iax2_trunk::iax2_trunk(iax2_tx_queue &queue) :
+	tx_queue(queue), interval(0), timestamps(false)
+{
+	start = tvnow();
+}
+
+iax2_trunk::~iax2_trunk(void)
+{
+	for (buckets_iterator i = buckets.begin(); i != buckets.end(); i++)
+		delete i->second;
+}
+
+void iax2_trunk::set_interval(unsigned int ms)
+{
+	interval = ms;
+	if (!interval)
+		flush();
+}
+
+int iax2_trunk::add(const struct sockaddr_in *sin, unsigned short call_num, 
+	u_int16_t ts, const void *data, size_t len)
+{
+	size_t entry_len = timestamps ? 
+		sizeof(iax2_meta_trunk_mini) + len : sizeof(iax2_meta_trunk_entry) + len;
+	iax2_trunk_bucket *bucket;
+
+	if (sizeof(iax2_meta_trunk_header) + entry_len > IAX2_TRUNK_MAX_LEN)
+		return -1;
+
+	buckets_iterator i = buckets.find(key(sin));
+	if (i == buckets.end()) {
+		// Buckets are never removed while their hosts are quiet, so start
+		// over rather than grow without bound.
+		if (buckets.size() >= IAX2_TRUNK_TABLE_MAX) {
+			flush();
+			for (i = buckets.begin(); i != buckets.end(); i++)
+				delete i->second;
+			buckets.clear();
+		}
+		bucket = new iax2_trunk_bucket;
+		memcpy(&bucket->sin, sin, sizeof(bucket->sin));
+		bucket->len = 0;
+		bucket->pending = false;
+		buckets[key(sin)] = bucket;
+	} else
+		bucket = i->second;
+
+	// A full trunk frame goes out early to make room
+	if (bucket->len + entry_len > IAX2_TRUNK_MAX_LEN)
+		send_bucket(bucket);
+
+	if (!bucket->pending) {
+		if (pending.empty())
+			next_flush = tvadd(tvnow(), samp2tv(interval, 1000));
+		pending.push_back(bucket);
+		bucket->pending = true;
+	}
+	if (!bucket->len)
+		bucket->len = sizeof(iax2_meta_trunk_header);
+
+	if (timestamps) {
+		iax2_meta_trunk_mini *entry = (iax2_meta_trunk_mini *) (bucket->buf + bucket->len);
+		entry->len = htons(len);
+		entry->callno = htons(call_num);
+		entry->ts = htons(ts);
+		memcpy(entry->data, data, len);
+	} else {
+		iax2_meta_trunk_entry *entry = (iax2_meta_trunk_entry *) (bucket->buf + bucket->len);
+		entry->callno = htons(call_num);
+		entry->len = htons(len);
+		memcpy(entry->data, data, len);
+	}
+	bucket->len += entry_len;
+
+	return 0;
+}
+
+int iax2_trunk::next_flush_time(void) const
+{
+	if (pending.empty())
+		return -1;
+
+	int res = tvdiff_ms(next_flush, tvnow());
+
+	return (res < 0) ? 0 : res;
+}
+
+void iax2_trunk::flush(void)
+{
+	for (vector<iax2_trunk_bucket *>::iterator i = pending.begin(); i != pending.end(); i++) {
+		// It may have gone out early already
+		if ((*i)->len)
+			send_bucket(*i);
+		(*i)->pending = false;
+	}
+	pending.clear();
+}
+
+void iax2_trunk::flush(const struct sockaddr_in *sin)
+{
+	buckets_iterator i = buckets.find(key(sin));
+
+	// The bucket stays in the pending list, which skips it once it is empty
+	if (i != buckets.end() && i->second->len)
+		send_bucket(i->second);
+}
+
+void iax2_trunk::send_bucket(iax2_trunk_bucket *bucket)
+{
+	iax2_meta_trunk_header *header = (iax2_meta_trunk_header *) bucket->buf;
+
+	header->zeros = 0;
+	header->metacmd = IAX2_META_CMD_TRUNK;
+	header->cmddata = timestamps ? IAX2_META_TRUNK_TIMESTAMPS : 0;
+	header->ts = htonl(tvdiff_ms(tvnow(), start));
+
+	tx_queue.queue(bucket->buf, bucket->len, &bucket->sin);
+	bucket->len = 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2006, Russell Bryant <russell@russellbryant.net> 
+ *
+ * This file is part of LibIAX2xx.
+ *
+ * LibIAX2xx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * LibIAX2xx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LibIAX2xx; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*!
+ * \file
+ * \author Russell Bryant <russell@russellbryant.net>
+ *
+ * \brief IAX2 transmit queue
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+using namespace std;
+
+#include "iax2/iax2_tx_queue.h"
+
+/* sendmmsg() showed up in Linux 3.0 and glibc 2.14. */
+#if defined(__GLIBC__) && defined(__GLIBC_PREREQ)
+#if __GLIBC_PREREQ(2, 14)
+#define HAVE_SENDMMSG
+#endif
+#endif
+
+/*!
+ * \brief A packet waiting in an iax2_tx_queue
+ */
+struct iax2_tx_queue_entry {
+	struct sockaddr_in sin;
+	struct iovec iov;
+};
+
+iax2_tx_queue::iax2_tx_queue(unsigned int num) :
+	sockfd(-1), tracer(NULL), size(num ? num : 1), count(0)
+{
+	bufs = (unsigned char *) malloc(size * IAX2_TX_QUEUE_MAX_PACKET_LEN);
+	entries = (iax2_tx_queue_entry *) calloc(size, sizeof(*entries));
+}
+
+iax2_tx_queue::~iax2_tx_queue(void)
+{
+	free(bufs);
+	free(entries);
+}
+
+unsigned char *iax2_tx_queue::reserve(size_t len)
+{
+	if (len > IAX2_TX_QUEUE_MAX_PACKET_LEN || !bufs || !entries)
+		return NULL;
+
+	if (count == size)
+		flush();
+
+	return bufs + (count * IAX2_TX_QUEUE_MAX_PACKET_LEN);
+}
+
+void iax2_tx_queue::commit(size_t len, const struct sockaddr_in *sin)
+{
+	iax2_tx_queue_entry *entry = &entries[count++];
+
+	memcpy(&entry->sin, sin, sizeof(entry->sin));
+	entry->iov.iov_base = bufs + ((count - 1) * IAX2_TX_QUEUE_MAX_PACKET_LEN);
+	entry->iov.iov_len = len;
+}
+
+int iax2_tx_queue::queue(const unsigned char *buf, size_t len, const struct sockaddr_in *sin)
+{
+	unsigned char *dst;
+
+	if (!(dst = reserve(len))) {
+		if (sendto(sockfd, buf, len, 0, (const struct sockaddr *) sin, sizeof(*sin)) < 0) {
+			fprintf(stderr, "Error Sending IAX2 Frame: %s\n", strerror(errno));
+			return -1;
+		}
+		return 0;
+	}
+
+	memcpy(dst, buf, len);
+	commit(len, sin);
+
+	return 0;
+}
+
+int iax2_tx_queue::flush(void)
+{
+	int res = 0;
+	unsigned int sent = 0;
+
+	if (!count)
+		return 0;
+
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr *msgs = (struct mmsghdr *) alloca(count * sizeof(*msgs));
+
+	memset(msgs, 0, count * sizeof(*msgs));
+	for (unsigned int i = 0; i < count; i++) {
+		msgs[i].msg_hdr.msg_name = &entries[i].sin;
+		msgs[i].msg_hdr.msg_namelen = sizeof(entries[i].sin);
+		msgs[i].msg_hdr.msg_iov = &entries[i].iov;
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (sent < count) {
+		int num = sendmmsg(sockfd, msgs + sent, count - sent, 0);
+		if (num < 0) {
+			if (errno == EINTR)
+				continue;
+			// Skip the packet that failed, and keep going with the rest.
+			fprintf(stderr, "Error Sending IAX2 Frame: %s\n", strerror(errno));
+			res = -1;
+			num = 1;
+		}
+		sent += num;
+	}
+#else
+	for (; sent < count; sent++) {
+		if (sendto(sockfd, entries[sent].iov.iov_base, entries[sent].iov.iov_len, 0,
+			(const struct sockaddr *) &entries[sent].sin, sizeof(entries[sent].sin)) == -1) {
+			fprintf(stderr, "Error Sending IAX2 Frame: %s\n", strerror(errno));
+			res = -1;
+		}
+	}
+#endif
+
+	count = 0;
+
+	return res;
+}
@@ -308,6 +308,8 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
+	frame.print(&remote_addr);
+
 	if (frame.send(&remote_addr, sockfd)) {
 		fprintf(stderr, "Error sending packet!\n");
 		exit(1);
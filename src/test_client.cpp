@@ -60,6 +60,7 @@ static void *run_client(void *data)
 	iax2_client client(DEFAULT_IAX2_PORT + 1);
 	args->client = &client;
 	client.register_event_handler(iax2_event_dispatcher);
+	client.get_tracer().set_level(IAX2_TRACE_ALL_FRAMES);
 	client.add_outbound_registration("test_client", "127.0.0.1", DEFAULT_IAX2_PORT);
 	client.set_capabilities(IAX2_FORMAT_SLINEAR | IAX2_FORMAT_ULAW | IAX2_FORMAT_ALAW);
 	args->res = client.run(&args->cond, &args->cond_lock);
@@ -86,6 +87,13 @@ int main(int argc, char *argv[])
 	args.client->send_command(new iax2_command(IAX2_COMMAND_TYPE_VIDEO, call_num,
 		fake_image, sizeof(fake_image)));
 
+	unsigned char fake_audio[160] = { 0, };
+	for (int i = 0; i < 3; i++) {
+		args.client->send_command(new iax2_command(IAX2_COMMAND_TYPE_AUDIO, call_num,
+			fake_audio, sizeof(fake_audio)));
+		usleep(20000);
+	}
+
 	pthread_join(client_thread, NULL);
 
 	exit(args.res);
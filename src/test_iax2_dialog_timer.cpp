@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <time.h>
 
 using namespace std;
 
@@ -45,6 +46,7 @@ public:
 	~iax2_test_timer(void) {};
 
 	int run_test(void);
+	int run_scale_test(void);
 
 protected:
 	virtual void process_incoming_frame(iax2_frame &frame, const struct sockaddr_in *sin) {}
@@ -94,6 +96,189 @@ enum iax2_dialog_result iax2_fake_dialog::timer_callback(void)
 	return IAX2_DIALOG_RESULT_SUCCESS;
 }
 
+/*! The number of timers started by the scale test */
+#define SCALE_TEST_TIMERS 20000
+
+/*! The scale test timers expire within this many milliseconds */
+#define SCALE_TEST_SPAN 3000
+
+/*!
+ * \brief A dialog that checks the order that its timer expires in
+ */
+class iax2_order_dialog : public iax2_dialog {
+public:
+	iax2_order_dialog(unsigned int ms, struct timeval tv);
+	virtual ~iax2_order_dialog(void);
+
+	virtual enum iax2_dialog_result process_frame(iax2_frame &frame, const struct sockaddr_in *sin)
+		{ return IAX2_DIALOG_RESULT_SUCCESS; }
+	virtual enum iax2_command_result process_command(iax2_command &command)
+		{ return IAX2_COMMAND_RESULT_UNSUPPORTED; }
+
+	virtual enum iax2_dialog_result timer_callback(void);
+
+	/*! The offset in milliseconds from the start of the test */
+	unsigned int ms;
+	struct timeval expires;
+	bool stopped;
+	bool fired;
+
+	static unsigned int last_ms;
+	static unsigned int num_fired;
+	static unsigned int failures;
+};
+
+unsigned int iax2_order_dialog::last_ms = 0;
+unsigned int iax2_order_dialog::num_fired = 0;
+unsigned int iax2_order_dialog::failures = 0;
+
+iax2_order_dialog::iax2_order_dialog(unsigned int offset, struct timeval tv) :
+	iax2_dialog(NULL, 0, 0), ms(offset), expires(tv), stopped(false), fired(false)
+{
+}
+
+iax2_order_dialog::~iax2_order_dialog(void)
+{
+}
+
+enum iax2_dialog_result iax2_order_dialog::timer_callback(void)
+{
+	struct timeval now = tvnow();
+
+	if (stopped) {
+		printf("Timer at %u ms fired after it was stopped\n", ms);
+		failures++;
+	}
+	if (fired) {
+		printf("Timer at %u ms fired twice\n", ms);
+		failures++;
+	}
+	if (ms < last_ms) {
+		printf("Timer at %u ms fired after the timer at %u ms\n", ms, last_ms);
+		failures++;
+	}
+	if (now.tv_sec < expires.tv_sec || 
+		(now.tv_sec == expires.tv_sec && now.tv_usec < expires.tv_usec)) {
+		printf("Timer at %u ms fired %d ms early\n", ms, tvdiff_ms(expires, now));
+		failures++;
+	}
+
+	fired = true;
+	last_ms = ms;
+	num_fired++;
+
+	return IAX2_DIALOG_RESULT_SUCCESS;
+}
+
+int iax2_test_timer::run_scale_test(void)
+{
+	iax2_order_dialog *dialogs[SCALE_TEST_TIMERS];
+	unsigned int ids[SCALE_TEST_TIMERS];
+	unsigned int i, ms, expected = 0;
+	struct timeval start;
+	int next;
+
+	srandom(time(NULL));
+	start = tvnow();
+
+	/* Most of the timers are within the first few seconds, but some are far
+	 * enough out to land in the outer levels of the wheel.  All of those are
+	 * stopped before they expire. */
+	for (i = 0; i < SCALE_TEST_TIMERS; i++) {
+		if (i % 100)
+			ms = random() % SCALE_TEST_SPAN;
+		else
+			ms = SCALE_TEST_SPAN + random() % (3600 * 1000);
+		dialogs[i] = new iax2_order_dialog(ms, tvadd(start, samp2tv(ms, 1000)));
+		if (!(ids[i] = start_timer(dialogs[i], dialogs[i]->expires))) {
+			printf("Failed to start timer %u\n", i);
+			iax2_order_dialog::failures++;
+		}
+	}
+
+	for (i = 0; i < SCALE_TEST_TIMERS; i++) {
+		if ((i % 2) && dialogs[i]->ms < SCALE_TEST_SPAN)
+			continue;
+		dialogs[i]->stopped = true;
+		if (stop_timer(ids[i])) {
+			printf("Failed to stop timer %u\n", i);
+			iax2_order_dialog::failures++;
+		}
+		if (!stop_timer(ids[i])) {
+			printf("Stopped timer %u twice\n", i);
+			iax2_order_dialog::failures++;
+		}
+	}
+
+	for (i = 0; i < SCALE_TEST_TIMERS; i++) {
+		if (!dialogs[i]->stopped)
+			expected++;
+	}
+
+	while ((next = next_callback_time()) >= 0) {
+		if (next > 0)
+			usleep(next * 1000);
+		run_callbacks();
+	}
+
+	if (iax2_order_dialog::num_fired != expected) {
+		printf("%u timers fired, expected %u\n", iax2_order_dialog::num_fired, expected);
+		iax2_order_dialog::failures++;
+	}
+
+	/* The ids of expired timers must not stop the timers that reuse them */
+	for (i = 0; i < SCALE_TEST_TIMERS; i++) {
+		if (!dialogs[i]->stopped && !stop_timer(ids[i])) {
+			printf("Stopped expired timer %u\n", i);
+			iax2_order_dialog::failures++;
+		}
+		delete dialogs[i];
+	}
+
+	printf("Scale test: %u timers, %u fired, %u stopped: %s\n", SCALE_TEST_TIMERS,
+		iax2_order_dialog::num_fired, SCALE_TEST_TIMERS - expected,
+		iax2_order_dialog::failures ? "FAIL" : "PASS");
+
+	return iax2_order_dialog::failures ? -1 : 0;
+}
+
+/*!
+ * \brief Check that mini frame timestamps are rebuilt right around a wrap
+ *
+ * The frames arrive out of order, so some from before the wrap come after
+ * the full timestamp has already moved past it.
+ */
+static int run_unwrap_test(void)
+{
+	static const struct {
+		u_int32_t last;
+		unsigned short ts16;
+		u_int32_t expected;
+	} checks[] = {
+		{ 0x00001000, 0x1014, 0x00001014 },
+		{ 0x0000FFF0, 0x000E, 0x0001000E },
+		{ 0x0001000E, 0xFFFA, 0x0000FFFA },
+		{ 0x0001000E, 0x0022, 0x00010022 },
+		{ 0x0001000E, 0x0004, 0x00010004 },
+		{ 0x0000FFFA, 0x0022, 0x00010022 },
+		{ 0x00000010, 0xFFF0, 0x0000FFF0 },
+	};
+	unsigned int i, failures = 0;
+
+	for (i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+		u_int32_t ts = iax2_call_dialog::unwrap_mini_ts(checks[i].last, checks[i].ts16);
+		if (ts != checks[i].expected) {
+			printf("Timestamp %04x after %08x became %08x instead of %08x\n",
+				checks[i].ts16, checks[i].last, ts, checks[i].expected);
+			failures++;
+		}
+	}
+
+	printf("Unwrap test: %u checks: %s\n", i, failures ? "FAIL" : "PASS");
+
+	return failures ? -1 : 0;
+}
+
 int iax2_test_timer::run_test(void)
 {
 	int next, remove;
@@ -127,11 +312,20 @@ int main(int argc, char *argv[])
 		"Hello!   <---- immediately\n"
 		"Hello!   <---- about 1 seconds from now\n"
 		"Hello!   <---- about 2 seconds from now\n"
-		"Hello!   <---- about 3 seconds from now\n\n\n");
+		"Hello!   <---- about 3 seconds from now\n\n"
+		"Then, twenty thousand timers are started and half are stopped.  The test\n"
+		"checks that the rest expire in order, and prints PASS or FAIL.  Last,\n"
+		"the timestamps of mini frames are checked around a wrap.\n\n\n");
 
 	int res = test.run_test();
 
 	printf("\n");
 
-	exit(res);
+	if (!res)
+		res = test.run_scale_test();
+
+	if (!res)
+		res = run_unwrap_test();
+
+	exit(res ? 1 : 0);
 }
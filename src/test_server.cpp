@@ -61,6 +61,7 @@ static void *run_server(void *data)
 	iax2_server server(DEFAULT_IAX2_PORT);
 	args->server = &server;
 	server.register_event_handler(iax2_event_dispatcher);
+	server.get_tracer().set_level(IAX2_TRACE_ALL_FRAMES);
 	args->res = server.run(&args->cond, &args->cond_lock);
 
 	return NULL;